@@ -0,0 +1,145 @@
+/*
+ * bench-bootinfo.c
+ *
+ * Benchmarks for the boot information block
+ * functions. The library source is included directly
+ * so the storage layer can be pointed at a memory-backed
+ * device and a private lock directory instead of the
+ * real boot device.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include "../bootinfo.c"
+#include "bench.h"
+
+struct bootinfo_arg_s {
+	char path[64];
+	struct storage_layout_s layout;
+	bootinfo_context_t *ctx;
+	char name[32];
+};
+
+static void
+run_bootinfo_open (void *arg)
+{
+	struct bootinfo_arg_s *ba = arg;
+	bootinfo_context_t *ctx;
+
+	if (open_storage(BOOTINFO_O_RDONLY, &ba->layout, NULL, &ctx) < 0) {
+		perror("open_storage");
+		exit(1);
+	}
+	bootinfo_close(ctx);
+}
+
+static void
+run_bootinfo_var_get (void *arg)
+{
+	struct bootinfo_arg_s *ba = arg;
+	char valbuf[64];
+
+	if (bootinfo_var_get(ba->ctx, ba->name, valbuf, sizeof(valbuf)) < 0) {
+		perror("bootinfo_var_get");
+		exit(1);
+	}
+}
+
+static void
+run_bootinfo_var_set (void *arg)
+{
+	struct bootinfo_arg_s *ba = arg;
+
+	if (bootinfo_var_set(ba->ctx, "bench_var", "1") < 0 ||
+	    bootinfo_var_set(ba->ctx, "bench_var", NULL) < 0) {
+		perror("bootinfo_var_set");
+		exit(1);
+	}
+}
+
+/*
+ * populate_vars
+ *
+ * Reinitializes the bootinfo storage and fills
+ * it with the specified number of variables.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+populate_vars (const struct storage_layout_s *layout, unsigned int count)
+{
+	bootinfo_context_t *ctx;
+	char name[32];
+	unsigned int i;
+
+	if (open_storage(BOOTINFO_O_RDWR|BOOTINFO_O_CREAT|BOOTINFO_O_FORCE_INIT, layout, NULL, &ctx) < 0)
+		return -1;
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "v%u", i);
+		if (bootinfo_var_set(ctx, name, "1") < 0) {
+			bootinfo_close(ctx);
+			return -1;
+		}
+	}
+	return bootinfo_close(ctx);
+
+} /* populate_vars */
+
+/*
+ * bench_bootinfo
+ *
+ * Runs the bootinfo benchmarks.
+ */
+void
+bench_bootinfo (void)
+{
+	static const unsigned int counts[] = { 0, 10, 100, 1000 };
+	static char lockdir[] = "/tmp/bench-bootinfo-XXXXXX";
+	struct bootinfo_arg_s ba;
+	char name[64];
+	unsigned int i;
+	int fd;
+
+	if (mkdtemp(lockdir) == NULL) {
+		perror("mkdtemp");
+		return;
+	}
+	bootinfo_lockdir = lockdir;
+	fd = bench_memdev("bootinfo-device", 1024 * 1024, ba.path, sizeof(ba.path));
+	if (fd < 0) {
+		perror("bench_memdev");
+		rmdir(lockdir);
+		return;
+	}
+	if (legacy_layout(0x18, ba.path, &ba.layout) < 0) {
+		perror("legacy_layout");
+		close(fd);
+		rmdir(lockdir);
+		return;
+	}
+	for (i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+		if (populate_vars(&ba.layout, counts[i]) < 0) {
+			fprintf(stderr, "bootinfo: could not store %u variables: %s\n",
+				counts[i], strerror(errno));
+			break;
+		}
+		snprintf(name, sizeof(name), "bootinfo/open+close/%u", counts[i]);
+		bench_run(name, run_bootinfo_open, &ba);
+		if (counts[i] == 0)
+			continue;
+		if (open_storage(BOOTINFO_O_RDWR, &ba.layout, NULL, &ba.ctx) < 0) {
+			perror("open_storage");
+			break;
+		}
+		snprintf(ba.name, sizeof(ba.name), "v%u", counts[i] - 1);
+		snprintf(name, sizeof(name), "bootinfo/var_get/%u", counts[i]);
+		bench_run(name, run_bootinfo_var_get, &ba);
+		snprintf(name, sizeof(name), "bootinfo/var_set+delete/%u", counts[i]);
+		bench_run(name, run_bootinfo_var_set, &ba);
+		bootinfo_close(ba.ctx);
+	}
+	close(fd);
+	snprintf(name, sizeof(name), "%s/lockfile", lockdir);
+	unlink(name);
+	rmdir(lockdir);
+
+} /* bench_bootinfo */
@@ -0,0 +1,212 @@
+/*
+ * bench-bup.c
+ *
+ * Benchmarks for the BUP payload parsing and
+ * TNSPEC matching functions. The library source is
+ * included directly so the internal spec-handling
+ * helpers can be measured on their own.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include "../bup.c"
+#include "bench.h"
+
+static const char *other_specs[] = {
+	"",
+	"2888-400-0004-K.0-1-2-jetson-agx-xavier-mmcblk0p1",
+	"3448-200-0000-B.0-1-0-jetson-nano-2gb-devkit-mmcblk0p1",
+};
+
+struct spec_arg_s {
+	const char *specstr;
+	struct tnspec_s tnspec;
+	struct tnspec_s other;
+	char compatstr[128];
+	struct tnspec_s compat;
+};
+
+static void
+run_spec_split (void *arg)
+{
+	struct spec_arg_s *sa = arg;
+
+	spec_split(sa->specstr, &sa->tnspec);
+}
+
+static void
+run_specs_match (void *arg)
+{
+	struct spec_arg_s *sa = arg;
+	volatile bool match __attribute__((unused));
+
+	match = specs_match(&sa->other, &sa->tnspec);
+}
+
+static void
+run_generate_compat_spec (void *arg)
+{
+	struct spec_arg_s *sa = arg;
+
+	generate_compat_spec(&sa->tnspec, &sa->compat, sa->compatstr, sizeof(sa->compatstr));
+}
+
+/*
+ * make_payload
+ *
+ * Builds a synthetic BUP payload in a memory-backed
+ * file. Entries are spread across 40 partition names,
+ * with a mix of specs that match the running system,
+ * are common to all systems, or are for other boards,
+ * so that enumeration exercises the matching logic
+ * the same way a real multi-board payload does.
+ *
+ * Parameters:
+ *  ourspec: TNSPEC string for the running system
+ *  entry_count: number of entries to generate
+ *  pathbuf: buffer to receive the pathname of the payload
+ *  pathbufsize: size of pathbuf
+ *
+ * Returns: open file descriptor, or -1 on error
+ */
+static int
+make_payload (const char *ourspec, unsigned int entry_count, char *pathbuf, size_t pathbufsize)
+{
+	static const size_t entry_data_size = 64;
+	struct bup_header_s hdr;
+	struct bup_ods_entry_s ent;
+	uint8_t data[64];
+	const char *spec;
+	size_t dataoff;
+	unsigned int i;
+	int fd;
+
+	fd = bench_memdev("bup-payload", 0, pathbuf, pathbufsize);
+	if (fd < 0)
+		return -1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, bup_magic, sizeof(hdr.magic));
+	hdr.version = (expected_major_version << 16);
+	hdr.header_size = sizeof(hdr);
+	hdr.entry_count = entry_count;
+	dataoff = sizeof(hdr) + entry_count * sizeof(ent);
+	hdr.blob_size = dataoff + entry_count * entry_data_size;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto fail;
+	for (i = 0; i < entry_count; i++) {
+		memset(&ent, 0, sizeof(ent));
+		snprintf(ent.partition, sizeof(ent.partition), "part%02u", i % 40);
+		spec = (i % 4 == 0 ? ourspec : other_specs[i % 4 - 1]);
+		memcpy(ent.spec, spec, strnlen(spec, sizeof(ent.spec)));
+		ent.offset = dataoff + i * entry_data_size;
+		ent.length = entry_data_size;
+		ent.op_mode = OP_MODE_PRODUCTION;
+		if (write(fd, &ent, sizeof(ent)) != sizeof(ent))
+			goto fail;
+	}
+	memset(data, 0x5a, sizeof(data));
+	for (i = 0; i < entry_count; i++)
+		if (write(fd, data, entry_data_size) != entry_data_size)
+			goto fail;
+	return fd;
+fail:
+	close(fd);
+	return -1;
+
+} /* make_payload */
+
+struct payload_arg_s {
+	char path[64];
+	bup_context_t *ctx;
+};
+
+static void
+run_bup_init (void *arg)
+{
+	struct payload_arg_s *pa = arg;
+	bup_context_t *ctx;
+
+	ctx = bup_init(pa->path);
+	if (ctx == NULL) {
+		perror(pa->path);
+		exit(1);
+	}
+	bup_finish(ctx);
+}
+
+static void
+run_bup_enumerate (void *arg)
+{
+	struct payload_arg_s *pa = arg;
+	void *iterctx = NULL;
+	const char *partname;
+	off_t offset;
+	size_t length;
+	unsigned int version;
+
+	while (bup_enumerate_entries(pa->ctx, &iterctx, &partname, &offset, &length, &version));
+}
+
+static void
+run_bup_find_missing (void *arg)
+{
+	struct payload_arg_s *pa = arg;
+	const char *missing[32];
+
+	if (bup_find_missing_entries(pa->ctx, missing, sizeof(missing)/sizeof(missing[0])) < 0) {
+		fprintf(stderr, "bup_find_missing_entries failed\n");
+		exit(1);
+	}
+}
+
+/*
+ * bench_bup
+ *
+ * Runs the BUP payload benchmarks.
+ */
+void
+bench_bup (void)
+{
+	static const unsigned int counts[] = { 10, 100, 1000, 10000 };
+	struct spec_arg_s sa;
+	struct payload_arg_s pa;
+	bup_context_t *basectx;
+	char name[64];
+	unsigned int i;
+	int fd;
+
+	basectx = bup_init(NULL);
+	if (basectx == NULL) {
+		perror("bup_init (check " XQUOTE(CONFIGPATH) " contents)");
+		return;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.specstr = bup_tnspec(basectx);
+	spec_split(other_specs[1], &sa.other);
+	bench_run("bup/spec_split", run_spec_split, &sa);
+	bench_run("bup/specs_match", run_specs_match, &sa);
+	bench_run("bup/generate_compat_spec", run_generate_compat_spec, &sa);
+
+	for (i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+		fd = make_payload(bup_tnspec(basectx), counts[i], pa.path, sizeof(pa.path));
+		if (fd < 0) {
+			perror("make_payload");
+			break;
+		}
+		snprintf(name, sizeof(name), "bup/bup_init/%u", counts[i]);
+		bench_run(name, run_bup_init, &pa);
+		pa.ctx = bup_init(pa.path);
+		if (pa.ctx == NULL) {
+			perror(pa.path);
+			close(fd);
+			break;
+		}
+		snprintf(name, sizeof(name), "bup/enumerate_entries/%u", counts[i]);
+		bench_run(name, run_bup_enumerate, &pa);
+		snprintf(name, sizeof(name), "bup/find_missing_entries/%u", counts[i]);
+		bench_run(name, run_bup_find_missing, &pa);
+		bup_finish(pa.ctx);
+		close(fd);
+	}
+	bup_finish(basectx);
+
+} /* bench_bup */
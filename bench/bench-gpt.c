@@ -0,0 +1,175 @@
+/*
+ * bench-gpt.c
+ *
+ * Benchmarks for GPT loading/lookup and slot
+ * metadata handling, run against a memory-backed
+ * device holding a synthetic partition table.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include "../gpt.c"
+#include "smd.h"
+#include "bench.h"
+
+#define BENCH_GPT_PARTS		64U
+#define BENCH_GPT_PARTBLOCKS	16U
+
+/*
+ * make_gpt_device
+ *
+ * Writes a boot-device pseudo-GPT (backup copy only, as
+ * used on the Tegra boot partitions) with BENCH_GPT_PARTS
+ * entries, the last two being SMD and SMD_b, to a memory-backed
+ * device, followed by a fresh copy of the slot metadata.
+ *
+ * Parameters:
+ *  pathbuf: buffer to receive the pathname of the device
+ *  pathbufsize: size of pathbuf
+ *
+ * Returns: open file descriptor, or -1 on error
+ */
+static int
+make_gpt_device (char *pathbuf, size_t pathbufsize)
+{
+	gpt_context_t *ctx;
+	smd_context_t *smd;
+	struct gpt_entry_s *ent;
+	unsigned int i;
+	int fd;
+
+	fd = bench_memdev("gpt-device", 4 * 1024 * 1024, pathbuf, pathbufsize);
+	if (fd < 0)
+		return -1;
+	ctx = gpt_init(pathbuf, 512, GPT_INIT_FOR_WRITING);
+	if (ctx == NULL)
+		goto fail;
+	ctx->entry_count = MAX_CONFIG_ENTRIES;
+	ctx->entries = calloc(ctx->entry_count, sizeof(struct gpt_entry_s));
+	if (ctx->entries == NULL)
+		goto fail;
+	for (i = 0, ent = ctx->entries; i < BENCH_GPT_PARTS; i++, ent++) {
+		if (i == BENCH_GPT_PARTS - 2)
+			strcpy(ent->part_name, "SMD");
+		else if (i == BENCH_GPT_PARTS - 1)
+			strcpy(ent->part_name, "SMD_b");
+		else
+			snprintf(ent->part_name, sizeof(ent->part_name), "part%02u", i);
+		memcpy(ent->type_guid, default_type_guid, sizeof(ent->type_guid));
+		uuid_generate_random((void *) (ent->part_guid));
+		ent->first_lba = GPT_SIZE_IN_BLOCKS + 2 + i * BENCH_GPT_PARTBLOCKS;
+		ent->last_lba = ent->first_lba + BENCH_GPT_PARTBLOCKS - 1;
+	}
+	ctx->entries_used = BENCH_GPT_PARTS;
+	if (gpt_save(ctx, GPT_BACKUP_ONLY|GPT_NVIDIA_SPECIAL) < 0)
+		goto fail;
+	smd = smd_new(REDUNDANCY_BOOTLOADER_ONLY);
+	if (smd == NULL)
+		goto fail;
+	if (smd_update(smd, ctx, fd, true) < 0) {
+		smd_finish(smd);
+		goto fail;
+	}
+	smd_finish(smd);
+	gpt_finish(ctx);
+	return fd;
+fail:
+	if (ctx != NULL)
+		gpt_finish(ctx);
+	close(fd);
+	return -1;
+
+} /* make_gpt_device */
+
+struct gpt_arg_s {
+	char path[64];
+	int fd;
+	gpt_context_t *ctx;
+	smd_context_t *smd;
+};
+
+static void
+run_gpt_load (void *arg)
+{
+	struct gpt_arg_s *ga = arg;
+
+	if (gpt_load(ga->ctx, GPT_BACKUP_ONLY|GPT_NVIDIA_SPECIAL) < 0) {
+		fprintf(stderr, "gpt_load failed\n");
+		exit(1);
+	}
+}
+
+static void
+run_gpt_find_by_name (void *arg)
+{
+	struct gpt_arg_s *ga = arg;
+
+	if (gpt_find_by_name(ga->ctx, "SMD_b") == NULL) {
+		fprintf(stderr, "gpt_find_by_name failed\n");
+		exit(1);
+	}
+}
+
+static void
+run_smd_init (void *arg)
+{
+	struct gpt_arg_s *ga = arg;
+	smd_context_t *smd;
+
+	smd = smd_init(ga->ctx, ga->fd);
+	if (smd == NULL) {
+		perror("smd_init");
+		exit(1);
+	}
+	smd_finish(smd);
+}
+
+static void
+run_smd_update (void *arg)
+{
+	struct gpt_arg_s *ga = arg;
+
+	if (smd_update(ga->smd, ga->ctx, ga->fd, true) < 0) {
+		perror("smd_update");
+		exit(1);
+	}
+}
+
+/*
+ * bench_gpt_smd
+ *
+ * Runs the GPT and slot metadata benchmarks.
+ */
+void
+bench_gpt_smd (void)
+{
+	struct gpt_arg_s ga;
+
+	ga.fd = make_gpt_device(ga.path, sizeof(ga.path));
+	if (ga.fd < 0) {
+		perror("make_gpt_device");
+		return;
+	}
+	ga.ctx = gpt_init(ga.path, 512, 0);
+	if (ga.ctx == NULL) {
+		perror(ga.path);
+		close(ga.fd);
+		return;
+	}
+	if (gpt_load(ga.ctx, GPT_BACKUP_ONLY|GPT_NVIDIA_SPECIAL) < 0) {
+		fprintf(stderr, "%s: could not load GPT\n", ga.path);
+		gpt_finish(ga.ctx);
+		close(ga.fd);
+		return;
+	}
+	bench_run("gpt/gpt_load", run_gpt_load, &ga);
+	bench_run("gpt/gpt_find_by_name", run_gpt_find_by_name, &ga);
+	bench_run("smd/smd_init", run_smd_init, &ga);
+	ga.smd = smd_init(ga.ctx, ga.fd);
+	if (ga.smd != NULL) {
+		bench_run("smd/smd_update", run_smd_update, &ga);
+		smd_finish(ga.smd);
+	}
+	gpt_finish(ga.ctx);
+	close(ga.fd);
+
+} /* bench_gpt_smd */
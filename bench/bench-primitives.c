@@ -0,0 +1,384 @@
+/*
+ * bench-primitives.c
+ *
+ * Micro-benchmarks for the tegra-boot-tools library
+ * primitives. Each benchmark is run repeatedly until
+ * a minimum amount of wall-clock time has elapsed, and
+ * the average time and number of heap allocations per
+ * operation are reported.
+ *
+ * Allocations are counted by wrapping the allocator
+ * entry points at link time (-Wl,--wrap=...), so only
+ * allocations made directly by the library sources
+ * linked into this program are counted.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "bench.h"
+#include "posix-crc32.h"
+#include "ver.h"
+#include "util.h"
+#include "blkcache.h"
+
+static unsigned long alloc_count;
+static uint64_t min_runtime_ns = 200000000ULL;
+static const char *name_filter;
+
+static struct option options[] = {
+	{ "filter",		required_argument,	0, 'f' },
+	{ "time",		required_argument,	0, 't' },
+	{ "help",		no_argument,		0, 'h' },
+	{ 0,			0,			0, 0   }
+};
+static const char *shortopts = ":f:t:h";
+
+static char *optarghelp[] = {
+	"--filter             ",
+	"--time               ",
+	"--help               ",
+};
+
+static char *opthelp[] = {
+	"run only benchmarks whose names contain this string",
+	"minimum run time per benchmark, in milliseconds (default 200)",
+	"display this help text",
+};
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+char *__real_strdup(const char *s);
+
+void *
+__wrap_malloc (size_t size)
+{
+	alloc_count += 1;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc (size_t nmemb, size_t size)
+{
+	alloc_count += 1;
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+	alloc_count += 1;
+	return __real_realloc(ptr, size);
+}
+
+int
+__wrap_posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+	alloc_count += 1;
+	return __real_posix_memalign(memptr, alignment, size);
+}
+
+char *
+__wrap_strdup (const char *s)
+{
+	alloc_count += 1;
+	return __real_strdup(s);
+}
+
+static void
+print_usage (void)
+{
+	int i;
+	printf("\nUsage:\n");
+	printf("\tbench-primitives <option>\n\n");
+	printf("Options:\n");
+	for (i = 0; i < sizeof(options)/sizeof(options[0]) && options[i].name != 0; i++) {
+		printf(" %s\t%c%c\t%s\n",
+		       optarghelp[i],
+		       (options[i].val == 0 ? ' ' : '-'),
+		       (options[i].val == 0 ? ' ' : options[i].val),
+		       opthelp[i]);
+	}
+
+} /* print_usage */
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+} /* now_ns */
+
+/*
+ * bench_run
+ *
+ * Runs a benchmark function in batches, doubling the
+ * batch size until a single batch takes at least the
+ * minimum run time, then reports the per-operation
+ * time and allocation count for that batch.
+ *
+ * Parameters:
+ *  name: name of the benchmark, for reporting and filtering
+ *  fn:   function to run; one call is one operation
+ *  arg:  argument to pass to fn
+ *
+ * Returns: nothing
+ */
+void
+bench_run (const char *name, bench_fn_t fn, void *arg)
+{
+	unsigned long iterations, i, allocs;
+	uint64_t start, elapsed;
+
+	if (name_filter != NULL && strstr(name, name_filter) == NULL)
+		return;
+
+	for (iterations = 1;; iterations *= 2) {
+		alloc_count = 0;
+		start = now_ns();
+		for (i = 0; i < iterations; i++)
+			fn(arg);
+		elapsed = now_ns() - start;
+		allocs = alloc_count;
+		if (elapsed >= min_runtime_ns || iterations >= (1UL << 30))
+			break;
+	}
+	printf("%-44s %10lu %14.1f ns/op %8.2f allocs/op\n", name, iterations,
+	       (double) elapsed / iterations, (double) allocs / iterations);
+
+} /* bench_run */
+
+/*
+ * bench_memdev
+ *
+ * Creates a zero-filled, memory-backed file to stand in
+ * for a storage device, so the library functions can be
+ * exercised without touching real hardware.
+ *
+ * Parameters:
+ *  name: name for the memfd (informational only)
+ *  size: size of the device, in bytes
+ *  pathbuf: buffer to receive a pathname for the device
+ *  pathbufsize: size of pathbuf
+ *
+ * Returns: open file descriptor, or -1 on error
+ */
+int
+bench_memdev (const char *name, size_t size, char *pathbuf, size_t pathbufsize)
+{
+	int fd;
+
+	fd = memfd_create(name, 0);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	snprintf(pathbuf, pathbufsize, "/proc/self/fd/%d", fd);
+	return fd;
+
+} /* bench_memdev */
+
+struct crc_arg_s {
+	void *buf;
+	size_t len;
+};
+
+static void
+run_posix_crc32 (void *arg)
+{
+	struct crc_arg_s *ca = arg;
+	volatile uint32_t crc __attribute__((unused));
+
+	crc = posix_crc32(ca->buf, ca->len);
+}
+
+static void
+run_zlib_crc32 (void *arg)
+{
+	struct crc_arg_s *ca = arg;
+	volatile uint32_t crc __attribute__((unused));
+
+	crc = crc32(0, ca->buf, ca->len);
+}
+
+static void
+bench_crc (void)
+{
+	static const size_t sizes[] = { 512, 4096, 1024*1024 };
+	struct crc_arg_s ca;
+	char name[64];
+	unsigned int i;
+
+	ca.buf = malloc(sizes[sizeof(sizes)/sizeof(sizes[0])-1]);
+	if (ca.buf == NULL) {
+		perror("malloc");
+		return;
+	}
+	memset(ca.buf, 0xa5, sizes[sizeof(sizes)/sizeof(sizes[0])-1]);
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		ca.len = sizes[i];
+		snprintf(name, sizeof(name), "posix_crc32/%zu", sizes[i]);
+		bench_run(name, run_posix_crc32, &ca);
+		snprintf(name, sizeof(name), "zlib_crc32/%zu", sizes[i]);
+		bench_run(name, run_zlib_crc32, &ca);
+	}
+	free(ca.buf);
+
+} /* bench_crc */
+
+static void
+run_block_is_zero (void *arg)
+{
+	struct crc_arg_s *ca = arg;
+
+	if (!block_is_zero(ca->buf, ca->len)) {
+		fprintf(stderr, "block_is_zero: unexpected non-zero result\n");
+		exit(1);
+	}
+}
+
+static void
+bench_zero_scan (void)
+{
+	struct crc_arg_s ca;
+
+	ca.len = 1024 * 1024;
+	ca.buf = calloc(1, ca.len);
+	if (ca.buf == NULL) {
+		perror("calloc");
+		return;
+	}
+	bench_run("block_is_zero/1048576", run_block_is_zero, &ca);
+	free(ca.buf);
+
+} /* bench_zero_scan */
+
+struct cache_arg_s {
+	int fd;
+	uint8_t buf[512];
+};
+
+static void
+run_cached_read (void *arg)
+{
+	struct cache_arg_s *ca = arg;
+
+	if (blkcache_pread(ca->fd, ca->buf, sizeof(ca->buf), 4096) != sizeof(ca->buf)) {
+		perror("blkcache_pread");
+		exit(1);
+	}
+}
+
+static void
+bench_blkcache (void)
+{
+	struct cache_arg_s ca;
+	char pathname[64];
+
+	ca.fd = bench_memdev("blkcache", 1024 * 1024, pathname, sizeof(pathname));
+	if (ca.fd < 0) {
+		perror("bench_memdev");
+		return;
+	}
+	bench_run("blkcache_pread/512/uncached", run_cached_read, &ca);
+	blkcache_set_limit(1024 * 1024);
+	bench_run("blkcache_pread/512/cached", run_cached_read, &ca);
+	blkcache_set_limit(0);
+	close(ca.fd);
+
+} /* bench_blkcache */
+
+struct ver_arg_s {
+	char buf[512];
+	size_t len;
+};
+
+static void
+run_ver_extract_info (void *arg)
+{
+	struct ver_arg_s *va = arg;
+	ver_info_t ver;
+
+	if (ver_extract_info(va->buf, va->len, &ver) != 0) {
+		perror("ver_extract_info");
+		exit(1);
+	}
+}
+
+static void
+bench_ver (void)
+{
+	struct ver_arg_s va;
+	int n;
+
+	n = snprintf(va.buf, sizeof(va.buf), "NV3\n# R32 , REVISION: 7.3\n"
+		     "BOARDID=3668 BOARDSKU=0001 FAB=100 BOARDREV=B.0 CHIPREV=2 fuselevel_s=1\n"
+		     "20230101120000\n");
+	snprintf(va.buf + n, sizeof(va.buf) - n, "BYTES:%d CRC32:%u\n", n, posix_crc32(va.buf, n));
+	va.len = strlen(va.buf);
+	bench_run("ver_extract_info", run_ver_extract_info, &va);
+
+} /* bench_ver */
+
+/*
+ * main program
+ */
+int
+main (int argc, char * const argv[])
+{
+	int c, which;
+
+	for (;;) {
+		c = getopt_long_only(argc, argv, shortopts, options, &which);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				print_usage();
+				return 0;
+			case 'f':
+				name_filter = optarg;
+				break;
+			case 't':
+				min_runtime_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+				if (min_runtime_ns == 0) {
+					fprintf(stderr, "Error: invalid run time: %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Error: unrecognized option\n");
+				print_usage();
+				return 1;
+		}
+	}
+
+	printf("%-44s %10s %17s %18s\n", "benchmark", "iterations", "time", "allocations");
+	bench_crc();
+	bench_zero_scan();
+	bench_blkcache();
+	bench_ver();
+	bench_bup();
+	bench_gpt_smd();
+	bench_bootinfo();
+
+	return 0;
+
+} /* main */
@@ -0,0 +1,16 @@
+#ifndef bench_h_included
+#define bench_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include <stddef.h>
+
+typedef void (*bench_fn_t)(void *arg);
+
+void bench_run(const char *name, bench_fn_t fn, void *arg);
+int bench_memdev(const char *name, size_t size, char *pathbuf, size_t pathbufsize);
+
+void bench_bup(void);
+void bench_gpt_smd(void);
+void bench_bootinfo(void);
+
+#endif /* bench_h_included */
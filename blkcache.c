@@ -0,0 +1,462 @@
+/*
+ * blkcache.c
+ *
+ * Small in-process cache of device blocks, shared by
+ * the GPT, SMD, bootinfo, and bootloader update code, so
+ * that regions read more than once during a run are only
+ * read from the device once.
+ *
+ * The cache is write-through: writes go straight to the
+ * device, and any cached blocks they overlap are dropped.
+ * Each cached sector carries a CRC32 that is checked on
+ * every hit, so a damaged cache entry is re-read from the
+ * device rather than returned. Sectors are kept small so
+ * that this check costs about as much as the copy.
+ *
+ * Blocks are keyed by device, so different device nodes
+ * that alias the same storage (a partition and its whole
+ * disk) are cached separately; callers must not mix them
+ * for the same region.
+ *
+ * The cache is disabled (all calls go straight to the
+ * device) until blkcache_set_limit() is called with a
+ * non-zero size. It is not thread-safe.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "blkcache.h"
+
+#define BLKCACHE_BUCKETS 1024
+/*
+ * Maximum number of uncached sectors read from the
+ * device with a single call on a miss.
+ */
+#define BLKCACHE_READ_MAX (64 * BLKCACHE_BLOCK_SIZE)
+
+/*
+ * Blocks are identified by the device (for block device
+ * nodes, so different opens of the same device share
+ * entries) or the file, plus the block-aligned offset.
+ */
+struct blkcache_key_s {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct blkcache_block_s {
+	struct blkcache_block_s *hash_next;
+	struct blkcache_block_s *lru_prev, *lru_next;
+	struct blkcache_key_s key;
+	off_t offset;
+	size_t valid;
+	uint32_t crc;
+	uint8_t data[BLKCACHE_BLOCK_SIZE];
+};
+
+static struct blkcache_block_s *buckets[BLKCACHE_BUCKETS];
+static struct blkcache_block_s *lru_head, *lru_tail;
+static size_t cache_limit;
+static blkcache_stats_t stats;
+
+/*
+ * get_key
+ *
+ * Fills in the cache key for a file descriptor.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+get_key (int fd, struct blkcache_key_s *key)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (S_ISBLK(st.st_mode)) {
+		key->dev = st.st_rdev;
+		key->ino = 0;
+	} else {
+		key->dev = st.st_dev;
+		key->ino = st.st_ino;
+	}
+	return 0;
+
+} /* get_key */
+
+static unsigned int
+bucket_index (const struct blkcache_key_s *key, off_t offset)
+{
+	uint64_t h = ((uint64_t) key->dev * 31 + key->ino) * 31 + (uint64_t) offset / BLKCACHE_BLOCK_SIZE;
+
+	return (unsigned int) ((h ^ (h >> 17)) % BLKCACHE_BUCKETS);
+
+} /* bucket_index */
+
+static void
+lru_unlink (struct blkcache_block_s *blk)
+{
+	if (blk->lru_prev != NULL)
+		blk->lru_prev->lru_next = blk->lru_next;
+	else
+		lru_head = blk->lru_next;
+	if (blk->lru_next != NULL)
+		blk->lru_next->lru_prev = blk->lru_prev;
+	else
+		lru_tail = blk->lru_prev;
+	blk->lru_prev = blk->lru_next = NULL;
+
+} /* lru_unlink */
+
+static void
+lru_push (struct blkcache_block_s *blk)
+{
+	blk->lru_prev = NULL;
+	blk->lru_next = lru_head;
+	if (lru_head != NULL)
+		lru_head->lru_prev = blk;
+	lru_head = blk;
+	if (lru_tail == NULL)
+		lru_tail = blk;
+
+} /* lru_push */
+
+/*
+ * remove_block
+ *
+ * Unlinks a block from the hash table and LRU list
+ * and frees it.
+ */
+static void
+remove_block (struct blkcache_block_s *blk)
+{
+	struct blkcache_block_s **pp;
+
+	for (pp = &buckets[bucket_index(&blk->key, blk->offset)]; *pp != NULL; pp = &(*pp)->hash_next)
+		if (*pp == blk) {
+			*pp = blk->hash_next;
+			break;
+		}
+	lru_unlink(blk);
+	stats.cached_bytes -= sizeof(blk->data);
+	free(blk);
+
+} /* remove_block */
+
+/*
+ * pread_fully
+ *
+ * Reads until the requested length, end of file,
+ * or an error.
+ *
+ * Returns: number of bytes read, or -1 on error (errno set)
+ */
+static ssize_t
+pread_fully (int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+	size_t total;
+
+	for (total = 0; total < len; total += n) {
+		n = pread(fd, (uint8_t *) buf + total, len - total, offset + total);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0)
+			break;
+	}
+	return total;
+
+} /* pread_fully */
+
+/*
+ * find_block
+ *
+ * Locates a cached block without verifying it or
+ * updating the statistics.
+ *
+ * Returns: pointer to block, or NULL if not cached
+ */
+static struct blkcache_block_s *
+find_block (const struct blkcache_key_s *key, off_t offset)
+{
+	struct blkcache_block_s *blk;
+
+	for (blk = buckets[bucket_index(key, offset)]; blk != NULL; blk = blk->hash_next)
+		if (blk->offset == offset && blk->key.dev == key->dev && blk->key.ino == key->ino)
+			return blk;
+	return NULL;
+
+} /* find_block */
+
+/*
+ * lookup_block
+ *
+ * Locates a cached block, verifying its checksum.
+ *
+ * Returns: pointer to block, or NULL if not cached
+ */
+static struct blkcache_block_s *
+lookup_block (const struct blkcache_key_s *key, off_t offset)
+{
+	struct blkcache_block_s *blk;
+
+	blk = find_block(key, offset);
+	if (blk == NULL)
+		return NULL;
+	if (crc32(0, blk->data, blk->valid) != blk->crc) {
+		stats.checksum_errors += 1;
+		remove_block(blk);
+		return NULL;
+	}
+	lru_unlink(blk);
+	lru_push(blk);
+	stats.hits += 1;
+	return blk;
+
+} /* lookup_block */
+
+/*
+ * load_blocks
+ *
+ * Reads a run of blocks from the device into the cache
+ * with a single read, stopping early at the first block
+ * that is already cached. The least-recently used blocks
+ * are evicted to stay within the size limit.
+ *
+ * fd: file descriptor
+ * key: cache key for fd
+ * offset: block-aligned offset of the first block
+ * len: number of bytes wanted, starting at offset
+ *
+ * Returns: pointer to first block, or NULL on error (errno set)
+ */
+static struct blkcache_block_s *
+load_blocks (int fd, const struct blkcache_key_s *key, off_t offset, size_t len)
+{
+	static uint8_t readbuf[BLKCACHE_READ_MAX];
+	struct blkcache_block_s *blk, *first = NULL;
+	size_t count, i, pos;
+	ssize_t n;
+	unsigned int idx;
+
+	if (len > sizeof(readbuf))
+		len = sizeof(readbuf);
+	for (count = 1; count * BLKCACHE_BLOCK_SIZE < len; count++)
+		if (find_block(key, offset + count * BLKCACHE_BLOCK_SIZE) != NULL)
+			break;
+	n = pread_fully(fd, readbuf, count * BLKCACHE_BLOCK_SIZE, offset);
+	if (n < 0)
+		return NULL;
+	for (i = 0, pos = 0; i < count; i++, pos += BLKCACHE_BLOCK_SIZE) {
+		while (lru_tail != NULL && stats.cached_bytes + sizeof(blk->data) > cache_limit) {
+			/* never evict the block the caller is waiting for */
+			if (lru_tail == first)
+				return first;
+			remove_block(lru_tail);
+		}
+		stats.misses += 1;
+		blk = malloc(sizeof(*blk));
+		if (blk == NULL)
+			return first;
+		blk->key = *key;
+		blk->offset = offset + pos;
+		blk->valid = ((size_t) n > pos ? (size_t) n - pos : 0);
+		if (blk->valid > sizeof(blk->data))
+			blk->valid = sizeof(blk->data);
+		memcpy(blk->data, readbuf + pos, blk->valid);
+		blk->crc = crc32(0, blk->data, blk->valid);
+		idx = bucket_index(key, blk->offset);
+		blk->hash_next = buckets[idx];
+		buckets[idx] = blk;
+		lru_push(blk);
+		stats.cached_bytes += sizeof(blk->data);
+		if (first == NULL)
+			first = blk;
+		if (blk->valid < sizeof(blk->data))
+			break;
+	}
+	return first;
+
+} /* load_blocks */
+
+/*
+ * invalidate_range
+ *
+ * Drops all cached blocks for a device that overlap
+ * a range (len == 0 means the whole device).
+ */
+static void
+invalidate_range (const struct blkcache_key_s *key, off_t offset, size_t len)
+{
+	struct blkcache_block_s *blk, *next;
+
+	for (blk = lru_head; blk != NULL; blk = next) {
+		next = blk->lru_next;
+		if (blk->key.dev != key->dev || blk->key.ino != key->ino)
+			continue;
+		if (len != 0 && (blk->offset + BLKCACHE_BLOCK_SIZE <= offset ||
+				 blk->offset >= offset + (off_t) len))
+			continue;
+		remove_block(blk);
+		stats.invalidated += 1;
+	}
+
+} /* invalidate_range */
+
+/*
+ * blkcache_set_limit
+ *
+ * Sets the maximum amount of memory used for cached
+ * blocks. A limit of zero disables the cache and frees
+ * everything in it.
+ *
+ * limit: size limit, in bytes
+ *
+ * Returns: nothing
+ */
+void
+blkcache_set_limit (size_t limit)
+{
+	cache_limit = limit;
+	while (lru_tail != NULL && stats.cached_bytes > cache_limit)
+		remove_block(lru_tail);
+
+} /* blkcache_set_limit */
+
+/*
+ * blkcache_pread
+ *
+ * Reads from a file or device through the cache. Reads
+ * larger than half the cache limit bypass the cache, so
+ * that whole-partition reads do not flush out the small,
+ * frequently-read regions (GPT, SMD, VER, bootinfo).
+ *
+ * fd: file descriptor
+ * buf: buffer to read into
+ * len: number of bytes to read
+ * offset: offset from start of file/device
+ *
+ * Returns: number of bytes read (short only at end of
+ *          file), or -1 on error (errno set)
+ */
+ssize_t
+blkcache_pread (int fd, void *buf, size_t len, off_t offset)
+{
+	struct blkcache_key_s key;
+	struct blkcache_block_s *blk;
+	size_t total, chunk, blkoff;
+	off_t base;
+
+	if (cache_limit == 0)
+		return pread_fully(fd, buf, len, offset);
+	if (len > cache_limit / 2 || get_key(fd, &key) < 0) {
+		stats.bypassed += 1;
+		return pread_fully(fd, buf, len, offset);
+	}
+	for (total = 0; total < len; total += chunk) {
+		base = (offset + total) - (offset + total) % BLKCACHE_BLOCK_SIZE;
+		blkoff = (size_t) (offset + total - base);
+		blk = lookup_block(&key, base);
+		if (blk == NULL) {
+			blk = load_blocks(fd, &key, base, blkoff + (len - total));
+			if (blk == NULL)
+				return -1;
+		}
+		if (blkoff >= blk->valid)
+			break;
+		chunk = blk->valid - blkoff;
+		if (chunk > len - total)
+			chunk = len - total;
+		memcpy((uint8_t *) buf + total, blk->data + blkoff, chunk);
+	}
+	return total;
+
+} /* blkcache_pread */
+
+/*
+ * blkcache_pwrite
+ *
+ * Writes to a file or device, dropping any cached blocks
+ * the write overlaps.
+ *
+ * fd: file descriptor
+ * buf: data to write
+ * len: number of bytes to write
+ * offset: offset from start of file/device
+ *
+ * Returns: number of bytes written, or -1 on error (errno set)
+ */
+ssize_t
+blkcache_pwrite (int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+	size_t total;
+
+	blkcache_invalidate(fd, offset, (len == 0 ? 1 : len));
+	for (total = 0; total < len; total += n) {
+		n = pwrite(fd, (const uint8_t *) buf + total, len - total, offset + total);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+	}
+	return total;
+
+} /* blkcache_pwrite */
+
+/*
+ * blkcache_invalidate
+ *
+ * Drops cached blocks for a file or device, for use when
+ * it has been (or may have been) modified other than
+ * through blkcache_pwrite().
+ *
+ * fd: file descriptor
+ * offset: start of range
+ * len: length of range, or 0 for the whole device
+ *
+ * Returns: nothing
+ */
+void
+blkcache_invalidate (int fd, off_t offset, size_t len)
+{
+	struct blkcache_key_s key;
+
+	if (lru_head == NULL || get_key(fd, &key) < 0)
+		return;
+	invalidate_range(&key, offset, len);
+
+} /* blkcache_invalidate */
+
+/*
+ * blkcache_get_stats
+ *
+ * Returns a copy of the cache statistics.
+ *
+ * stats: pointer to structure to fill in
+ *
+ * Returns: nothing
+ */
+void
+blkcache_get_stats (blkcache_stats_t *statsp)
+{
+	*statsp = stats;
+
+} /* blkcache_get_stats */
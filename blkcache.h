@@ -0,0 +1,26 @@
+#ifndef blkcache_h_included
+#define blkcache_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BLKCACHE_BLOCK_SIZE 512
+
+struct blkcache_stats_s {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long bypassed;
+	unsigned long invalidated;
+	unsigned long checksum_errors;
+	size_t cached_bytes;
+};
+typedef struct blkcache_stats_s blkcache_stats_t;
+
+void blkcache_set_limit(size_t limit);
+ssize_t blkcache_pread(int fd, void *buf, size_t len, off_t offset);
+ssize_t blkcache_pwrite(int fd, const void *buf, size_t len, off_t offset);
+void blkcache_invalidate(int fd, off_t offset, size_t len);
+void blkcache_get_stats(blkcache_stats_t *stats);
+
+#endif /* blkcache_h_included */
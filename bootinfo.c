@@ -19,10 +19,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 #include <zlib.h>
 #include "bootinfo.h"
+#include "blkcache.h"
+#include "gpt.h"
 #include "util.h"
 #include "config.h"
 
@@ -43,6 +47,20 @@ static const uint16_t DEVINFO_VERSION_CURRENT = 3;
 #error "EXTENSION_SECTOR_COUNT out of range"
 #endif
 
+/*
+ * When bootinfo is kept in its own partition, the extension
+ * can be larger, but must be able to hold everything that
+ * could be migrated from the boot device.
+ */
+#ifndef BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT
+#define BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT EXTENSION_SECTOR_COUNT
+#endif
+
+#if (BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT < EXTENSION_SECTOR_COUNT) || \
+	(BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT > MAX_EXTENSION_SECTORS)
+#error "BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT out of range"
+#endif
+
 
 /*
  * The device_info structure is the on-disk (or on-storage-device)
@@ -63,7 +81,7 @@ struct device_info {
 } __attribute__((packed));
 #define FLAG_BOOT_IN_PROGRESS	(1<<0)
 #define DEVINFO_HDR_SIZE sizeof(struct device_info)
-#define VARSPACE_SIZE (DEVINFO_BLOCK_SIZE+EXTENSION_SIZE-(DEVINFO_HDR_SIZE+sizeof(uint32_t)))
+#define VARSPACE_SIZE(ctx_) ((ctx_)->infosize-(DEVINFO_HDR_SIZE+sizeof(uint32_t)))
 /*
  * Maximum size of a variable name was arbitrarily set to DEVINFO_BLOCK_SIZE
  * in earlier versions, so retain that here.
@@ -73,7 +91,7 @@ struct device_info {
  * byte for the null character terminating the variable list.
  */
 #define MAX_NAME_SIZE (DEVINFO_BLOCK_SIZE)
-#define MAX_VALUE_SIZE (VARSPACE_SIZE-4)
+#define MAX_VALUE_SIZE(ctx_) (VARSPACE_SIZE(ctx_)-4)
 
 struct info_var {
 	struct info_var *next;
@@ -99,7 +117,8 @@ struct bootinfo_context_s {
 	int lockfd;
 	bool readonly;
 	bool dirty;
-	bool valid[2];
+	bool valid[MAX_OFFSET_COUNT];
+	bool formatted;
 	bool reset_bootdev_status;
 	int current;
 	const char *devinfo_dev;
@@ -107,12 +126,16 @@ struct bootinfo_context_s {
 	// Only the first two entries in these arrays are used for
 	// read-write access; additional pairs of entries are allowed
 	// for read-only access, to handle upgrades that change offsets.
+	// Offsets are from the start of the device.
 	off_t devinfo_offset[MAX_OFFSET_COUNT];
 	off_t extension_offset[MAX_OFFSET_COUNT];
+	unsigned int ext_sectors;
+	size_t ext_size;
+	size_t infosize;
 	struct device_info curinfo;
 	struct info_var *vars;
 	size_t varsize;
-	uint8_t infobuf[MAX_OFFSET_COUNT][DEVINFO_BLOCK_SIZE+EXTENSION_SIZE];
+	uint8_t *infobuf[MAX_OFFSET_COUNT];
 };
 
 struct devinfo_offset_s {
@@ -191,6 +214,20 @@ struct devinfo_offset_s {
 };
 #define OFFSET_TABLE_COUNT (sizeof(devinfo_offset_table)/sizeof(devinfo_offset_table[0]))
 
+/*
+ * Where the bootinfo copies live on a particular device.
+ * Offsets in devinfo_offset_table[] are from the end of
+ * the device; offsets within a partition are from the start.
+ */
+struct storage_layout_s {
+	const char *devname;
+	bool from_end;
+	unsigned int ext_sectors;
+	int offset_count;
+	off_t devinfo_offset[MAX_OFFSET_COUNT];
+	off_t extension_offset[MAX_OFFSET_COUNT];
+};
+
 /*
  * Order here is important. Some systems may have both
  * eMMC and a SPI flash, and we prefer the eMMC.
@@ -202,6 +239,12 @@ static const char *devinfo_devices[] = {
 	[1] = "/dev/mtdblock0",
 };
 
+/*
+ * Directory holding the lockfile used to coordinate
+ * access between processes.
+ */
+static const char *bootinfo_lockdir = "/run/tegra-bootinfo";
+
 /*
  * identify_chip
  *
@@ -236,22 +279,19 @@ identify_chip ()
  * by iterating through devinfo_devices[]. First
  * successful access(F_OK) wins.
  *
- * returns 0 on success, non-0 on failure.
+ * returns device name on success, NULL on failure.
  */
-static int
-find_storage_dev (bootinfo_context_t *ctx)
+static const char *
+find_storage_dev (void)
 {
 	unsigned int i;
 
 	for (i = 0; i < sizeof(devinfo_devices)/sizeof(devinfo_devices[0]); i++) {
-		if (access(devinfo_devices[i], F_OK) == 0) {
-			ctx->devinfo_dev = devinfo_devices[i];
-			return 0;
-		}
+		if (access(devinfo_devices[i], F_OK) == 0)
+			return devinfo_devices[i];
 	}
-	ctx->devinfo_dev = NULL;
 	errno = ENODEV;
-	return -1;
+	return NULL;
 
 } /* find_storage_dev */
 
@@ -281,7 +321,7 @@ parse_vars (struct bootinfo_context_s *ctx)
 		return -1;
 	}
 	for (cp = (char *)(ctx->infobuf[ctx->current] + DEVINFO_HDR_SIZE),
-		     remain = sizeof(ctx->infobuf[ctx->current]) - (DEVINFO_HDR_SIZE+sizeof(uint32_t)),
+		     remain = VARSPACE_SIZE(ctx),
 		     ctx->varsize = 0,
 		     last = NULL;
 	     remain > 0 && *cp != '\0';
@@ -333,7 +373,7 @@ pack_vars (struct bootinfo_context_s *ctx, int idx)
 	if (ctx->vars == NULL)
 		return 0;
 	for (var = ctx->vars, cp = (char *)(ctx->infobuf[idx] + DEVINFO_HDR_SIZE),
-		     remain = sizeof(ctx->infobuf[idx]) - (DEVINFO_HDR_SIZE+sizeof(uint32_t)+1);
+		     remain = VARSPACE_SIZE(ctx) - 1;
 	     var != NULL && remain > 0;
 	     var = var->next) {
 		nlen = strlen(var->name) + 1;
@@ -391,6 +431,40 @@ free_vars (struct bootinfo_context_s *ctx)
 
 } /* free_vars */
 
+/*
+ * seal_block
+ *
+ * Fills in the checksums for an info block.
+ */
+static void
+seal_block (struct bootinfo_context_s *ctx, uint8_t *buf)
+{
+	struct device_info *info = (struct device_info *) buf;
+	uint32_t *crcptr = (uint32_t *) &buf[ctx->infosize - sizeof(uint32_t)];
+
+	info->crcsum = 0;
+	info->crcsum = crc32(0, buf, DEVINFO_BLOCK_SIZE);
+	*crcptr = crc32(0, &buf[DEVINFO_BLOCK_SIZE], ctx->ext_size-sizeof(uint32_t));
+
+} /* seal_block */
+
+/*
+ * write_copy
+ *
+ * Writes an info block (base block and extension) to
+ * the storage location for one of the copies.
+ */
+static int
+write_copy (struct bootinfo_context_s *ctx, int idx, const uint8_t *buf)
+{
+	if (blkcache_pwrite(ctx->fd, buf, DEVINFO_BLOCK_SIZE, ctx->devinfo_offset[idx]) < 0)
+		return -1;
+	if (blkcache_pwrite(ctx->fd, buf + DEVINFO_BLOCK_SIZE, ctx->ext_size, ctx->extension_offset[idx]) < 0)
+		return -1;
+	return 0;
+
+} /* write_copy */
+
 /*
  * update_bootinfo
  *
@@ -399,9 +473,7 @@ free_vars (struct bootinfo_context_s *ctx)
 static int
 update_bootinfo (struct bootinfo_context_s *ctx)
 {
-	uint32_t *crcptr;
 	struct device_info *info;
-	ssize_t n, cnt;
 	int idx;
 
 	if (ctx->readonly) {
@@ -418,36 +490,21 @@ update_bootinfo (struct bootinfo_context_s *ctx)
 		idx = 1 - ctx->current;
 
 	info = (struct device_info *) ctx->infobuf[idx];
-	crcptr = (uint32_t *) &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE + EXTENSION_SIZE - sizeof(uint32_t)];
 	memset(info, 0, DEVINFO_BLOCK_SIZE);
 	memcpy(info->magic, DEVICE_MAGIC, sizeof(info->magic));
 	info->devinfo_version = DEVINFO_VERSION_CURRENT;
 	info->flags = ctx->curinfo.flags;
 	info->failed_boots = ctx->curinfo.failed_boots;
 	info->sernum = ctx->curinfo.sernum + 1;
-	info->ext_sectors = EXTENSION_SECTOR_COUNT;
+	info->ext_sectors = ctx->ext_sectors;
 	/* Don't pack vars if current index is invalid */
 	if (ctx->current >= 0 && pack_vars(ctx, idx) < 0)
 		return -1;
-	info->crcsum = crc32(0, ctx->infobuf[idx], DEVINFO_BLOCK_SIZE);
-	*crcptr = crc32(0, &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE], EXTENSION_SIZE-sizeof(uint32_t));
+	seal_block(ctx, ctx->infobuf[idx]);
 
-	if (lseek(ctx->fd, ctx->devinfo_offset[idx], SEEK_END) < 0)
-		return -1;
-	for (n = 0; n < DEVINFO_BLOCK_SIZE; n += cnt) {
-		cnt = write(ctx->fd, ctx->infobuf[idx] + n, DEVINFO_BLOCK_SIZE-n);
-		if (cnt < 0)
-			return -1;
-	}
-	if (lseek(ctx->fd, ctx->extension_offset[idx], SEEK_END) < 0)
+	if (write_copy(ctx, idx, ctx->infobuf[idx]) < 0)
 		return -1;
 
-	for (n = 0; n < EXTENSION_SIZE; n += cnt) {
-		cnt = write(ctx->fd, ctx->infobuf[idx] + DEVINFO_BLOCK_SIZE + n, EXTENSION_SIZE-n);
-		if (cnt < 0)
-			return -1;
-	}
-
 	ctx->dirty = false;
 	return 0;
 
@@ -463,11 +520,10 @@ update_bootinfo (struct bootinfo_context_s *ctx)
 static int
 boot_devinfo_init (bootinfo_context_t *ctx)
 {
-	ssize_t n, cnt;
 	uint8_t *buf;
 	int i;
 
-	buf = calloc(1, DEVINFO_BLOCK_SIZE + EXTENSION_SIZE);
+	buf = calloc(1, ctx->infosize);
 	if (buf == NULL)
 		return -1;
 
@@ -475,23 +531,7 @@ boot_devinfo_init (bootinfo_context_t *ctx)
 	 * Start by zeroing out the primary and backup blocks
 	 */
 	for (i = 0; i < 2; i++) {
-		if (lseek(ctx->fd, ctx->devinfo_offset[i], SEEK_END) < 0)
-			break;
-		for (n = 0; n < DEVINFO_BLOCK_SIZE; n += cnt) {
-			cnt = write(ctx->fd, buf+n, DEVINFO_BLOCK_SIZE-n);
-			if (cnt < 0)
-				break;
-		}
-		if (n < DEVINFO_BLOCK_SIZE)
-			break;
-		if (lseek(ctx->fd, ctx->extension_offset[i], SEEK_END) < 0)
-			break;
-		for (n = 0; n < EXTENSION_SIZE; n += cnt) {
-			cnt = write(ctx->fd, buf+DEVINFO_BLOCK_SIZE+n, EXTENSION_SIZE-n);
-			if (cnt < 0)
-				break;
-		}
-		if (n < EXTENSION_SIZE)
+		if (write_copy(ctx, i, buf) < 0)
 			break;
 	}
 	free(buf);
@@ -504,102 +544,461 @@ boot_devinfo_init (bootinfo_context_t *ctx)
 } /* boot_devinfo_init */
 
 /*
- * bootinfo_open
- *
- * Tries to find a valid bootinfo block, and initializes a context
- * if one is found.
+ * legacy_layout
  *
- * Returns negative value on an underlying error or if neither block
- * is valid.
+ * Fills in the layout for bootinfo copies stored on
+ * the boot device, from devinfo_offset_table[].
  *
- * Returns 0 on success, and ctxp will be set to point to a valid
- * context.  Caller MUST call bootinfo_close to clean up the context.
+ * chipid: tegra chip ID
+ * devname: storage device name
+ * layout: pointer to layout to be filled in
  *
+ * Returns 0 on success, -1 on error (errno set)
  */
-int
-bootinfo_open (unsigned int flags, struct bootinfo_context_s **ctxp)
+static int
+legacy_layout (unsigned long chipid, const char *devname, struct storage_layout_s *layout)
 {
-	struct bootinfo_context_s *ctx;
-	struct device_info *dp;
-	unsigned long chipid;
-	ssize_t n, cnt;
-	int i, dirfd;
 	unsigned int offset_table_index;
+	int i;
 
-	*ctxp = NULL;
-	ctx = calloc(1, sizeof(struct bootinfo_context_s));
-	if (ctx == NULL)
-		return -1;
-
-	chipid = identify_chip();
-	if (chipid != 0x21 && chipid != 0x18 && chipid != 0x19) {
-		errno = ENODEV;
-		goto failure_exit;
-	}
-	if (find_storage_dev(ctx) < 0)
-		goto failure_exit;
 	for (offset_table_index = 0; offset_table_index < OFFSET_TABLE_COUNT; offset_table_index++) {
 		struct devinfo_offset_s *entry = &devinfo_offset_table[offset_table_index];
 		if (chipid == entry->chipid && (entry->devinfo_dev == NULL ||
-						strcmp(ctx->devinfo_dev, entry->devinfo_dev) == 0)) {
-			ctx->offset_count = entry->offset_count;
-			for (i = 0; i < ctx->offset_count; i++) {
-				ctx->devinfo_offset[i] = entry->devinfo_offset[i];
-				ctx->extension_offset[i] = entry->extension_offset[i];
+						strcmp(devname, entry->devinfo_dev) == 0)) {
+			layout->devname = devname;
+			layout->from_end = true;
+			layout->ext_sectors = EXTENSION_SECTOR_COUNT;
+			layout->offset_count = entry->offset_count;
+			for (i = 0; i < layout->offset_count; i++) {
+				layout->devinfo_offset[i] = entry->devinfo_offset[i];
+				layout->extension_offset[i] = entry->extension_offset[i];
 			}
-			break;
+			return 0;
 		}
 	}
-	if (offset_table_index >= OFFSET_TABLE_COUNT) {
-		errno = ENODEV;
-		goto failure_exit;
+	errno = ENODEV;
+	return -1;
+
+} /* legacy_layout */
+
+/*
+ * Bootinfo partition location, once found. It is also
+ * saved in the lock directory, which is cleared at each
+ * boot, so later processes need not load the GPT again.
+ * The lock directory is writable by the lock group, so
+ * a saved location is only trusted for reading; it is
+ * checked against the GPT before a read-write open.
+ */
+struct partition_location_s {
+	char devname[PATH_MAX];
+	dev_t rdev;
+	off_t devsize;
+	off_t start;
+	off_t stride;
+};
+static struct partition_location_s partition_location;
+static bool partition_location_valid;
+static bool partition_location_checked;
+static const char partition_location_file[] = "layout";
+
+/*
+ * device_identity
+ *
+ * Gets the device number and size of a block device,
+ * for checking a saved partition location against.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+device_identity (const char *devname, dev_t *rdev, off_t *devsize)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(devname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	*rdev = st.st_rdev;
+	*devsize = lseek(fd, 0, SEEK_END);
+	close(fd);
+	return (*devsize == (off_t) -1 ? -1 : 0);
+
+} /* device_identity */
+
+/*
+ * load_partition_location
+ *
+ * Reads the partition location saved by an earlier
+ * process, if the device it names is still the same.
+ *
+ * Returns true if a usable location was loaded.
+ */
+static bool
+load_partition_location (struct partition_location_s *loc)
+{
+	char path[PATH_MAX];
+	unsigned long long rdev, devsize, start, stride;
+	dev_t cur_rdev;
+	off_t cur_size;
+	FILE *fp;
+	int n;
+
+	snprintf(path, sizeof(path), "%s/%s", bootinfo_lockdir, partition_location_file);
+	fp = fopen(path, "re");
+	if (fp == NULL)
+		return false;
+	n = fscanf(fp, "%4095s %llx %llu %llu %llu", loc->devname, &rdev, &devsize, &start, &stride);
+	fclose(fp);
+	if (n != 5 || device_identity(loc->devname, &cur_rdev, &cur_size) < 0 ||
+	    cur_rdev != (dev_t) rdev || cur_size != (off_t) devsize)
+		return false;
+	loc->rdev = rdev;
+	loc->devsize = devsize;
+	loc->start = start;
+	loc->stride = stride;
+	return true;
+
+} /* load_partition_location */
+
+/*
+ * save_partition_location
+ *
+ * Saves the partition location for later processes. Only
+ * done if the lock directory already exists; failures
+ * are ignored, as the location can always be found again.
+ */
+static void
+save_partition_location (const struct partition_location_s *loc)
+{
+	char path[PATH_MAX], tmppath[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", bootinfo_lockdir, partition_location_file);
+	snprintf(tmppath, sizeof(tmppath), "%s/%s.%ld", bootinfo_lockdir, partition_location_file, (long) getpid());
+	fp = fopen(tmppath, "we");
+	if (fp == NULL)
+		return;
+	fprintf(fp, "%s %llx %llu %llu %llu\n", loc->devname, (unsigned long long) loc->rdev,
+		(unsigned long long) loc->devsize, (unsigned long long) loc->start,
+		(unsigned long long) loc->stride);
+	if (fclose(fp) != 0 || rename(tmppath, path) < 0)
+		unlink(tmppath);
+
+} /* save_partition_location */
+
+/*
+ * find_partition
+ *
+ * Searches the devices in BOOTINFO_PARTITION_DEVICES,
+ * in order, for the bootinfo partition, using each
+ * device's GPT.
+ *
+ * Each copy (base block followed by its extension) starts
+ * at the beginning of one half of the partition, rounded
+ * down to 4KiB, so a partition sized at twice the erase
+ * block size keeps the copies in separate erase blocks.
+ *
+ * loc: pointer to location to be filled in
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ * errno is ENOENT if no partition was found.
+ */
+static int
+find_partition (struct partition_location_s *loc)
+{
+	char devlist[] = BOOTINFO_PARTITION_DEVICES;
+	char *dev, *saveptr;
+	gpt_context_t *gptctx;
+	gpt_entry_t *part;
+	unsigned int align;
+
+	for (dev = strtok_r(devlist, " ", &saveptr); dev != NULL; dev = strtok_r(NULL, " ", &saveptr)) {
+		if (access(dev, F_OK) != 0)
+			continue;
+		gptctx = gpt_init(dev, 0, 0);
+		if (gptctx == NULL)
+			continue;
+		part = (gpt_load(gptctx, 0) == 0 ? gpt_find_by_name(gptctx, BOOTINFO_PARTITION) : NULL);
+		if (part == NULL) {
+			gpt_finish(gptctx);
+			continue;
+		}
+		/*
+		 * Keep both copies aligned to 4KiB, or to the physical
+		 * block size if that is larger.
+		 */
+		align = (gpt_physical_blocksize(gptctx) > 4096 ? gpt_physical_blocksize(gptctx) : 4096);
+		loc->start = part->first_lba * gpt_blocksize(gptctx);
+		loc->stride = (((part->last_lba - part->first_lba + 1) * gpt_blocksize(gptctx)) / 2) & ~((off_t) align - 1);
+		gpt_finish(gptctx);
+		snprintf(loc->devname, sizeof(loc->devname), "%s", dev);
+		if (device_identity(dev, &loc->rdev, &loc->devsize) < 0)
+			return -1;
+		return 0;
+	}
+	errno = ENOENT;
+	return -1;
+
+} /* find_partition */
+
+/*
+ * partition_layout
+ *
+ * Fills in the layout for bootinfo copies stored in a
+ * dedicated partition (BOOTINFO_PARTITION) on the main
+ * storage device. The partition is located once, and
+ * the result reused by this and later processes (see
+ * partition_location_s above).
+ *
+ * layout: pointer to layout to be filled in
+ * readonly: true if the layout is only used for reading
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ * errno is ENOENT if no partition is configured
+ * or none was found.
+ */
+static int
+partition_layout (struct storage_layout_s *layout, bool readonly)
+{
+	struct partition_location_s *loc = &partition_location;
+	struct partition_location_s found;
+	int i;
+
+	if (strlen(BOOTINFO_PARTITION) == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (!partition_location_valid) {
+		if (!load_partition_location(loc)) {
+			if (find_partition(loc) < 0)
+				return -1;
+			save_partition_location(loc);
+			partition_location_checked = true;
+		}
+		partition_location_valid = true;
+	}
+	if (!readonly && !partition_location_checked) {
+		if (find_partition(&found) < 0)
+			return -1;
+		if (strcmp(found.devname, loc->devname) != 0 || found.rdev != loc->rdev ||
+		    found.devsize != loc->devsize || found.start != loc->start ||
+		    found.stride != loc->stride) {
+			*loc = found;
+			save_partition_location(loc);
+		}
+		partition_location_checked = true;
+	}
+	if (loc->stride < DEVINFO_BLOCK_SIZE + BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT * 512) {
+		errno = ENOSPC;
+		return -1;
+	}
+	layout->devname = loc->devname;
+	layout->from_end = false;
+	layout->ext_sectors = BOOTINFO_PARTITION_EXTENSION_SECTOR_COUNT;
+	layout->offset_count = 2;
+	for (i = 0; i < 2; i++) {
+		layout->devinfo_offset[i] = loc->start + i * loc->stride;
+		layout->extension_offset[i] = loc->start + i * loc->stride + DEVINFO_BLOCK_SIZE;
 	}
+	return 0;
+
+} /* partition_layout */
+
+/*
+ * free_context
+ *
+ * Closes the storage device and lockfile
+ * and frees a context.
+ */
+static void
+free_context (struct bootinfo_context_s *ctx)
+{
+	if (ctx->lockfd >= 0)
+		close(ctx->lockfd);
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+	if (ctx->reset_bootdev_status)
+		set_bootdev_writeable_status(ctx->devinfo_dev, false);
+	free(ctx->infobuf[0]);
+	free(ctx);
+
+} /* free_context */
+
+/*
+ * open_copies
+ *
+ * Sets up a context for a storage layout and
+ * opens the storage device. Does not lock or
+ * read anything.
+ *
+ * layout: storage layout
+ * readonly: true to open for reading only
+ *
+ * Returns context pointer, or NULL on error (errno set)
+ */
+static struct bootinfo_context_s *
+open_copies (const struct storage_layout_s *layout, bool readonly)
+{
+	struct bootinfo_context_s *ctx;
+	off_t devsize;
+	int i;
+
+	ctx = calloc(1, sizeof(struct bootinfo_context_s));
+	if (ctx == NULL)
+		return NULL;
 
 	ctx->fd = ctx->lockfd = -1;
-	ctx->readonly = (flags & BOOTINFO_O_ACCMODE) == BOOTINFO_O_RDONLY;
+	ctx->devinfo_dev = layout->devname;
+	ctx->offset_count = layout->offset_count;
+	ctx->ext_sectors = layout->ext_sectors;
+	ctx->ext_size = layout->ext_sectors * 512;
+	ctx->infosize = DEVINFO_BLOCK_SIZE + ctx->ext_size;
+	ctx->infobuf[0] = calloc(ctx->offset_count, ctx->infosize);
+	if (ctx->infobuf[0] == NULL)
+		goto failure_exit;
+	for (i = 1; i < ctx->offset_count; i++)
+		ctx->infobuf[i] = ctx->infobuf[0] + i * ctx->infosize;
+
+	ctx->readonly = readonly;
 	if (!ctx->readonly)
 		ctx->reset_bootdev_status = set_bootdev_writeable_status(ctx->devinfo_dev, true);
 
 	ctx->fd = open(ctx->devinfo_dev, (ctx->readonly ? O_RDONLY : O_RDWR|O_DSYNC));
 	if (ctx->fd < 0)
 		goto failure_exit;
-	/*
-	 * We use a lockfile to coordinate access to the bootinfo block
-	 * from multiple processes
-	 */
-	dirfd = open("/run/tegra-bootinfo", O_PATH);
-	if (dirfd < 0) {
-		if (mkdir("/run/tegra-bootinfo", 02770) < 0)
-			goto failure_exit;
-		dirfd = open("/run/tegra-bootinfo", O_PATH);
-		if (dirfd < 0)
-			goto failure_exit;
-	}
-	ctx->lockfd = openat(dirfd, "lockfile", O_CREAT|O_RDWR, 0770);
-	close(dirfd);
-	if (ctx->lockfd < 0)
-		goto failure_exit;
-	if (flock(ctx->lockfd, (ctx->readonly ? LOCK_SH : LOCK_EX)) < 0)
+	devsize = (layout->from_end ? lseek(ctx->fd, 0, SEEK_END) : 0);
+	if (devsize < 0)
 		goto failure_exit;
-
 	for (i = 0; i < ctx->offset_count; i++) {
-		/*
-		 * Read base block
-		 */
-		if (lseek(ctx->fd, ctx->devinfo_offset[i], SEEK_END) < 0)
-			continue;
-		for (n = 0; n < DEVINFO_BLOCK_SIZE; n += cnt) {
-			cnt = read(ctx->fd, &ctx->infobuf[i][n], DEVINFO_BLOCK_SIZE-n);
-			if (cnt < 0)
+		ctx->devinfo_offset[i] = devsize + layout->devinfo_offset[i];
+		ctx->extension_offset[i] = devsize + layout->extension_offset[i];
+	}
+	return ctx;
+
+failure_exit:
+	free_context(ctx);
+	return NULL;
+
+} /* open_copies */
+
+/*
+ * Reads of the bootinfo copies are batched, so that
+ * copies stored near each other on the device are
+ * read with a single preadv(). Gaps between them of
+ * up to this size are read into a scratch buffer
+ * rather than splitting the read.
+ */
+#define READ_GAP_MAX 65536
+
+struct read_req_s {
+	off_t offset;
+	size_t len;
+	uint8_t *buf;
+	bool ok;
+};
+
+/*
+ * read_batch
+ *
+ * Reads a set of ranges from a device, sorting them by
+ * offset and merging nearby ones into a single preadv()
+ * call. Each request's ok flag is set if its range was
+ * read completely.
+ *
+ * fd: file descriptor
+ * reqs: array of read requests
+ * count: number of requests (at most MAX_OFFSET_COUNT)
+ *
+ * Returns: nothing
+ */
+static void
+read_batch (int fd, struct read_req_s *reqs, unsigned int count)
+{
+	static uint8_t gapbuf[READ_GAP_MAX];
+	struct read_req_s *order[MAX_OFFSET_COUNT], *tmp;
+	struct iovec iov[MAX_OFFSET_COUNT*2];
+	unsigned int i, j, first, iovcnt;
+	off_t spanstart, spanend;
+	ssize_t n;
+
+	for (i = 0; i < count; i++) {
+		reqs[i].ok = false;
+		order[i] = &reqs[i];
+		for (j = i; j > 0 && order[j]->offset < order[j-1]->offset; j--) {
+			tmp = order[j];
+			order[j] = order[j-1];
+			order[j-1] = tmp;
+		}
+	}
+	for (first = 0; first < count; first = i) {
+		spanstart = order[first]->offset;
+		spanend = spanstart + order[first]->len;
+		iov[0].iov_base = order[first]->buf;
+		iov[0].iov_len = order[first]->len;
+		iovcnt = 1;
+		for (i = first + 1; i < count; i++) {
+			if (order[i]->offset < spanend || order[i]->offset - spanend > READ_GAP_MAX)
 				break;
+			if (order[i]->offset > spanend) {
+				iov[iovcnt].iov_base = gapbuf;
+				iov[iovcnt].iov_len = order[i]->offset - spanend;
+				iovcnt += 1;
+			}
+			iov[iovcnt].iov_base = order[i]->buf;
+			iov[iovcnt].iov_len = order[i]->len;
+			iovcnt += 1;
+			spanend = order[i]->offset + order[i]->len;
 		}
-		if (n < DEVINFO_BLOCK_SIZE)
+		do {
+			n = preadv(fd, iov, iovcnt, spanstart);
+		} while (n < 0 && errno == EINTR);
+		for (j = first; j < i; j++)
+			order[j]->ok = (n >= 0 && order[j]->offset + (off_t) order[j]->len <= spanstart + n);
+	}
+
+} /* read_batch */
+
+/*
+ * read_copies
+ *
+ * Reads in all of the bootinfo copies for a context,
+ * converting older layouts to the current one, and
+ * marks the ones that are valid.
+ *
+ * The base blocks for all copies are read in one batch;
+ * the extensions are then read, in a second batch, only
+ * for the copies whose base block looks valid.
+ */
+static void
+read_copies (struct bootinfo_context_s *ctx)
+{
+	struct device_info *dp;
+	struct read_req_s reqs[MAX_OFFSET_COUNT];
+	int extidx[MAX_OFFSET_COUNT];
+	unsigned int extcount = 0;
+	uint32_t crcsum;
+	int i;
+
+	for (i = 0; i < ctx->offset_count; i++) {
+		reqs[i].offset = ctx->devinfo_offset[i];
+		reqs[i].len = DEVINFO_BLOCK_SIZE;
+		reqs[i].buf = ctx->infobuf[i];
+	}
+	read_batch(ctx->fd, reqs, ctx->offset_count);
+
+	for (i = 0; i < ctx->offset_count; i++) {
+		if (!reqs[i].ok)
 			continue;
 
 		dp = (struct device_info *)(ctx->infobuf[i]);
 
 		if (memcmp(dp->magic, DEVICE_MAGIC, DEVICE_MAGIC_SIZE) != 0)
 			continue;
+		ctx->formatted = true;
 		/*
 		 * Automatically convert older layouts to current:
 		 *
@@ -610,59 +1009,216 @@ bootinfo_open (unsigned int flags, struct bootinfo_context_s **ctxp)
 			uint8_t inprogress = dp->flags;
 			dp->flags = (inprogress != 0 ? FLAG_BOOT_IN_PROGRESS : 0);
 			ctx->valid[i] = true;
-			memset(ctx->infobuf[i] + sizeof(struct device_info), 0, DEVINFO_BLOCK_SIZE+EXTENSION_SIZE-sizeof(struct device_info));
-			dp->ext_sectors = EXTENSION_SECTOR_COUNT;
+			memset(ctx->infobuf[i] + sizeof(struct device_info), 0, ctx->infosize-sizeof(struct device_info));
+			dp->ext_sectors = ctx->ext_sectors;
 			dp->devinfo_version = DEVINFO_VERSION_CURRENT;
 			continue;
 		}
 		if (dp->devinfo_version == DEVINFO_VERSION_OLD) {
-			uint32_t crcsum = dp->crcsum;
+			crcsum = dp->crcsum;
 			dp->crcsum = 0;
 			if (crc32(0, ctx->infobuf[i], DEVINFO_BLOCK_SIZE) != crcsum)
 				continue;
 			ctx->valid[i] = true;
-			memset(ctx->infobuf[i] + DEVINFO_BLOCK_SIZE, 0, EXTENSION_SIZE);
-			dp->ext_sectors = EXTENSION_SECTOR_COUNT;
+			memset(ctx->infobuf[i] + DEVINFO_BLOCK_SIZE, 0, ctx->ext_size);
+			dp->ext_sectors = ctx->ext_sectors;
 			dp->devinfo_version = DEVINFO_VERSION_CURRENT;
 			continue;
 		}
-		if (dp->devinfo_version >= DEVINFO_VERSION_CURRENT) {
-			uint32_t crcsum;
-			if (dp->ext_sectors != EXTENSION_SECTOR_COUNT) {
-				fprintf(stderr, "warning: extension size mismatch\n");
-				continue;
-			}
-			/*
-			 * Read extension block
-			 */
-			if (lseek(ctx->fd, ctx->extension_offset[i], SEEK_END) < 0)
-				continue;
-			for (n = 0; n < EXTENSION_SIZE; n += cnt) {
-				cnt = read(ctx->fd, &ctx->infobuf[i][DEVINFO_BLOCK_SIZE+n], EXTENSION_SIZE-n);
-				if (cnt < 0)
-					break;
-			}
-			if (n < EXTENSION_SIZE)
-				continue;
-			crcsum = *(uint32_t *)(&ctx->infobuf[i][DEVINFO_BLOCK_SIZE+EXTENSION_SIZE-sizeof(uint32_t)]);
-			if (crc32(0, &ctx->infobuf[i][DEVINFO_BLOCK_SIZE], EXTENSION_SIZE-sizeof(uint32_t)) != crcsum)
-				continue;
-		} else
+		if (dp->devinfo_version < DEVINFO_VERSION_CURRENT)
 			continue; /* unrecognized version */
+		if (dp->ext_sectors != ctx->ext_sectors) {
+			fprintf(stderr, "warning: extension size mismatch\n");
+			continue;
+		}
+		/*
+		 * Extension block needed
+		 */
+		reqs[extcount].offset = ctx->extension_offset[i];
+		reqs[extcount].len = ctx->ext_size;
+		reqs[extcount].buf = &ctx->infobuf[i][DEVINFO_BLOCK_SIZE];
+		extidx[extcount++] = i;
+	}
+	if (extcount == 0)
+		return;
+
+	read_batch(ctx->fd, reqs, extcount);
+	while (extcount-- > 0) {
+		if (!reqs[extcount].ok)
+			continue;
+		i = extidx[extcount];
+		crcsum = *(uint32_t *)(&ctx->infobuf[i][ctx->infosize-sizeof(uint32_t)]);
+		if (crc32(0, &ctx->infobuf[i][DEVINFO_BLOCK_SIZE], ctx->ext_size-sizeof(uint32_t)) != crcsum)
+			continue;
 		ctx->valid[i] = true;
 	}
+
+} /* read_copies */
+
+/*
+ * select_current
+ *
+ * Chooses the current block based on which is valid,
+ * and if both of the first two are, which has the
+ * higher serial number.
+ *
+ * Returns: index of current block, or -1 if none are valid
+ */
+static int
+select_current (struct bootinfo_context_s *ctx)
+{
+	struct device_info *dp, *dp1;
+	int i;
+
+	for (i = 0; i < ctx->offset_count && !ctx->valid[i]; i++);
+	if (i >= ctx->offset_count)
+		return -1;
+	if (i < 2 && ctx->valid[1-i]) {
+		/* both of the first two are valid */
+		dp = (struct device_info *) (ctx->infobuf[0]);
+		dp1 = (struct device_info *) (ctx->infobuf[1]);
+		if (dp->sernum == 255 && dp1->sernum == 0)
+			return 1;
+		if (dp1->sernum == 255 && dp->sernum == 0)
+			return 0;
+		return (dp1->sernum > dp->sernum ? 1 : 0);
+	}
+	return i;
+
+} /* select_current */
+
+/*
+ * migrate_storage
+ *
+ * Copies the current bootinfo block from its previous
+ * storage location into both copies in a newly-set-up
+ * location. The caller must hold the lock. The old
+ * copies are left in place.
+ *
+ * ctx: context for the new location
+ * from: layout of the previous location
+ *
+ * Returns 0 on success, -1 on error (errno set)
+ */
+static int
+migrate_storage (struct bootinfo_context_s *ctx, const struct storage_layout_s *from)
+{
+	struct bootinfo_context_s *oldctx;
+	struct device_info *dp;
+	int current, i, ret = -1;
+
+	oldctx = open_copies(from, true);
+	if (oldctx == NULL)
+		return -1;
+	read_copies(oldctx);
+	current = select_current(oldctx);
+	if (current < 0) {
+		errno = ENODATA;
+		goto depart;
+	}
+	/*
+	 * The new extension is at least as large as the old one,
+	 * so the variables carry over as-is.
+	 */
+	memset(ctx->infobuf[0], 0, ctx->infosize);
+	memcpy(ctx->infobuf[0], oldctx->infobuf[current], oldctx->infosize - sizeof(uint32_t));
+	dp = (struct device_info *) ctx->infobuf[0];
+	dp->devinfo_version = DEVINFO_VERSION_CURRENT;
+	dp->ext_sectors = ctx->ext_sectors;
+	seal_block(ctx, ctx->infobuf[0]);
+	for (i = 0; i < 2; i++)
+		if (write_copy(ctx, i, ctx->infobuf[0]) < 0)
+			goto depart;
+	memcpy(ctx->infobuf[1], ctx->infobuf[0], ctx->infosize);
+	ctx->valid[0] = ctx->valid[1] = true;
+	ret = 0;
+
+  depart:
+	free_context(oldctx);
+	return ret;
+
+} /* migrate_storage */
+
+/*
+ * open_storage
+ *
+ * The guts of bootinfo_open(), once the storage
+ * location has been identified.
+ *
+ * flags: flags passed to bootinfo_open()
+ * layout: storage layout
+ * migrate_from: previous storage layout to migrate from
+ *               if no valid copies are found (may be NULL)
+ * ctxp: pointer to context pointer to be filled in
+ *
+ * Returns 0 on success, -1 on error (errno set)
+ */
+static int
+open_storage (unsigned int flags, const struct storage_layout_s *layout,
+	      const struct storage_layout_s *migrate_from,
+	      struct bootinfo_context_s **ctxp)
+{
+	struct bootinfo_context_s *ctx;
+	int current, dirfd;
+
+	*ctxp = NULL;
+	ctx = open_copies(layout, (flags & BOOTINFO_O_ACCMODE) == BOOTINFO_O_RDONLY);
+	if (ctx == NULL)
+		return -1;
+	/*
+	 * We use a lockfile to coordinate access to the bootinfo block
+	 * from multiple processes
+	 */
+	dirfd = open(bootinfo_lockdir, O_PATH);
+	if (dirfd < 0) {
+		if (mkdir(bootinfo_lockdir, 02770) < 0)
+			goto failure_exit;
+		dirfd = open(bootinfo_lockdir, O_PATH);
+		if (dirfd < 0)
+			goto failure_exit;
+	}
+	ctx->lockfd = openat(dirfd, "lockfile", O_CREAT|O_RDWR, 0770);
+	close(dirfd);
+	if (ctx->lockfd < 0)
+		goto failure_exit;
+	if (flock(ctx->lockfd, (ctx->readonly ? LOCK_SH : LOCK_EX)) < 0)
+		goto failure_exit;
+	/*
+	 * Another process may have updated the blocks since
+	 * we last read them, so drop anything cached now that
+	 * we hold the lock.
+	 */
+	blkcache_invalidate(ctx->fd, 0, 0);
+
+	read_copies(ctx);
+	current = select_current(ctx);
+	/*
+	 * Once this location holds bootinfo blocks, the previous
+	 * location is stale, so if none of the copies here are
+	 * usable, fail rather than go back to it. Only an
+	 * explicit reinitialization gets past this.
+	 */
+	if (current < 0 && migrate_from != NULL && ctx->formatted &&
+	    (flags & BOOTINFO_O_FORCE_INIT) == 0) {
+		fprintf(stderr, "error: bootinfo copies on %s are damaged\n", layout->devname);
+		errno = EBADMSG;
+		goto failure_exit;
+	}
+	/*
+	 * Nothing here yet, so bring over what is in the
+	 * previous location (unless we're reinitializing).
+	 */
+	if (current < 0 && migrate_from != NULL && !ctx->readonly &&
+	    (flags & BOOTINFO_O_FORCE_INIT) == 0 &&
+	    migrate_storage(ctx, migrate_from) == 0)
+		current = select_current(ctx);
 	/*
 	 * Caller can pass the CREAT flag to tell us to try
 	 * initializing if no valid data is found, and add the
 	 * FORCE_INIT flag to tell us to initialize even if valid
 	 * data is found.
-	 *
-	 * Otherwise, choose the current block based on
-	 * which is valid, and if both, which has the
-	 * higher serial number.
 	 */
-	for (i = 0; i < ctx->offset_count && !ctx->valid[i]; i++);
-	if (i >= ctx->offset_count) {
+	if (current < 0) {
 		if (flags & BOOTINFO_O_CREAT) {
 			if (boot_devinfo_init(ctx) < 0)
 				goto failure_exit;
@@ -677,20 +1233,8 @@ bootinfo_open (unsigned int flags, struct bootinfo_context_s **ctxp)
 			goto failure_exit;
 		ctx->current = 0;
 		/* If successful, fall through */
-	} else if (i < 2 && ctx->valid[1-i]) {
-		/* both of the first two are valid */
-		struct device_info *dp1 = (struct device_info *) (ctx->infobuf[1]);
-		dp = (struct device_info *) (ctx->infobuf[0]);
-		if (dp->sernum == 255 && dp1->sernum == 0)
-			ctx->current = 1;
-		else if (dp1->sernum == 255 && dp->sernum == 0)
-			ctx->current = 0;
-		else if (dp1->sernum > dp->sernum)
-			ctx->current = 1;
-		else
-			ctx->current = 0;
 	} else
-		ctx->current = i;
+		ctx->current = current;
 	memcpy(&ctx->curinfo, ctx->infobuf[ctx->current], sizeof(ctx->curinfo));
 	if (parse_vars(ctx) < 0) {
 		/* internal error ? */
@@ -700,17 +1244,61 @@ bootinfo_open (unsigned int flags, struct bootinfo_context_s **ctxp)
 	return 0;
 
 failure_exit:
-	if (ctx) {
-		if (ctx->lockfd >= 0)
-			close(ctx->lockfd);
-		if (ctx->fd >= 0)
-			close(ctx->fd);
-		if (ctx->reset_bootdev_status)
-			set_bootdev_writeable_status(ctx->devinfo_dev, false);
-		free(ctx);
-	}
+	free_context(ctx);
 	return -1;
 
+} /* open_storage */
+
+/*
+ * bootinfo_open
+ *
+ * Tries to find a valid bootinfo block, and initializes a context
+ * if one is found.
+ *
+ * If a bootinfo partition is configured and present, it is used,
+ * with the contents of the boot device copies migrated into it
+ * the first time it is opened for writing. Until then, read-only
+ * opens use the boot device copies. After that, the boot device
+ * copies are never used again: if neither copy in the partition
+ * is valid, the open fails (errno EBADMSG) unless the
+ * BOOTINFO_O_FORCE_INIT flag is passed.
+ *
+ * Returns negative value on an underlying error or if neither block
+ * is valid.
+ *
+ * Returns 0 on success, and ctxp will be set to point to a valid
+ * context.  Caller MUST call bootinfo_close to clean up the context.
+ *
+ */
+int
+bootinfo_open (unsigned int flags, struct bootinfo_context_s **ctxp)
+{
+	struct storage_layout_s layout, legacy;
+	unsigned long chipid;
+	const char *devname;
+	bool use_partition, have_legacy;
+
+	*ctxp = NULL;
+	chipid = identify_chip();
+	if (chipid != 0x21 && chipid != 0x18 && chipid != 0x19) {
+		errno = ENODEV;
+		return -1;
+	}
+	use_partition = partition_layout(&layout, (flags & BOOTINFO_O_ACCMODE) == BOOTINFO_O_RDONLY) == 0;
+	if (!use_partition && errno != ENOENT)
+		return -1;
+	devname = find_storage_dev();
+	have_legacy = devname != NULL && legacy_layout(chipid, devname, &legacy) == 0;
+	if (use_partition) {
+		if (open_storage(flags, &layout, (have_legacy ? &legacy : NULL), ctxp) == 0)
+			return 0;
+		if (errno != ENODATA || !have_legacy)
+			return -1;
+	}
+	if (!have_legacy)
+		return -1;
+	return open_storage(flags, &legacy, NULL, ctxp);
+
 } /* bootinfo_open */
 
 /*
@@ -726,16 +1314,8 @@ bootinfo_close (struct bootinfo_context_s *ctx)
 		return ret;
 	if (ctx->dirty)
 		ret = update_bootinfo(ctx);
-	if (ctx->lockfd >= 0)
-		close(ctx->lockfd);
-	if (ctx->fd >= 0)
-		close(ctx->fd);
-	if (ctx->reset_bootdev_status)
-		set_bootdev_writeable_status(ctx->devinfo_dev, false);
-	ctx->fd = -1;
-	ctx->lockfd = -1;
 	free_vars(ctx);
-	free(ctx);
+	free_context(ctx);
 
 	return ret;
 
@@ -1001,8 +1581,8 @@ bootinfo_var_set (bootinfo_context_t *ctx, const char *name, const char *value)
 			}
 		}
 		vallen = cp - value;
-		if (vallen >= MAX_VALUE_SIZE ||
-		    ctx->varsize + namelen + vallen + 2 > MAX_VALUE_SIZE) {
+		if (vallen >= MAX_VALUE_SIZE(ctx) ||
+		    ctx->varsize + namelen + vallen + 2 > MAX_VALUE_SIZE(ctx)) {
 			errno = ENOSPC;
 			return -1;
 		}
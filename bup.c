@@ -93,33 +93,60 @@ struct bup_ods_entry_s {
 } __attribute__((packed));
 
 /*
- * BUP entry - structure for use in context
- *
- * Mirrors the on-disk structure, but adds
- * room for null terminators on strings and
- * isn't packed.
+ * Reference to a (stripped, not null-terminated)
+ * string in the on-disk entries, used while
+ * interning.
  */
-struct bup_entry_s {
-	uint32_t offset;
-	uint32_t length;
-	uint32_t version;
-	uint32_t op_mode;
-	char partition[41];
-	char spec[65];
+struct strref_s {
+	const char *str;
+	uint32_t len;
+};
+
+/*
+ * Hash table for interning strings while loading
+ * the entries. Slots hold the string ID plus one,
+ * or zero if empty.
+ */
+struct intern_table_s {
+	uint32_t *slots;
+	uint32_t mask;
+	struct strref_s *refs;
+	uint32_t count;
 };
 
 /*
  * API context
+ *
+ * The entry table is built by bup_init() in a single
+ * arena allocation. Entry fields are held in parallel
+ * arrays, and partition names and spec strings are
+ * interned: each distinct string is stored once, stripped
+ * and null-terminated, and entries refer to it by ID, so
+ * names compare as integers. Each distinct spec is matched
+ * against our TNSPEC and compatibility spec just once,
+ * when the payload is loaded.
  */
 struct bup_context_s {
 	int fd;
-	void *buffer;
+	void *arena;
+	unsigned int header_version;
 	char our_spec_str[128];
 	struct tnspec_s our_tnspec;
 	char compat_spec_str[128];
 	struct tnspec_s compat_spec;
 	unsigned int entry_count;
-	struct bup_entry_s *entries;
+	uint32_t *offsets;
+	uint32_t *lengths;
+	uint32_t *versions;
+	uint32_t *op_modes;
+	uint32_t *name_ids;
+	uint32_t *spec_ids;
+	unsigned int name_count;
+	const char **names;
+	uint8_t *name_state;
+	unsigned int spec_count;
+	const char **specs;
+	bool *spec_matches;
 };
 
 static const uint8_t bup_magic[16] = "NVIDIA__BLOB__V2";
@@ -230,26 +257,88 @@ specs_match (const struct tnspec_s *e, const struct tnspec_s *s)
 } /* specs_match */
 
 /*
- * rstrip
+ * stripped_len
  *
  * Strings in BUP payload entries can be right-padded with
- * blanks, tabs, or nulls. Copies the string from the entry
- * while stripping any padding characters off the right.
+ * blanks, tabs, or nulls. Returns the length of the string
+ * in the entry with any padding characters stripped off
+ * the right.
+ */
+static uint32_t
+stripped_len (const char *in, size_t len)
+{
+	const char *cp;
+	size_t n = strnlen(in, len);
+
+	if ((cp = memchr(in, ' ', n)) != NULL)
+		n = cp - in;
+	if ((cp = memchr(in, '\t', n)) != NULL)
+		n = cp - in;
+	return n;
+
+} /* stripped_len */
+
+/*
+ * intern
  *
- * out is assumed to be of size len+1 (or larger).
+ * Looks up a string in an interning table, adding
+ * it if it is not already there.
+ *
+ * Returns: ID of the string
  */
-static void
-rstrip (char *out, const char *in, size_t len)
-{	char *outp = out;
-	const char *inp = in;
+static uint32_t
+intern (struct intern_table_s *tbl, const char *str, uint32_t len)
+{
+	uint64_t hash = len, word;
+	uint32_t i, id;
+
+	/*
+	 * Hash a word at a time; these strings are mostly
+	 * long, similar TNSPECs.
+	 */
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&word, str + i, 8);
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < len; i++)
+		hash = (hash ^ (uint8_t) str[i]) * 0x100000001b3ULL;
+	hash ^= hash >> 32;
+	for (i = hash & tbl->mask; tbl->slots[i] != 0; i = (i + 1) & tbl->mask) {
+		id = tbl->slots[i] - 1;
+		if (tbl->refs[id].len == len && memcmp(tbl->refs[id].str, str, len) == 0)
+			return id;
+	}
+	id = tbl->count++;
+	tbl->refs[id].str = str;
+	tbl->refs[id].len = len;
+	tbl->slots[i] = id + 1;
+	return id;
+
+} /* intern */
 
-	while (len > 0 && !(*inp == '\0' || *inp == '\t' || *inp == ' ')) {
-		*outp++ = *inp++;
-		len--;
+/*
+ * store_strings
+ *
+ * Copies interned strings into the arena, null-terminated,
+ * filling in the table of pointers to them.
+ *
+ * Returns: pointer to the arena space after the strings
+ */
+static char *
+store_strings (struct intern_table_s *tbl, const char **ptrs, char *cp)
+{
+	uint32_t id;
+
+	for (id = 0; id < tbl->count; id++) {
+		memcpy(cp, tbl->refs[id].str, tbl->refs[id].len);
+		cp[tbl->refs[id].len] = '\0';
+		ptrs[id] = cp;
+		cp += tbl->refs[id].len + 1;
 	}
-	*outp = '\0';
+	return cp;
 
-} /* rstrip */
+} /* store_strings */
 
 /*
  * construct_tnspec
@@ -547,50 +636,49 @@ free_context (bup_context_t *ctx)
 {
 	if (ctx->fd >= 0)
 		close(ctx->fd);
-	if (ctx->entries)
-		free(ctx->entries);
-	if (ctx->buffer != NULL)
-		free(ctx->buffer);
+	if (ctx->arena != NULL)
+		free(ctx->arena);
 	free(ctx);
 } /* free_context */
 
 /*
- * bup_init
+ * load_payload
  *
- * Initialize BUP payload context.
+ * Opens a payload and builds the entry table
+ * in the context. The context's TNSPEC and
+ * compatibility spec must already be set up.
  *
- * Header and the payload's directory entries
- * are validated and stored in the context.
+ * ctx: context
+ * pathname: pathname of the payload
+ * openfd: descriptor already open on the payload (the
+ *         context uses a duplicate of it), or -1 to
+ *         open pathname
+ *
+ * Returns: the context, or NULL on error
+ *          (the context is freed)
  */
-bup_context_t *
-bup_init (const char *pathname)
+static bup_context_t *
+load_payload (bup_context_t *ctx, const char *pathname, int openfd)
 {
 	int fd;
-	ssize_t n, totsize;
-	bup_context_t *ctx;
-	struct bup_header_s *hdr;
+	ssize_t n;
+	size_t total, entsize, strbytes, arenasize;
+	struct bup_header_s hdr;
+	struct bup_ods_entry_s *odsents;
+	struct intern_table_s names, specs;
+	struct tnspec_s entspec;
 	struct stat st;
 	off_t payload_size;
-	uint8_t *bufp;
-	int i;
-
-	ctx = malloc(sizeof(*ctx));
-	if (ctx == NULL)
-		return NULL;
-	memset(ctx, 0, sizeof(*ctx));
-	ctx->fd = -1;
-	if (construct_tnspec(ctx->our_spec_str, sizeof(ctx->our_spec_str)) < 0) {
-		free_context(ctx);
-		return NULL;
-	}
-	spec_split(ctx->our_spec_str, &ctx->our_tnspec);
-	generate_compat_spec(&ctx->our_tnspec, &ctx->compat_spec,
-			     ctx->compat_spec_str, sizeof(ctx->compat_spec_str));
-
-	if (pathname == NULL)
-		return ctx;
-
-	fd = open(pathname, O_RDONLY);
+	uint32_t *name_ids, *spec_ids;
+	uint32_t i, nslots;
+	void *scratch;
+	uint8_t *ap;
+	char *cp;
+
+	if (openfd < 0)
+		fd = open(pathname, O_RDONLY|O_CLOEXEC);
+	else
+		fd = fcntl(openfd, F_DUPFD_CLOEXEC, 0);
 	if (fd < 0) {
 		free_context(ctx);
 		return NULL;
@@ -602,90 +690,256 @@ bup_init (const char *pathname)
 	}
 	payload_size = st.st_size;
 
-	ctx->buffer = malloc(payload_size);
-	if (ctx->buffer == NULL) {
-		free_context(ctx);
-		return NULL;
-	}
-
-	n = read(fd, ctx->buffer, payload_size);
-	if (n < sizeof(struct bup_header_s)) {
+	n = pread(fd, &hdr, sizeof(hdr), 0);
+	if (n < (ssize_t) sizeof(hdr)) {
 		free_context(ctx);
 		return NULL;
 	}
-	hdr = ctx->buffer;
-	if (memcmp(hdr->magic, bup_magic, sizeof(hdr->magic)) != 0) {
+	if (memcmp(hdr.magic, bup_magic, sizeof(hdr.magic)) != 0) {
 		fprintf(stderr, "%s: bad header magic\n", pathname);
 		free_context(ctx);
 		return NULL;
 	}
-	if (BUP_VERSION_MAJOR(hdr->version) != expected_major_version ||
-	    BUP_VERSION_MINOR(hdr->version) > max_minor_version) {
+	if (BUP_VERSION_MAJOR(hdr.version) != expected_major_version ||
+	    BUP_VERSION_MINOR(hdr.version) > max_minor_version) {
 		char verstr[64];
-		bup_version_string(verstr, sizeof(verstr), hdr->version);
+		bup_version_string(verstr, sizeof(verstr), hdr.version);
 		fprintf(stderr, "%s: unsupported BUP version %s\n", pathname, verstr);
 		free_context(ctx);
 		return NULL;
 	}
-	if (hdr->blob_type != 0) {
+	if (hdr.blob_type != 0) {
 		fprintf(stderr, "%s: bad blob type\n", pathname);
 		free_context(ctx);
 		return NULL;
 	}
-	if (hdr->header_size < sizeof(struct bup_header_s)) {
+	ctx->header_version = hdr.version;
+	if (hdr.header_size < sizeof(struct bup_header_s)) {
 		fprintf(stderr, "%s: bad header length\n", pathname);
 		free_context(ctx);
 		return NULL;
 	}
-	totsize = hdr->header_size + hdr->entry_count * sizeof(struct bup_ods_entry_s);
-	if (totsize > payload_size) {
+	entsize = (size_t) hdr.entry_count * sizeof(struct bup_ods_entry_s);
+	if (hdr.header_size + entsize > payload_size) {
 		fprintf(stderr, "%s: cannot load all update entries\n", pathname);
 		free_context(ctx);
 		return NULL;
 	}
-	while (totsize > n) {
-		ssize_t rlen = read(fd, (uint8_t *)ctx->buffer + n, totsize - n);
-		if (rlen < 0) {
+
+	/*
+	 * Scratch space, freed once the arena is built: the
+	 * on-disk entries, the interning hash tables, and the
+	 * string IDs for each entry.
+	 */
+	for (nslots = 16; nslots < 2 * hdr.entry_count; nslots <<= 1);
+	scratch = malloc(entsize + 2 * nslots * sizeof(uint32_t) +
+			 2 * (size_t) hdr.entry_count * (sizeof(struct strref_s) + sizeof(uint32_t)));
+	if (scratch == NULL) {
+		free_context(ctx);
+		return NULL;
+	}
+	odsents = scratch;
+	names.slots = (uint32_t *) ((uint8_t *) scratch + entsize);
+	memset(names.slots, 0, 2 * nslots * sizeof(uint32_t));
+	specs.slots = names.slots + nslots;
+	names.mask = specs.mask = nslots - 1;
+	names.refs = (struct strref_s *) (specs.slots + nslots);
+	specs.refs = names.refs + hdr.entry_count;
+	name_ids = (uint32_t *) (specs.refs + hdr.entry_count);
+	spec_ids = name_ids + hdr.entry_count;
+	names.count = specs.count = 0;
+
+	for (total = 0; total < entsize; total += n) {
+		n = pread(fd, (uint8_t *) odsents + total, entsize - total, hdr.header_size + total);
+		if (n <= 0) {
+			if (n == 0)
+				fprintf(stderr, "%s: premature EOF\n", pathname);
+			free(scratch);
 			free_context(ctx);
 			return NULL;
 		}
-		if (rlen == 0) {
-			fprintf(stderr, "%s: premature EOF\n", pathname);
+	}
+	for (i = 0; i < hdr.entry_count; i++) {
+		struct bup_ods_entry_s *odsent = &odsents[i];
+		uint32_t namelen = stripped_len(odsent->partition, sizeof(odsent->partition));
+		if (odsent->offset > payload_size ||
+		    (off_t) odsent->offset + odsent->length > payload_size) {
+			fprintf(stderr, "%s: entry %u (%.*s) beyond end of file\n",
+				pathname, i, (int) namelen, odsent->partition);
+			free(scratch);
 			free_context(ctx);
 			return NULL;
 		}
-		n += rlen;
+		name_ids[i] = intern(&names, odsent->partition, namelen);
+		spec_ids[i] = intern(&specs, odsent->spec, stripped_len(odsent->spec, sizeof(odsent->spec)));
 	}
-	ctx->entries = malloc(hdr->entry_count * sizeof(struct bup_entry_s));
-	if (ctx->entries == NULL) {
+
+	/*
+	 * Arena layout: string pointer tables, entry
+	 * field arrays, per-string flags, then the strings.
+	 */
+	for (i = 0, strbytes = 0; i < names.count; i++)
+		strbytes += names.refs[i].len + 1;
+	for (i = 0; i < specs.count; i++)
+		strbytes += specs.refs[i].len + 1;
+	arenasize = (names.count + specs.count) * sizeof(const char *) +
+		6 * (size_t) hdr.entry_count * sizeof(uint32_t) +
+		names.count * sizeof(uint8_t) + specs.count * sizeof(bool) + strbytes;
+	ctx->arena = malloc(arenasize == 0 ? 1 : arenasize);
+	if (ctx->arena == NULL) {
+		free(scratch);
 		free_context(ctx);
 		return NULL;
 	}
-
-	ctx->entry_count = hdr->entry_count;
-	for (i = 0, bufp = (uint8_t *)ctx->buffer + hdr->header_size;
-	     i < ctx->entry_count;
-	     i++, bufp += sizeof(struct bup_ods_entry_s)) {
-		struct bup_ods_entry_s *odsent = (struct bup_ods_entry_s *) bufp;
-		rstrip(ctx->entries[i].partition, odsent->partition, sizeof(odsent->partition));
-		rstrip(ctx->entries[i].spec, odsent->spec, sizeof(odsent->spec));
-		ctx->entries[i].offset = odsent->offset;
-		ctx->entries[i].length = odsent->length;
-		ctx->entries[i].version = odsent->version;
-		ctx->entries[i].op_mode = odsent->op_mode;
-		if (ctx->entries[i].offset > payload_size ||
-		    ctx->entries[i].offset + ctx->entries[i].length > payload_size) {
-			fprintf(stderr, "%s: entry %d (%s) beyond end of file\n",
-				pathname, i, ctx->entries[i].partition);
-			free_context(ctx);
-			return NULL;
-		}
+	ap = ctx->arena;
+	ctx->names = (const char **) ap;
+	ap += names.count * sizeof(const char *);
+	ctx->specs = (const char **) ap;
+	ap += specs.count * sizeof(const char *);
+	ctx->offsets = (uint32_t *) ap;
+	ctx->lengths = ctx->offsets + hdr.entry_count;
+	ctx->versions = ctx->lengths + hdr.entry_count;
+	ctx->op_modes = ctx->versions + hdr.entry_count;
+	ctx->name_ids = ctx->op_modes + hdr.entry_count;
+	ctx->spec_ids = ctx->name_ids + hdr.entry_count;
+	ap = (uint8_t *) (ctx->spec_ids + hdr.entry_count);
+	ctx->name_state = ap;
+	ap += names.count * sizeof(uint8_t);
+	ctx->spec_matches = (bool *) ap;
+	ap += specs.count * sizeof(bool);
+	cp = store_strings(&names, ctx->names, (char *) ap);
+	store_strings(&specs, ctx->specs, cp);
+
+	ctx->entry_count = hdr.entry_count;
+	ctx->name_count = names.count;
+	ctx->spec_count = specs.count;
+	for (i = 0; i < ctx->entry_count; i++) {
+		ctx->offsets[i] = odsents[i].offset;
+		ctx->lengths[i] = odsents[i].length;
+		ctx->versions[i] = odsents[i].version;
+		ctx->op_modes[i] = odsents[i].op_mode;
+	}
+	memcpy(ctx->name_ids, name_ids, ctx->entry_count * sizeof(uint32_t));
+	memcpy(ctx->spec_ids, spec_ids, ctx->entry_count * sizeof(uint32_t));
+	free(scratch);
+
+	for (i = 0; i < ctx->spec_count; i++) {
+		spec_split(ctx->specs[i], &entspec);
+		ctx->spec_matches[i] = (specs_match(&entspec, &ctx->our_tnspec) ||
+					(ctx->compat_spec.field_count > 0 && specs_match(&entspec, &ctx->compat_spec)));
 	}
 
 	return ctx;
 
+} /* load_payload */
+
+/*
+ * bup_init
+ *
+ * Initialize BUP payload context.
+ *
+ * Header and the payload's directory entries
+ * are validated and stored in the context.
+ */
+bup_context_t *
+bup_init (const char *pathname)
+{
+	bup_context_t *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = -1;
+	if (construct_tnspec(ctx->our_spec_str, sizeof(ctx->our_spec_str)) < 0) {
+		free_context(ctx);
+		return NULL;
+	}
+	spec_split(ctx->our_spec_str, &ctx->our_tnspec);
+	generate_compat_spec(&ctx->our_tnspec, &ctx->compat_spec,
+			     ctx->compat_spec_str, sizeof(ctx->compat_spec_str));
+
+	if (pathname == NULL)
+		return ctx;
+	return load_payload(ctx, pathname, -1);
+
 } /* bup_init */
 
+/*
+ * tnspec_context
+ *
+ * Allocates a context for matching against a given
+ * TNSPEC.
+ *
+ * Returns: the context, or NULL on error
+ */
+static bup_context_t *
+tnspec_context (const char *tnspec)
+{
+	bup_context_t *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = -1;
+	if (strlen(tnspec) >= sizeof(ctx->our_spec_str)) {
+		free_context(ctx);
+		return NULL;
+	}
+	strcpy(ctx->our_spec_str, tnspec);
+	spec_split(ctx->our_spec_str, &ctx->our_tnspec);
+	generate_compat_spec(&ctx->our_tnspec, &ctx->compat_spec,
+			     ctx->compat_spec_str, sizeof(ctx->compat_spec_str));
+	return ctx;
+
+} /* tnspec_context */
+
+/*
+ * bup_init_for_tnspec
+ *
+ * Initialize BUP payload context for matching against
+ * a given TNSPEC, rather than the one for the system we
+ * are running on. Does not need the EEPROM or our
+ * configuration files, so can be used for examining
+ * payloads on another host. An empty TNSPEC matches only
+ * the entries that have no spec.
+ */
+bup_context_t *
+bup_init_for_tnspec (const char *pathname, const char *tnspec)
+{
+	bup_context_t *ctx = tnspec_context(tnspec);
+
+	if (ctx == NULL)
+		return NULL;
+	return load_payload(ctx, pathname, -1);
+
+} /* bup_init_for_tnspec */
+
+/*
+ * bup_init_fd_for_tnspec
+ *
+ * As bup_init_for_tnspec(), but for a payload the caller
+ * already has open, so the entries are guaranteed to come
+ * from that file even if the path has since been replaced.
+ * The descriptor is duplicated; the caller keeps its own,
+ * and the file position is not used.
+ *
+ * fd: descriptor open on the payload
+ * pathname: pathname of the payload (for messages)
+ * tnspec: TNSPEC to match against
+ */
+bup_context_t *
+bup_init_fd_for_tnspec (int fd, const char *pathname, const char *tnspec)
+{
+	bup_context_t *ctx = tnspec_context(tnspec);
+
+	if (ctx == NULL)
+		return NULL;
+	return load_payload(ctx, pathname, fd);
+
+} /* bup_init_fd_for_tnspec */
+
 /*
  * bup_finish
  */
@@ -766,53 +1020,131 @@ bup_enumerate_entries (bup_context_t *ctx, void **iterctx, const char **partname
 {
 	unsigned int i;
 	uintptr_t start;
-	struct bup_entry_s *ent;
-	struct tnspec_s entspec;
 
 	start = (uintptr_t)(*iterctx);
-	for (i = start; i < ctx->entry_count; i++) {
-		ent = &ctx->entries[i];
-		if (ent->op_mode != OP_MODE_PREPRODUCTION) {
-			spec_split(ent->spec, &entspec);
-			if (specs_match(&entspec, &ctx->our_tnspec))
-				break;
-			if (ctx->compat_spec.field_count > 0 && specs_match(&entspec, &ctx->compat_spec))
-				break;
-		}
-	}
+	for (i = start; i < ctx->entry_count; i++)
+		if (ctx->op_modes[i] != OP_MODE_PREPRODUCTION && ctx->spec_matches[ctx->spec_ids[i]])
+			break;
 	if (i >= ctx->entry_count) {
 		*iterctx = 0;
 		return false;
 	}
 
-	*partname = ctx->entries[i].partition;
-	*offset = (off_t)(ctx->entries[i].offset);
-	*length = (size_t)(ctx->entries[i].length);
-	*version = (unsigned int)(ctx->entries[i].version);
+	*partname = ctx->names[ctx->name_ids[i]];
+	*offset = (off_t)(ctx->offsets[i]);
+	*length = (size_t)(ctx->lengths[i]);
+	*version = (unsigned int)(ctx->versions[i]);
 	start = i;
 	*iterctx = (void *)(start + 1);
 	return true;
 
 } /* bup_enumerate_entries */
 
+/*
+ * bup_entry_spec
+ *
+ * Returns the spec string of the entry most recently
+ * returned by bup_enumerate_entries() for iterctx.
+ */
+const char *
+bup_entry_spec (bup_context_t *ctx, void *iterctx)
+{
+	uintptr_t i = (uintptr_t) iterctx;
 
-#define MAX_PARTS 64
+	if (i == 0 || i > ctx->entry_count)
+		return NULL;
+	return ctx->specs[ctx->spec_ids[i - 1]];
+
+} /* bup_entry_spec */
 
 /*
- * in_list
+ * bup_header_version
  *
- * returns true if a character string is found in the
- * array of strings pointed to by list, false otherwise.
+ * returns the version field from the payload header.
  */
-static bool
-in_list (const char **list, unsigned int listsize, const char *val)
+unsigned int
+bup_header_version (bup_context_t *ctx)
+{
+	return ctx->header_version;
+
+} /* bup_header_version */
+
+/*
+ * bup_entry_count
+ *
+ * returns the number of entries in the payload.
+ */
+unsigned int
+bup_entry_count (bup_context_t *ctx)
+{
+	return ctx->entry_count;
+
+} /* bup_entry_count */
+
+/*
+ * bup_entry_info
+ *
+ * Returns information about an entry by index, whether
+ * or not it matches the TNSPEC. Strings returned remain
+ * valid until bup_finish() is called.
+ *
+ * Returns bool: true on success, false if index is out of range.
+ */
+bool
+bup_entry_info (bup_context_t *ctx, unsigned int index, const char **partname,
+		const char **spec, off_t *offset, size_t *length,
+		unsigned int *version, bool *preproduction)
+{
+	if (index >= ctx->entry_count)
+		return false;
+	*partname = ctx->names[ctx->name_ids[index]];
+	*spec = ctx->specs[ctx->spec_ids[index]];
+	*offset = (off_t)(ctx->offsets[index]);
+	*length = (size_t)(ctx->lengths[index]);
+	*version = (unsigned int)(ctx->versions[index]);
+	*preproduction = ctx->op_modes[index] == OP_MODE_PREPRODUCTION;
+	return true;
+
+} /* bup_entry_info */
+
+/*
+ * bup_match_specs
+ *
+ * Checks a list of entry spec strings against a TNSPEC,
+ * and the compatibility spec derived from it, the same
+ * way entries are matched when enumerating a payload.
+ *
+ * tnspec: TNSPEC to match against
+ * specs: array of entry spec strings
+ * count: number of specs
+ * matches: array of count results, filled in
+ *
+ * Returns: nothing
+ */
+void
+bup_match_specs (const char *tnspec, const char * const *specs, unsigned int count, bool *matches)
 {
+	struct tnspec_s ourspec, compat, entspec;
+	char compatstr[128];
 	unsigned int i;
-	for (i = 0; i < listsize; i++)
-		if (strcmp(list[i], val) == 0)
-			return true;
-	return false;
-} /* in_list */
+
+	spec_split(tnspec, &ourspec);
+	generate_compat_spec(&ourspec, &compat, compatstr, sizeof(compatstr));
+	for (i = 0; i < count; i++) {
+		spec_split(specs[i], &entspec);
+		matches[i] = (specs_match(&entspec, &ourspec) ||
+			      (compat.field_count > 0 && specs_match(&entspec, &compat)));
+	}
+
+} /* bup_match_specs */
+
+/*
+ * Per-name states used by bup_find_missing_entries
+ */
+#define NAME_UNSEEN	0
+#define NAME_PRESENT	1
+#define NAME_MATCHED	2
+#define NAME_LISTED	3
 
 /*
  * bup_find_missing_entries
@@ -828,7 +1160,11 @@ in_list (const char **list, unsigned int listsize, const char *val)
  * exceed max_missing, if the provided array is too small.
  *
  * Note that there is no guarantee that a BUP payload will be ordered
- * by partition name, which makes the logic here a little more complicated.
+ * by partition name, so the entries are scanned twice: once to find
+ * which names have matching entries, and once more to list the
+ * missing ones in the order they first appear. The per-name state
+ * for those scans is kept in ctx->name_state, so a context must not
+ * be used for this from more than one thread at a time.
  *
  * Returns -1 for any errors.
  *
@@ -837,48 +1173,35 @@ int
 bup_find_missing_entries (bup_context_t *ctx, const char **missing_parts,
 			  size_t max_missing)
 {
-	unsigned int i, partcount, matchcount, missing_count;
-	struct bup_entry_s *ent;
-	struct tnspec_s entspec;
-	const char *all_parts[MAX_PARTS], *matching_parts[MAX_PARTS];
+	unsigned int i, missing_count;
+	uint32_t name;
 
-	partcount = matchcount = 0;
+	if (ctx->name_count > 0)
+		memset(ctx->name_state, NAME_UNSEEN, ctx->name_count);
 	for (i = 0; i < ctx->entry_count; i++) {
-		ent = &ctx->entries[i];
 		/*
 		 * Don't need to bother with preproduction or non-TNSPECed entries
 		 */
-		if (ent->op_mode == OP_MODE_PREPRODUCTION || ent->spec[0] == '\0')
+		if (ctx->op_modes[i] == OP_MODE_PREPRODUCTION || ctx->specs[ctx->spec_ids[i]][0] == '\0')
 			continue;
-		/*
-		 * If we've already matched this part, skip
-		 */
-		if (in_list(matching_parts, matchcount, ent->partition))
-			continue;
-		if (!in_list(all_parts, partcount, ent->partition)) {
-			if (partcount >= MAX_PARTS)
-				return -1;
-			all_parts[partcount++] = ent->partition;
-		}
-
-		spec_split(ent->spec, &entspec);
-		/*
-		 * No need to check the array length here, covered
-		 * by the check above since both arrays are the same
-		 * size
-		 */
-		if (specs_match(&entspec, &ctx->our_tnspec) ||
-		    (ctx->compat_spec.field_count > 0 && specs_match(&entspec, &ctx->compat_spec)))
-			matching_parts[matchcount++] = ent->partition;
+		name = ctx->name_ids[i];
+		if (ctx->spec_matches[ctx->spec_ids[i]])
+			ctx->name_state[name] = NAME_MATCHED;
+		else if (ctx->name_state[name] == NAME_UNSEEN)
+			ctx->name_state[name] = NAME_PRESENT;
 	}
 
 	missing_count = 0;
-	for (i = 0; i < partcount; i++) {
-		if (!in_list(matching_parts, matchcount, all_parts[i])) {
-			if (missing_parts != NULL && missing_count < max_missing)
-				missing_parts[missing_count] = all_parts[i];
-			missing_count += 1;
-		}
+	for (i = 0; i < ctx->entry_count; i++) {
+		if (ctx->op_modes[i] == OP_MODE_PREPRODUCTION || ctx->specs[ctx->spec_ids[i]][0] == '\0')
+			continue;
+		name = ctx->name_ids[i];
+		if (ctx->name_state[name] != NAME_PRESENT)
+			continue;
+		ctx->name_state[name] = NAME_LISTED;
+		if (missing_parts != NULL && missing_count < max_missing)
+			missing_parts[missing_count] = ctx->names[name];
+		missing_count += 1;
 	}
 
 	return missing_count;
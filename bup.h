@@ -11,6 +11,8 @@ struct bup_context_s;
 typedef struct bup_context_s bup_context_t;
 
 bup_context_t *bup_init(const char *pathname);
+bup_context_t *bup_init_for_tnspec(const char *pathname, const char *tnspec);
+bup_context_t *bup_init_fd_for_tnspec(int fd, const char *pathname, const char *tnspec);
 void bup_finish(bup_context_t *ctx);
 const char *bup_gpt_device(bup_context_t *ctx);
 const char *bup_boot_device(bup_context_t *ctx);
@@ -19,6 +21,13 @@ const char *bup_compat_spec(bup_context_t *ctx);
 bool bup_enumerate_entries(bup_context_t *ctx, void **iterctx,
 			   const char **partname, off_t *offset,
 			   size_t *length, unsigned int *version);
+const char *bup_entry_spec(bup_context_t *ctx, void *iterctx);
+unsigned int bup_header_version(bup_context_t *ctx);
+unsigned int bup_entry_count(bup_context_t *ctx);
+bool bup_entry_info(bup_context_t *ctx, unsigned int index, const char **partname,
+		    const char **spec, off_t *offset, size_t *length,
+		    unsigned int *version, bool *preproduction);
+void bup_match_specs(const char *tnspec, const char * const *specs, unsigned int count, bool *matches);
 int bup_find_missing_entries(bup_context_t *ctx, const char **missing_parts,
 			     size_t max_missing);
 off_t bup_setpos(bup_context_t *ctx, off_t offset);
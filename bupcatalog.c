@@ -0,0 +1,1278 @@
+/*
+ * bupcatalog.c
+ *
+ * Functions for building and querying an index of the
+ * BUP payloads in a directory, so that the payload to
+ * offer a device can be chosen without parsing every
+ * candidate.
+ *
+ * The index is a single file, laid out so it can be used
+ * directly from a read-only mapping. It holds, for each
+ * payload, the header version, a CRC32 digest of the file,
+ * and every entry, with its partition name and spec string
+ * (interned, and referred to by ID), version, location,
+ * content CRC32, and, for VER entries, the BSP version.
+ *
+ * For matching, each payload also has a list of the
+ * requirements it places on a TNSPEC: for each partition
+ * that has TNSPEC-specific entries, the set of specs that
+ * can supply it. A payload covers a TNSPEC when every one
+ * of its sets contains a spec that matches. Sets are shared
+ * between payloads, so a query matches each distinct spec
+ * and checks each distinct set once, then only has to look
+ * up the results for each payload.
+ *
+ * Updating the index scans the directory, carries over the
+ * records for payloads whose device, inode, size, and
+ * modification time are unchanged, and parses the rest in
+ * parallel. The new index is written to a temporary file
+ * and renamed into place.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "bupcatalog.h"
+#include "bup.h"
+#include "ver.h"
+
+#define CATALOG_MAGIC "TBUPCAT1"
+#define CATALOG_VERSION 1
+#define CATALOG_MAX_JOBS 64
+#define CATALOG_ENTRY_PREPRODUCTION (1U << 0)
+#define CATALOG_FEW_MATCHES 16
+
+/*
+ * Index file layout: the header, followed by the sections,
+ * each starting on an 8-byte boundary. The CRC covers
+ * everything after the header.
+ */
+struct catalog_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t crc;
+	uint32_t directory;
+	uint32_t payload_count;
+	uint32_t entry_count;
+	uint32_t name_count;
+	uint32_t spec_count;
+	uint32_t set_count;
+	uint32_t member_count;
+	uint32_t req_count;
+	uint32_t ver_count;
+	uint32_t strings_size;
+	uint32_t reserved;
+	uint64_t payloads_off;
+	uint64_t entries_off;
+	uint64_t names_off;
+	uint64_t specs_off;
+	uint64_t sets_off;
+	uint64_t members_off;
+	uint64_t reqs_off;
+	uint64_t vers_off;
+	uint64_t strings_off;
+	uint64_t file_size;
+};
+
+/*
+ * Payloads are sorted by file name
+ */
+struct catalog_payload_s {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t name;
+	uint32_t header_version;
+	uint32_t digest;
+	uint32_t first_entry;
+	uint32_t entry_count;
+	uint32_t first_req;
+	uint32_t req_count;
+	uint32_t first_ver;
+	uint32_t ver_count;
+};
+
+struct catalog_entry_s {
+	uint32_t name;
+	uint32_t spec;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t crc;
+	uint32_t bsp_version;
+};
+
+struct catalog_set_s {
+	uint32_t first_member;
+	uint32_t member_count;
+};
+
+struct catalog_ver_s {
+	uint32_t spec;
+	uint32_t bsp_version;
+};
+
+/*
+ * Catalog opened for queries
+ */
+struct bup_catalog_s {
+	void *map;
+	size_t mapsize;
+	const struct catalog_header_s *hdr;
+	const struct catalog_payload_s *payloads;
+	const struct catalog_entry_s *entries;
+	const uint32_t *names;
+	const uint32_t *specs;
+	const struct catalog_set_s *sets;
+	const uint32_t *members;
+	const uint32_t *reqs;
+	const struct catalog_ver_s *vers;
+	const char *strings;
+	/*
+	 * Scratch space for queries
+	 */
+	const char **specstrs;
+	bool *spec_ok;
+	bool *set_ok;
+	bup_catalog_match_t *found;
+};
+
+/*
+ * Structures used while updating
+ */
+struct blob_s {
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+};
+
+struct keytab_s {
+	struct blob_s *blob;
+	uint32_t *offs;
+	uint32_t *lens;
+	uint32_t count;
+	uint32_t cap;
+	uint32_t *slots;
+	uint32_t mask;
+};
+
+struct scan_entry_s {
+	const char *name;
+	const char *spec;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t crc;
+	uint32_t bsp_version;
+};
+
+struct scan_payload_s {
+	char *name;
+	struct stat st;
+	bool reused;
+	bool valid;
+	uint32_t header_version;
+	uint32_t digest;
+	unsigned int entry_count;
+	struct scan_entry_s *entries;
+	char *strings;
+};
+
+struct scan_job_s {
+	pthread_mutex_t lock;
+	const char *dirpath;
+	struct scan_payload_s *payloads;
+	unsigned int count;
+	unsigned int next;
+};
+
+static const char bup_magic[16] = "NVIDIA__BLOB__V2";
+
+/*
+ * grow
+ *
+ * Makes sure a dynamically-sized array has room
+ * for at least need elements.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+grow (void *arrayp, uint32_t *capp, size_t need, size_t elsize)
+{
+	void **ap = arrayp;
+	size_t newcap = (*capp == 0 ? 16 : *capp);
+	void *newarray;
+
+	if (need <= *capp)
+		return 0;
+	while (newcap < need)
+		newcap *= 2;
+	if (newcap > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	newarray = realloc(*ap, newcap * elsize);
+	if (newarray == NULL)
+		return -1;
+	*ap = newarray;
+	*capp = newcap;
+	return 0;
+
+} /* grow */
+
+/*
+ * blob_append
+ *
+ * Appends data to a blob, padded to a 4-byte boundary.
+ *
+ * offp: set to the offset of the data in the blob
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+blob_append (struct blob_s *b, const void *data, size_t len, uint32_t *offp)
+{
+	size_t padded = (len + 3) & ~(size_t) 3;
+	uint8_t *newdata;
+	size_t newcap;
+
+	if (b->size + padded > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (b->size + padded > b->cap) {
+		for (newcap = (b->cap == 0 ? 4096 : b->cap); newcap < b->size + padded; newcap *= 2);
+		newdata = realloc(b->data, newcap);
+		if (newdata == NULL)
+			return -1;
+		b->data = newdata;
+		b->cap = newcap;
+	}
+	memcpy(b->data + b->size, data, len);
+	memset(b->data + b->size + len, 0, padded - len);
+	*offp = b->size;
+	b->size += padded;
+	return 0;
+
+} /* blob_append */
+
+/*
+ * key_hash
+ *
+ * Returns: hash of a key
+ */
+static uint32_t
+key_hash (const void *key, uint32_t len)
+{
+	const uint8_t *p = key;
+	uint32_t hash = 2166136261U, i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+	return hash;
+
+} /* key_hash */
+
+/*
+ * keytab_intern
+ *
+ * Looks up a key, copying it into the table's
+ * blob if it is not already there.
+ *
+ * idp: set to the ID for the key
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+keytab_intern (struct keytab_s *t, const void *key, uint32_t len, uint32_t *idp)
+{
+	uint32_t i, id, newmask, *newslots, *newlens;
+
+	if (t->count * 2 >= t->mask + 1 || t->slots == NULL) {
+		newmask = (t->slots == NULL ? 255 : t->mask * 2 + 1);
+		newslots = calloc(newmask + 1, sizeof(uint32_t));
+		if (newslots == NULL)
+			return -1;
+		for (id = 0; id < t->count; id++) {
+			for (i = key_hash(t->blob->data + t->offs[id], t->lens[id]) & newmask;
+			     newslots[i] != 0; i = (i + 1) & newmask);
+			newslots[i] = id + 1;
+		}
+		free(t->slots);
+		t->slots = newslots;
+		t->mask = newmask;
+	}
+	for (i = key_hash(key, len) & t->mask; t->slots[i] != 0; i = (i + 1) & t->mask) {
+		id = t->slots[i] - 1;
+		if (t->lens[id] == len && memcmp(t->blob->data + t->offs[id], key, len) == 0) {
+			*idp = id;
+			return 0;
+		}
+	}
+	if (grow(&t->offs, &t->cap, t->count + 1, sizeof(uint32_t)) < 0)
+		return -1;
+	newlens = realloc(t->lens, t->cap * sizeof(uint32_t));
+	if (newlens == NULL)
+		return -1;
+	t->lens = newlens;
+	id = t->count;
+	if (blob_append(t->blob, key, len, &t->offs[id]) < 0)
+		return -1;
+	t->lens[id] = len;
+	t->count += 1;
+	t->slots[i] = id + 1;
+	*idp = id;
+	return 0;
+
+} /* keytab_intern */
+
+/*
+ * keytab_free
+ */
+static void
+keytab_free (struct keytab_s *t)
+{
+	free(t->offs);
+	free(t->lens);
+	free(t->slots);
+
+} /* keytab_free */
+
+/*
+ * scan_payload
+ *
+ * Parses a payload and computes its digests. Files that
+ * are not BUP payloads, that have entries extending past
+ * the end of the file, or that have changed since the
+ * directory was scanned, are left marked invalid, without
+ * any error message.
+ *
+ * Returns: nothing
+ */
+static void
+scan_payload (const char *dirpath, struct scan_payload_s *sp)
+{
+	char path[PATH_MAX];
+	char magic[sizeof(bup_magic)];
+	bup_context_t *ctx = NULL;
+	uint8_t *map = MAP_FAILED;
+	const char *partname, *spec;
+	off_t offset;
+	size_t length, strbytes;
+	unsigned int i, version;
+	bool preproduction;
+	ver_info_t verinfo;
+	struct stat st;
+	void *verbuf;
+	char *cp;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dirpath, sp->name);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	/*
+	 * The file may have been replaced or rewritten since the
+	 * directory scan; index what was opened, and only if it
+	 * is still the file that scan found. The entries are
+	 * parsed from this descriptor as well, not by path.
+	 */
+	if (fstat(fd, &st) < 0 || st.st_dev != sp->st.st_dev || st.st_ino != sp->st.st_ino ||
+	    st.st_size != sp->st.st_size || st.st_mtim.tv_sec != sp->st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != sp->st.st_mtim.tv_nsec)
+		goto depart;
+	sp->st = st;
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+	    memcmp(magic, bup_magic, sizeof(magic)) != 0)
+		goto depart;
+	ctx = bup_init_fd_for_tnspec(fd, path, "");
+	if (ctx == NULL)
+		goto depart;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto depart;
+	sp->header_version = bup_header_version(ctx);
+	sp->entry_count = bup_entry_count(ctx);
+	sp->entries = calloc(sp->entry_count + 1, sizeof(struct scan_entry_s));
+	if (sp->entries == NULL)
+		goto depart;
+	for (i = 0, strbytes = 0; i < sp->entry_count; i++) {
+		bup_entry_info(ctx, i, &partname, &spec, &offset, &length, &version, &preproduction);
+		if (offset < 0 || offset > st.st_size || length > (size_t) (st.st_size - offset))
+			goto depart;
+		strbytes += strlen(partname) + strlen(spec) + 2;
+	}
+	posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+	sp->digest = crc32(0, map, st.st_size);
+	sp->strings = malloc(strbytes + 1);
+	if (sp->strings == NULL)
+		goto depart;
+	for (i = 0, cp = sp->strings; i < sp->entry_count; i++) {
+		struct scan_entry_s *ent = &sp->entries[i];
+		bup_entry_info(ctx, i, &partname, &spec, &offset, &length, &version, &preproduction);
+		ent->name = strcpy(cp, partname);
+		cp += strlen(partname) + 1;
+		ent->spec = strcpy(cp, spec);
+		cp += strlen(spec) + 1;
+		ent->version = version;
+		ent->flags = (preproduction ? CATALOG_ENTRY_PREPRODUCTION : 0);
+		ent->offset = offset;
+		ent->length = length;
+		ent->crc = crc32(0, map + offset, length);
+		if (strcmp(partname, "VER") == 0 && length > 0) {
+			verbuf = malloc(length);
+			if (verbuf != NULL) {
+				memcpy(verbuf, map + offset, length);
+				if (ver_extract_info(verbuf, length, &verinfo) == 0)
+					ent->bsp_version = verinfo.bsp_version;
+				free(verbuf);
+			}
+		}
+	}
+	sp->valid = true;
+
+  depart:
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (ctx != NULL)
+		bup_finish(ctx);
+	close(fd);
+
+} /* scan_payload */
+
+/*
+ * scan_worker
+ *
+ * Thread function for parsing payloads.
+ */
+static void *
+scan_worker (void *arg)
+{
+	struct scan_job_s *job = arg;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->count)
+			break;
+		if (!job->payloads[i].reused)
+			scan_payload(job->dirpath, &job->payloads[i]);
+	}
+	return NULL;
+
+} /* scan_worker */
+
+/*
+ * payload_name_compare
+ *
+ * qsort comparison function for sorting payloads by name.
+ */
+static int
+payload_name_compare (const void *a, const void *b)
+{
+	const struct scan_payload_s *pa = a, *pb = b;
+
+	return strcmp(pa->name, pb->name);
+
+} /* payload_name_compare */
+
+/*
+ * find_old_payload
+ *
+ * Looks up a payload by name in an existing catalog.
+ *
+ * Returns: pointer to payload record, or NULL if not found
+ */
+static const struct catalog_payload_s *
+find_old_payload (bup_catalog_t *cat, const char *name)
+{
+	unsigned int lo = 0, hi, mid;
+	int c;
+
+	if (cat == NULL)
+		return NULL;
+	hi = cat->hdr->payload_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = strcmp(name, cat->strings + cat->payloads[mid].name);
+		if (c == 0)
+			return &cat->payloads[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+
+} /* find_old_payload */
+
+/*
+ * reuse_payload
+ *
+ * Fills in a payload's records from an existing catalog.
+ * The strings point into the old catalog's mapping.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+reuse_payload (bup_catalog_t *cat, const struct catalog_payload_s *old, struct scan_payload_s *sp)
+{
+	const struct catalog_entry_s *oldent;
+	unsigned int i;
+
+	sp->entries = calloc(old->entry_count + 1, sizeof(struct scan_entry_s));
+	if (sp->entries == NULL)
+		return -1;
+	for (i = 0; i < old->entry_count; i++) {
+		oldent = &cat->entries[old->first_entry + i];
+		sp->entries[i].name = cat->strings + cat->names[oldent->name];
+		sp->entries[i].spec = cat->strings + cat->specs[oldent->spec];
+		sp->entries[i].version = oldent->version;
+		sp->entries[i].flags = oldent->flags;
+		sp->entries[i].offset = oldent->offset;
+		sp->entries[i].length = oldent->length;
+		sp->entries[i].crc = oldent->crc;
+		sp->entries[i].bsp_version = oldent->bsp_version;
+	}
+	sp->entry_count = old->entry_count;
+	sp->header_version = old->header_version;
+	sp->digest = old->digest;
+	sp->reused = sp->valid = true;
+	return 0;
+
+} /* reuse_payload */
+
+/*
+ * pair_compare
+ *
+ * qsort comparison function for (name, spec) ID pairs.
+ */
+static int
+pair_compare (const void *a, const void *b)
+{
+	const uint32_t *pa = a, *pb = b;
+
+	if (pa[0] != pb[0])
+		return (pa[0] < pb[0] ? -1 : 1);
+	if (pa[1] != pb[1])
+		return (pa[1] < pb[1] ? -1 : 1);
+	return 0;
+
+} /* pair_compare */
+
+/*
+ * id_compare
+ *
+ * qsort comparison function for IDs.
+ */
+static int
+id_compare (const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t *) a, ib = *(const uint32_t *) b;
+
+	return (ia < ib ? -1 : (ia > ib ? 1 : 0));
+
+} /* id_compare */
+
+/*
+ * write_section
+ *
+ * Writes a section of the index, padded to an
+ * 8-byte boundary, updating the running CRC.
+ *
+ * offp: set to the file offset of the section
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+write_section (FILE *fp, const void *data, size_t len, uint32_t *crcp, uint64_t *posp, uint64_t *offp)
+{
+	static const uint8_t pad[8];
+	size_t padlen = (8 - (len % 8)) % 8;
+
+	*offp = *posp;
+	if (len > 0 && fwrite(data, len, 1, fp) != 1)
+		return -1;
+	if (padlen > 0 && fwrite(pad, padlen, 1, fp) != 1)
+		return -1;
+	if (len > 0)
+		*crcp = crc32(*crcp, data, len);
+	if (padlen > 0)
+		*crcp = crc32(*crcp, pad, padlen);
+	*posp += len + padlen;
+	return 0;
+
+} /* write_section */
+
+/*
+ * bup_catalog_update
+ *
+ * Creates or updates the index for the payloads in a directory.
+ *
+ * indexpath: path of the index file
+ * dirpath: directory holding the payloads
+ * jobs: number of payloads to parse in parallel (0 for one
+ *       per online CPU)
+ * stats: if non-NULL, filled in with counts of what was done
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+bup_catalog_update (const char *indexpath, const char *dirpath, unsigned int jobs,
+		    bup_catalog_update_stats_t *stats)
+{
+	bup_catalog_t *old;
+	DIR *dir = NULL;
+	struct dirent *de;
+	struct scan_payload_s *payloads = NULL;
+	uint32_t payload_count = 0, payload_cap = 0;
+	struct scan_job_s job;
+	pthread_t threads[CATALOG_MAX_JOBS];
+	unsigned int i, j, k, started;
+	const struct catalog_payload_s *oldp;
+	bup_catalog_update_stats_t st;
+	struct blob_s strings, members;
+	struct keytab_s names, specs, sets;
+	struct catalog_header_s hdr;
+	struct catalog_payload_s *recs = NULL;
+	struct catalog_entry_s *ents = NULL;
+	uint32_t ent_count = 0, ent_cap = 0;
+	uint32_t *reqs = NULL, req_count = 0, req_cap = 0;
+	struct catalog_ver_s *vers = NULL;
+	uint32_t ver_count = 0, ver_cap = 0;
+	struct catalog_set_s *setrecs = NULL;
+	uint32_t *pairs = NULL, pair_cap = 0, pair_count;
+	uint32_t *setids = NULL, setid_cap = 0, setid_count;
+	uint32_t *memberids = NULL, memberid_cap = 0, memberid_count;
+	uint32_t id, rec_count = 0, matched = 0, crc;
+	char tmppath[PATH_MAX], dirname[PATH_MAX];
+	FILE *fp = NULL;
+	uint64_t pos;
+	int ret = -1, save_errno;
+
+	memset(&st, 0, sizeof(st));
+	memset(&strings, 0, sizeof(strings));
+	memset(&members, 0, sizeof(members));
+	memset(&names, 0, sizeof(names));
+	memset(&specs, 0, sizeof(specs));
+	memset(&sets, 0, sizeof(sets));
+	names.blob = specs.blob = &strings;
+	sets.blob = &members;
+	tmppath[0] = '\0';
+
+	old = bup_catalog_open(indexpath);
+
+	if (realpath(dirpath, dirname) == NULL)
+		goto depart;
+	dir = opendir(dirpath);
+	if (dir == NULL)
+		goto depart;
+	while ((de = readdir(dir)) != NULL) {
+		struct scan_payload_s *sp;
+		if (de->d_name[0] == '.')
+			continue;
+		if (grow(&payloads, &payload_cap, payload_count + 1, sizeof(*payloads)) < 0)
+			goto depart;
+		sp = &payloads[payload_count];
+		memset(sp, 0, sizeof(*sp));
+		if (fstatat(dirfd(dir), de->d_name, &sp->st, 0) < 0 || !S_ISREG(sp->st.st_mode))
+			continue;
+		sp->name = strdup(de->d_name);
+		if (sp->name == NULL)
+			goto depart;
+		payload_count += 1;
+	}
+	closedir(dir);
+	dir = NULL;
+	qsort(payloads, payload_count, sizeof(*payloads), payload_name_compare);
+
+	/*
+	 * Carry over everything that has not changed
+	 */
+	for (i = 0; i < payload_count; i++) {
+		oldp = find_old_payload(old, payloads[i].name);
+		if (oldp == NULL)
+			continue;
+		matched += 1;
+		if (oldp->dev == (uint64_t) payloads[i].st.st_dev &&
+		    oldp->ino == (uint64_t) payloads[i].st.st_ino &&
+		    oldp->size == (int64_t) payloads[i].st.st_size &&
+		    oldp->mtime_sec == (int64_t) payloads[i].st.st_mtim.tv_sec &&
+		    oldp->mtime_nsec == (uint32_t) payloads[i].st.st_mtim.tv_nsec) {
+			if (reuse_payload(old, oldp, &payloads[i]) < 0)
+				goto depart;
+			st.reused += 1;
+		}
+	}
+	if (old != NULL)
+		st.removed = old->hdr->payload_count - matched;
+
+	/*
+	 * Parse the rest in parallel
+	 */
+	if (jobs == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = (n > 0 ? n : 1);
+	}
+	if (jobs > CATALOG_MAX_JOBS)
+		jobs = CATALOG_MAX_JOBS;
+	if (jobs > payload_count - st.reused)
+		jobs = payload_count - st.reused;
+	memset(&job, 0, sizeof(job));
+	pthread_mutex_init(&job.lock, NULL);
+	job.dirpath = dirpath;
+	job.payloads = payloads;
+	job.count = payload_count;
+	for (started = 0; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, scan_worker, &job) != 0)
+			break;
+	/*
+	 * Whatever could not be handed to a thread
+	 * is done here
+	 */
+	scan_worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	/*
+	 * Build the index contents
+	 */
+	recs = calloc(payload_count + 1, sizeof(*recs));
+	if (recs == NULL)
+		goto depart;
+	memset(&hdr, 0, sizeof(hdr));
+	if (blob_append(&strings, dirname, strlen(dirname) + 1, &hdr.directory) < 0)
+		goto depart;
+	for (i = 0; i < payload_count; i++) {
+		struct scan_payload_s *sp = &payloads[i];
+		struct catalog_payload_s *rec = &recs[rec_count];
+		if (!sp->valid) {
+			st.skipped += 1;
+			continue;
+		}
+		if (!sp->reused)
+			st.scanned += 1;
+		rec->dev = sp->st.st_dev;
+		rec->ino = sp->st.st_ino;
+		rec->size = sp->st.st_size;
+		rec->mtime_sec = sp->st.st_mtim.tv_sec;
+		rec->mtime_nsec = sp->st.st_mtim.tv_nsec;
+		rec->header_version = sp->header_version;
+		rec->digest = sp->digest;
+		if (blob_append(&strings, sp->name, strlen(sp->name) + 1, &rec->name) < 0)
+			goto depart;
+		rec->first_entry = ent_count;
+		rec->entry_count = sp->entry_count;
+		if (grow(&ents, &ent_cap, (size_t) ent_count + sp->entry_count, sizeof(*ents)) < 0 ||
+		    grow(&pairs, &pair_cap, (size_t) 2 * sp->entry_count, sizeof(*pairs)) < 0)
+			goto depart;
+		rec->first_ver = ver_count;
+		for (j = 0, pair_count = 0; j < sp->entry_count; j++) {
+			struct scan_entry_s *se = &sp->entries[j];
+			struct catalog_entry_s *ce = &ents[ent_count++];
+			if (keytab_intern(&names, se->name, strlen(se->name) + 1, &ce->name) < 0 ||
+			    keytab_intern(&specs, se->spec, strlen(se->spec) + 1, &ce->spec) < 0)
+				goto depart;
+			ce->version = se->version;
+			ce->flags = se->flags;
+			ce->offset = se->offset;
+			ce->length = se->length;
+			ce->crc = se->crc;
+			ce->bsp_version = se->bsp_version;
+			if (se->flags & CATALOG_ENTRY_PREPRODUCTION)
+				continue;
+			if (se->bsp_version != 0) {
+				if (grow(&vers, &ver_cap, ver_count + 1, sizeof(*vers)) < 0)
+					goto depart;
+				vers[ver_count].spec = ce->spec;
+				vers[ver_count].bsp_version = se->bsp_version;
+				ver_count += 1;
+			}
+			/*
+			 * Same rules as bup_find_missing_entries(): entries
+			 * without a spec do not make a partition required.
+			 */
+			if (se->spec[0] != '\0') {
+				pairs[pair_count * 2] = ce->name;
+				pairs[pair_count * 2 + 1] = ce->spec;
+				pair_count += 1;
+			}
+		}
+		rec->ver_count = ver_count - rec->first_ver;
+		/*
+		 * One requirement set per required partition:
+		 * the specs that can supply it.
+		 */
+		qsort(pairs, pair_count, 2 * sizeof(uint32_t), pair_compare);
+		setid_count = 0;
+		for (j = 0; j < pair_count; j = k) {
+			memberid_count = 0;
+			for (k = j; k < pair_count && pairs[k * 2] == pairs[j * 2]; k++) {
+				if (k > j && pairs[k * 2 + 1] == pairs[(k - 1) * 2 + 1])
+					continue;
+				if (grow(&memberids, &memberid_cap, memberid_count + 1, sizeof(uint32_t)) < 0)
+					goto depart;
+				memberids[memberid_count++] = pairs[k * 2 + 1];
+			}
+			if (keytab_intern(&sets, memberids, memberid_count * sizeof(uint32_t), &id) < 0 ||
+			    grow(&setids, &setid_cap, setid_count + 1, sizeof(uint32_t)) < 0)
+				goto depart;
+			setids[setid_count++] = id;
+		}
+		qsort(setids, setid_count, sizeof(uint32_t), id_compare);
+		rec->first_req = req_count;
+		for (j = 0; j < setid_count; j++) {
+			if (j > 0 && setids[j] == setids[j - 1])
+				continue;
+			if (grow(&reqs, &req_cap, req_count + 1, sizeof(uint32_t)) < 0)
+				goto depart;
+			reqs[req_count++] = setids[j];
+		}
+		rec->req_count = req_count - rec->first_req;
+		rec_count += 1;
+	}
+	setrecs = calloc(sets.count + 1, sizeof(*setrecs));
+	if (setrecs == NULL)
+		goto depart;
+	for (i = 0; i < sets.count; i++) {
+		setrecs[i].first_member = sets.offs[i] / sizeof(uint32_t);
+		setrecs[i].member_count = sets.lens[i] / sizeof(uint32_t);
+	}
+
+	/*
+	 * Write it out
+	 */
+	memcpy(hdr.magic, CATALOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = CATALOG_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.payload_count = rec_count;
+	hdr.entry_count = ent_count;
+	hdr.name_count = names.count;
+	hdr.spec_count = specs.count;
+	hdr.set_count = sets.count;
+	hdr.member_count = members.size / sizeof(uint32_t);
+	hdr.req_count = req_count;
+	hdr.ver_count = ver_count;
+	hdr.strings_size = strings.size;
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp.%ld", indexpath, (long) getpid());
+	fp = fopen(tmppath, "w");
+	if (fp == NULL)
+		goto depart;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto depart;
+	pos = sizeof(hdr);
+	crc = 0;
+	if (write_section(fp, recs, rec_count * sizeof(*recs), &crc, &pos, &hdr.payloads_off) < 0 ||
+	    write_section(fp, ents, ent_count * sizeof(*ents), &crc, &pos, &hdr.entries_off) < 0 ||
+	    write_section(fp, names.offs, names.count * sizeof(uint32_t), &crc, &pos, &hdr.names_off) < 0 ||
+	    write_section(fp, specs.offs, specs.count * sizeof(uint32_t), &crc, &pos, &hdr.specs_off) < 0 ||
+	    write_section(fp, setrecs, sets.count * sizeof(*setrecs), &crc, &pos, &hdr.sets_off) < 0 ||
+	    write_section(fp, members.data, members.size, &crc, &pos, &hdr.members_off) < 0 ||
+	    write_section(fp, reqs, req_count * sizeof(uint32_t), &crc, &pos, &hdr.reqs_off) < 0 ||
+	    write_section(fp, vers, ver_count * sizeof(*vers), &crc, &pos, &hdr.vers_off) < 0 ||
+	    write_section(fp, strings.data, strings.size, &crc, &pos, &hdr.strings_off) < 0)
+		goto depart;
+	hdr.crc = crc;
+	hdr.file_size = pos;
+	if (fseek(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+		goto depart;
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto depart;
+	}
+	fp = NULL;
+	if (rename(tmppath, indexpath) < 0)
+		goto depart;
+	tmppath[0] = '\0';
+	st.payloads = rec_count;
+	if (stats != NULL)
+		*stats = st;
+	ret = 0;
+
+  depart:
+	save_errno = errno;
+	if (fp != NULL)
+		fclose(fp);
+	if (tmppath[0] != '\0')
+		unlink(tmppath);
+	if (dir != NULL)
+		closedir(dir);
+	for (i = 0; i < payload_count; i++) {
+		free(payloads[i].name);
+		free(payloads[i].entries);
+		free(payloads[i].strings);
+	}
+	free(payloads);
+	free(recs);
+	free(ents);
+	free(reqs);
+	free(vers);
+	free(setrecs);
+	free(pairs);
+	free(setids);
+	free(memberids);
+	keytab_free(&names);
+	keytab_free(&specs);
+	keytab_free(&sets);
+	free(strings.data);
+	free(members.data);
+	if (old != NULL)
+		bup_catalog_close(old);
+	errno = save_errno;
+	return ret;
+
+} /* bup_catalog_update */
+
+/*
+ * section_ok
+ *
+ * Checks that a section lies within the index file.
+ *
+ * Returns: true if it does
+ */
+static bool
+section_ok (const struct catalog_header_s *hdr, uint64_t off, uint64_t count, size_t elsize)
+{
+	return off >= hdr->header_size && off % 8 == 0 &&
+		off <= hdr->file_size && count * elsize <= hdr->file_size - off;
+
+} /* section_ok */
+
+/*
+ * bup_catalog_open
+ *
+ * Maps an index file for querying, after
+ * checking that it is intact.
+ *
+ * Returns: catalog pointer, or NULL on error (errno set)
+ */
+bup_catalog_t *
+bup_catalog_open (const char *indexpath)
+{
+	bup_catalog_t *cat;
+	const struct catalog_header_s *hdr;
+	struct stat st;
+	unsigned int i;
+	uint32_t j;
+	int fd;
+
+	fd = open(indexpath, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t) sizeof(struct catalog_header_s)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	cat = calloc(1, sizeof(*cat));
+	if (cat == NULL) {
+		close(fd);
+		return NULL;
+	}
+	cat->mapsize = st.st_size;
+	cat->map = mmap(NULL, cat->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (cat->map == MAP_FAILED) {
+		free(cat);
+		return NULL;
+	}
+	hdr = cat->hdr = cat->map;
+	if (memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != CATALOG_VERSION || hdr->header_size != sizeof(*hdr) ||
+	    hdr->file_size != cat->mapsize ||
+	    !section_ok(hdr, hdr->payloads_off, hdr->payload_count, sizeof(struct catalog_payload_s)) ||
+	    !section_ok(hdr, hdr->entries_off, hdr->entry_count, sizeof(struct catalog_entry_s)) ||
+	    !section_ok(hdr, hdr->names_off, hdr->name_count, sizeof(uint32_t)) ||
+	    !section_ok(hdr, hdr->specs_off, hdr->spec_count, sizeof(uint32_t)) ||
+	    !section_ok(hdr, hdr->sets_off, hdr->set_count, sizeof(struct catalog_set_s)) ||
+	    !section_ok(hdr, hdr->members_off, hdr->member_count, sizeof(uint32_t)) ||
+	    !section_ok(hdr, hdr->reqs_off, hdr->req_count, sizeof(uint32_t)) ||
+	    !section_ok(hdr, hdr->vers_off, hdr->ver_count, sizeof(struct catalog_ver_s)) ||
+	    !section_ok(hdr, hdr->strings_off, hdr->strings_size, 1) ||
+	    hdr->strings_size == 0 ||
+	    crc32(0, (const uint8_t *) cat->map + hdr->header_size, hdr->file_size - hdr->header_size) != hdr->crc)
+		goto invalid;
+	cat->payloads = (const void *) ((const uint8_t *) cat->map + hdr->payloads_off);
+	cat->entries = (const void *) ((const uint8_t *) cat->map + hdr->entries_off);
+	cat->names = (const void *) ((const uint8_t *) cat->map + hdr->names_off);
+	cat->specs = (const void *) ((const uint8_t *) cat->map + hdr->specs_off);
+	cat->sets = (const void *) ((const uint8_t *) cat->map + hdr->sets_off);
+	cat->members = (const void *) ((const uint8_t *) cat->map + hdr->members_off);
+	cat->reqs = (const void *) ((const uint8_t *) cat->map + hdr->reqs_off);
+	cat->vers = (const void *) ((const uint8_t *) cat->map + hdr->vers_off);
+	cat->strings = (const char *) cat->map + hdr->strings_off;
+
+	/*
+	 * Every reference must be in range, so queries
+	 * need no further checks.
+	 */
+	if (cat->strings[hdr->strings_size - 1] != '\0' || hdr->directory >= hdr->strings_size)
+		goto invalid;
+	for (i = 0; i < hdr->name_count; i++)
+		if (cat->names[i] >= hdr->strings_size)
+			goto invalid;
+	for (i = 0; i < hdr->spec_count; i++)
+		if (cat->specs[i] >= hdr->strings_size)
+			goto invalid;
+	for (i = 0; i < hdr->set_count; i++)
+		if (cat->sets[i].first_member > hdr->member_count ||
+		    cat->sets[i].member_count > hdr->member_count - cat->sets[i].first_member)
+			goto invalid;
+	for (i = 0; i < hdr->member_count; i++)
+		if (cat->members[i] >= hdr->spec_count)
+			goto invalid;
+	for (i = 0; i < hdr->req_count; i++)
+		if (cat->reqs[i] >= hdr->set_count)
+			goto invalid;
+	for (i = 0; i < hdr->ver_count; i++)
+		if (cat->vers[i].spec >= hdr->spec_count)
+			goto invalid;
+	for (i = 0; i < hdr->entry_count; i++)
+		if (cat->entries[i].name >= hdr->name_count || cat->entries[i].spec >= hdr->spec_count)
+			goto invalid;
+	for (i = 0; i < hdr->payload_count; i++) {
+		const struct catalog_payload_s *p = &cat->payloads[i];
+		if (p->name >= hdr->strings_size ||
+		    p->first_entry > hdr->entry_count || p->entry_count > hdr->entry_count - p->first_entry ||
+		    p->first_req > hdr->req_count || p->req_count > hdr->req_count - p->first_req ||
+		    p->first_ver > hdr->ver_count || p->ver_count > hdr->ver_count - p->first_ver)
+			goto invalid;
+	}
+
+	cat->specstrs = calloc(hdr->spec_count + 1, sizeof(const char *));
+	cat->spec_ok = calloc(hdr->spec_count + 1, sizeof(bool));
+	cat->set_ok = calloc(hdr->set_count + 1, sizeof(bool));
+	cat->found = calloc(hdr->payload_count + 1, sizeof(bup_catalog_match_t));
+	if (cat->specstrs == NULL || cat->spec_ok == NULL || cat->set_ok == NULL || cat->found == NULL) {
+		bup_catalog_close(cat);
+		return NULL;
+	}
+	for (j = 0; j < hdr->spec_count; j++)
+		cat->specstrs[j] = cat->strings + cat->specs[j];
+	return cat;
+
+  invalid:
+	bup_catalog_close(cat);
+	errno = EINVAL;
+	return NULL;
+
+} /* bup_catalog_open */
+
+/*
+ * bup_catalog_close
+ */
+void
+bup_catalog_close (bup_catalog_t *cat)
+{
+	if (cat->map != MAP_FAILED && cat->map != NULL)
+		munmap(cat->map, cat->mapsize);
+	free(cat->specstrs);
+	free(cat->spec_ok);
+	free(cat->set_ok);
+	free(cat->found);
+	free(cat);
+
+} /* bup_catalog_close */
+
+/*
+ * bup_catalog_directory
+ *
+ * returns the directory that was scanned
+ * to build the catalog.
+ */
+const char *
+bup_catalog_directory (bup_catalog_t *cat)
+{
+	return cat->strings + cat->hdr->directory;
+
+} /* bup_catalog_directory */
+
+/*
+ * bup_catalog_payload_count
+ */
+unsigned int
+bup_catalog_payload_count (bup_catalog_t *cat)
+{
+	return cat->hdr->payload_count;
+
+} /* bup_catalog_payload_count */
+
+/*
+ * bup_catalog_payload_info
+ *
+ * Returns information about a payload by index. Payloads
+ * are ordered by file name.
+ *
+ * Returns bool: true on success, false if index is out of range.
+ */
+bool
+bup_catalog_payload_info (bup_catalog_t *cat, unsigned int index, bup_catalog_payload_t *info)
+{
+	const struct catalog_payload_s *p;
+
+	if (index >= cat->hdr->payload_count)
+		return false;
+	p = &cat->payloads[index];
+	info->name = cat->strings + p->name;
+	info->size = p->size;
+	info->mtime = p->mtime_sec;
+	info->header_version = p->header_version;
+	info->entry_count = p->entry_count;
+	info->digest = p->digest;
+	return true;
+
+} /* bup_catalog_payload_info */
+
+/*
+ * bup_catalog_entry_info
+ *
+ * Returns information about an entry in a payload.
+ *
+ * Returns bool: true on success, false if either index is out of range.
+ */
+bool
+bup_catalog_entry_info (bup_catalog_t *cat, unsigned int payload, unsigned int index,
+			bup_catalog_entry_t *info)
+{
+	const struct catalog_entry_s *e;
+
+	if (payload >= cat->hdr->payload_count || index >= cat->payloads[payload].entry_count)
+		return false;
+	e = &cat->entries[cat->payloads[payload].first_entry + index];
+	info->partname = cat->strings + cat->names[e->name];
+	info->spec = cat->strings + cat->specs[e->spec];
+	info->offset = e->offset;
+	info->length = e->length;
+	info->version = e->version;
+	info->preproduction = (e->flags & CATALOG_ENTRY_PREPRODUCTION) != 0;
+	info->crc = e->crc;
+	info->bsp_version = e->bsp_version;
+	return true;
+
+} /* bup_catalog_entry_info */
+
+/*
+ * match_compare
+ *
+ * qsort comparison function for ordering matches
+ * newest first.
+ */
+static int
+match_compare (const void *a, const void *b)
+{
+	const bup_catalog_match_t *ma = a, *mb = b;
+
+	if (ma->bsp_version != mb->bsp_version)
+		return (ma->bsp_version > mb->bsp_version ? -1 : 1);
+	if (ma->header_version != mb->header_version)
+		return (ma->header_version > mb->header_version ? -1 : 1);
+	if (ma->mtime != mb->mtime)
+		return (ma->mtime > mb->mtime ? -1 : 1);
+	return (ma->payload < mb->payload ? -1 : (ma->payload > mb->payload ? 1 : 0));
+
+} /* match_compare */
+
+/*
+ * bup_catalog_find
+ *
+ * Finds the payloads that cover a TNSPEC: every partition
+ * with TNSPEC-specific entries has an entry that matches
+ * the TNSPEC or its compatibility spec, as checked by
+ * bup_find_missing_entries(). The BSP version reported
+ * for each payload is the one from its matching VER entry.
+ * The per-spec and per-set results and the match list are
+ * kept in scratch arrays in the handle, so a handle must not
+ * be queried from more than one thread at a time; open a
+ * handle per thread instead.
+ *
+ * tnspec: TNSPEC of the device
+ * min_bsp_version: skip payloads with an older BSP version
+ * matches: array to fill in, newest payload first
+ * max_matches: length of the array
+ *
+ * Returns: number of payloads found, which may be more
+ *          than max_matches
+ */
+int
+bup_catalog_find (bup_catalog_t *cat, const char *tnspec, unsigned int min_bsp_version,
+		  bup_catalog_match_t *matches, unsigned int max_matches)
+{
+	const struct catalog_header_s *hdr = cat->hdr;
+	const struct catalog_payload_s *p;
+	bool use_sort = (matches != NULL && max_matches > CATALOG_FEW_MATCHES);
+	bup_catalog_match_t m;
+	unsigned int i, j, k, kept, count;
+	uint32_t bsp_version;
+
+	if (matches == NULL)
+		max_matches = 0;
+	bup_match_specs(tnspec, cat->specstrs, hdr->spec_count, cat->spec_ok);
+	for (i = 0; i < hdr->set_count; i++) {
+		cat->set_ok[i] = false;
+		for (j = 0; j < cat->sets[i].member_count && !cat->set_ok[i]; j++)
+			cat->set_ok[i] = cat->spec_ok[cat->members[cat->sets[i].first_member + j]];
+	}
+	for (i = 0, count = 0; i < hdr->payload_count; i++) {
+		p = &cat->payloads[i];
+		for (j = 0; j < p->req_count && cat->set_ok[cat->reqs[p->first_req + j]]; j++);
+		if (j < p->req_count)
+			continue;
+		for (j = 0, bsp_version = 0; j < p->ver_count; j++)
+			if (cat->spec_ok[cat->vers[p->first_ver + j].spec]) {
+				bsp_version = cat->vers[p->first_ver + j].bsp_version;
+				break;
+			}
+		if (bsp_version < min_bsp_version)
+			continue;
+		m.payload = i;
+		m.bsp_version = bsp_version;
+		m.header_version = p->header_version;
+		m.mtime = p->mtime_sec;
+		count += 1;
+		if (!use_sort) {
+			/*
+			 * Only a few wanted: keep the best ones in order
+			 */
+			kept = (count <= max_matches ? count - 1 : max_matches);
+			for (k = kept; k > 0 && match_compare(&m, &matches[k - 1]) < 0; k--)
+				if (k < max_matches)
+					matches[k] = matches[k - 1];
+			if (k < max_matches)
+				matches[k] = m;
+		} else
+			cat->found[count - 1] = m;
+	}
+	if (use_sort) {
+		qsort(cat->found, count, sizeof(cat->found[0]), match_compare);
+		if (matches != NULL)
+			memcpy(matches, cat->found, (count < max_matches ? count : max_matches) * sizeof(matches[0]));
+	}
+	return count;
+
+} /* bup_catalog_find */
@@ -0,0 +1,65 @@
+#ifndef bupcatalog_h_included
+#define bupcatalog_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+struct bup_catalog_s;
+typedef struct bup_catalog_s bup_catalog_t;
+
+struct bup_catalog_update_stats_s {
+	unsigned int payloads;
+	unsigned int scanned;
+	unsigned int reused;
+	unsigned int removed;
+	unsigned int skipped;
+};
+typedef struct bup_catalog_update_stats_s bup_catalog_update_stats_t;
+
+struct bup_catalog_payload_s {
+	const char *name;
+	off_t size;
+	time_t mtime;
+	unsigned int header_version;
+	unsigned int entry_count;
+	uint32_t digest;
+};
+typedef struct bup_catalog_payload_s bup_catalog_payload_t;
+
+struct bup_catalog_entry_s {
+	const char *partname;
+	const char *spec;
+	off_t offset;
+	size_t length;
+	unsigned int version;
+	bool preproduction;
+	uint32_t crc;
+	unsigned int bsp_version;
+};
+typedef struct bup_catalog_entry_s bup_catalog_entry_t;
+
+struct bup_catalog_match_s {
+	unsigned int payload;
+	unsigned int bsp_version;
+	unsigned int header_version;
+	time_t mtime;
+};
+typedef struct bup_catalog_match_s bup_catalog_match_t;
+
+int bup_catalog_update(const char *indexpath, const char *dirpath, unsigned int jobs,
+		       bup_catalog_update_stats_t *stats);
+bup_catalog_t *bup_catalog_open(const char *indexpath);
+void bup_catalog_close(bup_catalog_t *cat);
+const char *bup_catalog_directory(bup_catalog_t *cat);
+unsigned int bup_catalog_payload_count(bup_catalog_t *cat);
+bool bup_catalog_payload_info(bup_catalog_t *cat, unsigned int index, bup_catalog_payload_t *info);
+bool bup_catalog_entry_info(bup_catalog_t *cat, unsigned int payload, unsigned int index,
+			    bup_catalog_entry_t *info);
+/* Uses scratch space in the handle: do not query one handle from two threads at once */
+int bup_catalog_find(bup_catalog_t *cat, const char *tnspec, unsigned int min_bsp_version,
+		     bup_catalog_match_t *matches, unsigned int max_matches);
+
+#endif /* bupcatalog_h_included */
@@ -22,6 +22,8 @@
 #include <zlib.h>
 #include <fcntl.h>
 #include "gpt.h"
+#include "blkcache.h"
+#include "util.h"
 #include "config.h"
 #define QUOTE(m_) #m_
 #define XQUOTE(m_) QUOTE(m_)
@@ -64,6 +66,7 @@ struct gpt_entry_ondisk_s {
 struct gpt_context_s {
 	int fd;
 	unsigned int blocksize;
+	unsigned int physical_blocksize;
 	off_t devsize;
 	void *buffer;
 	bool is_mmcboot1;
@@ -185,7 +188,8 @@ format_header (gpt_context_t *ctx, struct gpt_header_s *dest, size_t destsize,
  * for the externally-facing API.
  *
  * devname: device name where the GPT is stored
- * blocksize: block size of the device, in bytes
+ * blocksize: logical block size of the device, in bytes,
+ *            or 0 to use the size reported by the device
  *
  * Returns: context pointer
  */
@@ -195,8 +199,9 @@ gpt_init (const char *devname, unsigned int blocksize, unsigned int flags)
 	int fd;
 	int err;
 	gpt_context_t *ctx;
+	unsigned int logical, physical;
 
-	if (blocksize < 512) {
+	if (blocksize != 0 && blocksize < 512) {
 		errno = EINVAL;
 		return NULL;
 	}
@@ -205,19 +210,26 @@ gpt_init (const char *devname, unsigned int blocksize, unsigned int flags)
 	if (ctx == NULL)
 		return NULL;
 	memset(ctx, 0, sizeof(*ctx));
-	err = posix_memalign(&ctx->buffer, sizeof(uint64_t), blocksize * GPT_SIZE_IN_BLOCKS);
-	if (err) {
-		errno = err;
-		free(ctx);
-		return NULL;
-	}
 
 	fd = open(devname, (flags & GPT_INIT_FOR_WRITING) == 0 ? O_RDONLY : O_RDWR);
 	if (fd < 0) {
-		free(ctx->buffer);
 		free(ctx);
 		return NULL;
 	}
+	get_block_sizes(fd, &logical, &physical);
+	if (blocksize == 0)
+		blocksize = logical;
+	ctx->physical_blocksize = (physical > blocksize ? physical : blocksize);
+	/*
+	 * Buffer is aligned for use with direct I/O
+	 */
+	err = posix_memalign(&ctx->buffer, ctx->physical_blocksize, blocksize * GPT_SIZE_IN_BLOCKS);
+	if (err) {
+		close(fd);
+		free(ctx);
+		errno = err;
+		return NULL;
+	}
 	ctx->is_mmcboot1 = strcmp(devname, "/dev/mmcblk0boot1") == 0;
 	ctx->fd = fd;
 	ctx->blocksize = blocksize;
@@ -297,28 +309,26 @@ gpt_load (gpt_context_t *ctx, unsigned int flags)
 		ctx->entries = NULL;
 	}
 	if ((flags & GPT_BACKUP_ONLY) == 0) {
-		startpos = lseek(fd, ctx->blocksize, SEEK_SET);
-		if (startpos != (off_t) -1) {
-			n = read(fd, ctx->buffer, 512);
-			if (n > 0 && parse_header(ctx, n, &ctx->primary_header) == 0)
-				ctx->primary_valid = (ctx->primary_header.entries_start_lba ==
-						      (ctx->primary_header.first_usable_lba -
-						       (ctx->primary_header.entry_count * ctx->primary_header.entry_size) / ctx->blocksize));
-		}
-	}
-	startpos = lseek(fd, ctx->devsize-ctx->blocksize, SEEK_SET);
-	if (startpos != (off_t) -1) {
-		n = read(fd, ctx->buffer, 512);
-		if (n > 0 && parse_header(ctx, n, &ctx->backup_header) == 0)
-			ctx->backup_valid = (ctx->backup_header.entries_start_lba ==
-					     (ctx->backup_header.last_usable_lba + ((flags & GPT_NVIDIA_SPECIAL) == 0 ? 1 : 0)));
+		n = blkcache_pread(fd, ctx->buffer, ctx->blocksize, ctx->blocksize);
+		if (n > 0 && parse_header(ctx, n, &ctx->primary_header) == 0)
+			ctx->primary_valid = (ctx->primary_header.entries_start_lba ==
+					      (ctx->primary_header.first_usable_lba -
+					       (ctx->primary_header.entry_count * ctx->primary_header.entry_size) / ctx->blocksize));
 	}
+	n = blkcache_pread(fd, ctx->buffer, ctx->blocksize, ctx->devsize-ctx->blocksize);
+	if (n > 0 && parse_header(ctx, n, &ctx->backup_header) == 0)
+		ctx->backup_valid = (ctx->backup_header.entries_start_lba ==
+				     (ctx->backup_header.last_usable_lba + ((flags & GPT_NVIDIA_SPECIAL) == 0 ? 1 : 0)));
 	if (!(ctx->primary_valid || ctx->backup_valid))
 		return -1;
+	/*
+	 * The entries for each copy sit next to that copy's
+	 * header, so their locations differ; everything else
+	 * must match.
+	 */
 	if (ctx->primary_valid && ctx->backup_valid) {
 		if (ctx->primary_header.first_usable_lba != ctx->backup_header.first_usable_lba ||
 		    ctx->primary_header.last_usable_lba != ctx->backup_header.last_usable_lba ||
-		    ctx->primary_header.entries_start_lba != ctx->backup_header.entries_start_lba ||
 		    ctx->primary_header.entry_size != ctx->backup_header.entry_size ||
 		    ctx->primary_header.entry_count != ctx->backup_header.entry_count ||
 		    ctx->primary_header.entries_crc32 != ctx->backup_header.entries_crc32)
@@ -334,10 +344,7 @@ gpt_load (gpt_context_t *ctx, unsigned int flags)
 	 */
 	if (ctx->is_mmcboot1 && (flags & GPT_NVIDIA_SPECIAL) != 0)
 		startpos -= ctx->devsize;
-	startpos = lseek(fd, startpos, SEEK_SET);
-	if (startpos == (off_t) -1)
-		return -1;
-	n = read(fd, ctx->buffer, hdr->entry_size * hdr->entry_count);
+	n = blkcache_pread(fd, ctx->buffer, hdr->entry_size * hdr->entry_count, startpos);
 	if (n <= 0)
 		return -1;
 	if (hdr->entries_crc32 != crc32(0, ctx->buffer, hdr->entry_size * hdr->entry_count))
@@ -430,33 +437,25 @@ gpt_save (gpt_context_t *ctx, unsigned int flags)
 			return -1;
 	}
 	if ((flags & GPT_BACKUP_ONLY) == 0) {
-		startpos = lseek(fd, ctx->blocksize * le64toh(primary_header.current_lba), SEEK_SET);
-		if (startpos == (off_t) -1)
-			return -1;
-		n = write(fd, &primary_header, sizeof(primary_header));
+		n = blkcache_pwrite(fd, &primary_header, sizeof(primary_header),
+				    ctx->blocksize * le64toh(primary_header.current_lba));
 		if (n != sizeof(primary_header))
 			return -1;
-		startpos = lseek(fd, ctx->blocksize * le64toh(primary_header.entries_start_lba), SEEK_SET);
-		if (startpos == (off_t) -1)
-			return -1;
-		n = write(fd, ctx->buffer, entries_size);
+		n = blkcache_pwrite(fd, ctx->buffer, entries_size,
+				    ctx->blocksize * le64toh(primary_header.entries_start_lba));
 		if (n != entries_size)
 			return -1;
 	}
 	startpos = ctx->blocksize * le64toh(backup_header.current_lba);
 	if (ctx->is_mmcboot1 && (flags & GPT_NVIDIA_SPECIAL) != 0)
 		startpos -= ctx->devsize;
-	startpos = lseek(fd, startpos, SEEK_SET);
-	if (startpos == (off_t) -1)
-		return -1;
-	n = write(fd, &backup_header, sizeof(backup_header));
+	n = blkcache_pwrite(fd, &backup_header, sizeof(backup_header), startpos);
 	if (n != sizeof(backup_header))
 		return -1;
 	startpos = ctx->blocksize * le64toh(backup_header.entries_start_lba);
 	if (ctx->is_mmcboot1 && (flags & GPT_NVIDIA_SPECIAL) != 0)
 		startpos -= ctx->devsize;
-	startpos = lseek(fd, startpos, SEEK_SET);
-	n = write(fd, ctx->buffer, entries_size);
+	n = blkcache_pwrite(fd, ctx->buffer, entries_size, startpos);
 	if (n != entries_size)
 		return -1;
 	return 0;
@@ -549,6 +548,43 @@ gpt_fd (gpt_context_t *ctx)
 
 } /* gpt_fd */
 
+/*
+ * gpt_blocksize
+ *
+ * Returns the logical block size used for
+ * the LBAs in the partition table.
+ *
+ * ctx: context pointer
+ *
+ * Returns: block size in bytes
+ */
+unsigned int
+gpt_blocksize (gpt_context_t *ctx)
+{
+	return ctx->blocksize;
+
+} /* gpt_blocksize */
+
+/*
+ * gpt_physical_blocksize
+ *
+ * Returns the physical block size of the device,
+ * which writes should be aligned to (and sized in
+ * multiples of) to avoid read-modify-write cycles
+ * in the device. Never smaller than the logical
+ * block size.
+ *
+ * ctx: context pointer
+ *
+ * Returns: block size in bytes
+ */
+unsigned int
+gpt_physical_blocksize (gpt_context_t *ctx)
+{
+	return ctx->physical_blocksize;
+
+} /* gpt_physical_blocksize */
+
 /*
  * gpt_entries_from_config
  *
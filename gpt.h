@@ -23,6 +23,8 @@ typedef struct gpt_entry_s gpt_entry_t;
 gpt_context_t *gpt_init(const char *devname, unsigned int blocksize, unsigned int flags);
 void gpt_finish(gpt_context_t *ctx);
 int gpt_fd(gpt_context_t *ctx);
+unsigned int gpt_blocksize(gpt_context_t *ctx);
+unsigned int gpt_physical_blocksize(gpt_context_t *ctx);
 
 #define GPT_BACKUP_ONLY		(1<<0)
 #define GPT_NVIDIA_SPECIAL	(1<<1)
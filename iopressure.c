@@ -0,0 +1,484 @@
+/*
+ * iopressure.c
+ *
+ * Adaptive throttling of background boot device I/O,
+ * driven by the kernel's pressure stall information
+ * (PSI) for I/O.
+ *
+ * Callers report each chunk of I/O they complete. Every
+ * sample interval, the share of time stalled on I/O over
+ * that interval is computed from the PSI totals of the
+ * cgroups that are not ours: the siblings of our own
+ * cgroup and of each of its ancestors (which together
+ * hold every other task), any children of our own cgroup,
+ * and the cgroup named by the caller, if any. For each,
+ * the "some" line of its io.pressure file (any task in it
+ * stalled) is read, and the highest share drives the
+ * control loop. Our own stalls are never counted, since
+ * our synchronous writes stall us even on an otherwise
+ * idle device; for the same reason the system-wide totals
+ * in /proc/pressure/io are not used.
+ *
+ * Above the high threshold, the allowed rate is halved
+ * (starting from the throughput seen in the last interval)
+ * and the chunk size limit with it. Below the low threshold,
+ * both are doubled again, until the rate reaches the
+ * unthrottled throughput and throttling is released. In
+ * between, nothing changes. While throttled, callers are
+ * paced by sleeping in iopressure_account().
+ *
+ * If PSI or the cgroup v2 hierarchy is not available,
+ * nothing is throttled. Not thread-safe.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include "iopressure.h"
+#include "config.h"
+
+#define IOPRESSURE_SAMPLE_USEC 250000UL
+#define IOPRESSURE_MAX_SHIFT 4
+#define IOPRESSURE_MIN_CHUNK 4096
+
+struct watch_s {
+	int fd;
+	unsigned long long total;
+};
+static struct watch_s *watches;
+static unsigned int watch_count, watch_cap, watch_dropped;
+static bool enabled;
+static unsigned long long sample_start;
+static size_t sample_bytes;
+static size_t rate, open_rate;
+static unsigned int chunk_shift;
+static unsigned long long pace_start;
+static size_t pace_bytes;
+static iopressure_stats_t pressure_stats;
+
+/*
+ * now_usec
+ *
+ * Returns: monotonic clock, in microseconds
+ */
+static unsigned long long
+now_usec (void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+
+} /* now_usec */
+
+/*
+ * read_stall_total
+ *
+ * Reads the cumulative stall time from one
+ * line of a PSI file.
+ *
+ * fd: open PSI file
+ * which: "some" or "full"
+ * totalp: set to the stall total, in microseconds
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+read_stall_total (int fd, const char *which, unsigned long long *totalp)
+{
+	char buf[256], *cp, *total;
+	ssize_t n;
+
+	if (lseek(fd, 0, SEEK_SET) == (off_t) -1)
+		return -1;
+	n = read(fd, buf, sizeof(buf)-1);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	cp = buf;
+	while (cp != NULL && strncmp(cp, which, strlen(which)) != 0) {
+		cp = strchr(cp, '\n');
+		if (cp != NULL)
+			cp += 1;
+	}
+	if (cp == NULL || (total = strstr(cp, "total=")) == NULL)
+		return -1;
+	*totalp = strtoull(total + 6, NULL, 10);
+	return 0;
+
+} /* read_stall_total */
+
+/*
+ * add_watch
+ *
+ * Opens a cgroup's io.pressure file and adds it to
+ * the watch list. A cgroup that goes away, or has no
+ * io.pressure file, is skipped quietly; one that could
+ * not be watched for lack of memory or descriptors is
+ * counted in watch_dropped.
+ *
+ * path: io.pressure file path
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+add_watch (const char *path)
+{
+	unsigned long long total;
+	struct watch_s *newwatches;
+	unsigned int newcap;
+	int fd;
+
+	if (watch_count >= watch_cap) {
+		newcap = (watch_cap == 0 ? 32 : watch_cap * 2);
+		newwatches = realloc(watches, newcap * sizeof(struct watch_s));
+		if (newwatches == NULL) {
+			watch_dropped += 1;
+			return -1;
+		}
+		watches = newwatches;
+		watch_cap = newcap;
+	}
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == EMFILE || errno == ENFILE || errno == ENOMEM)
+			watch_dropped += 1;
+		return -1;
+	}
+	if (read_stall_total(fd, "some", &total) < 0) {
+		close(fd);
+		return -1;
+	}
+	watches[watch_count].fd = fd;
+	watches[watch_count].total = total;
+	watch_count += 1;
+	return 0;
+
+} /* add_watch */
+
+/*
+ * watch_children
+ *
+ * Watches each child cgroup of a cgroup directory,
+ * except the one on our own path.
+ *
+ * dirpath: cgroup directory
+ * skip: name of child to skip, or NULL
+ *
+ * Returns: nothing
+ */
+static void
+watch_children (const char *dirpath, const char *skip)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(dirpath);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_type != DT_DIR || de->d_name[0] == '.')
+			continue;
+		if (skip != NULL && strcmp(de->d_name, skip) == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s/io.pressure", dirpath, de->d_name) >= sizeof(path))
+			continue;
+		add_watch(path);
+	}
+	closedir(dir);
+
+} /* watch_children */
+
+/*
+ * own_cgroup
+ *
+ * Finds our own cgroup in the cgroup v2 hierarchy.
+ *
+ * buf: buffer for the cgroup path (starting with '/')
+ * bufsize: size of the buffer
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+own_cgroup (char *buf, size_t bufsize)
+{
+	char line[PATH_MAX+8];
+	FILE *fp;
+	int ret = -1;
+
+	fp = fopen("/proc/self/cgroup", "re");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "0::/", 4) != 0)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (strlen(line + 3) < bufsize) {
+			strcpy(buf, line + 3);
+			ret = 0;
+		}
+		break;
+	}
+	fclose(fp);
+	return ret;
+
+} /* own_cgroup */
+
+/*
+ * iopressure_init
+ *
+ * Starts watching I/O pressure.
+ *
+ * cgroup: systemd service name (with or without the
+ *         ".service" suffix) or cgroup path (starting
+ *         with '/') whose stalls should also be watched,
+ *         or NULL for the other cgroups only
+ *
+ * Returns: 0 if pressure is being watched,
+ *          -1 if it is not available (errno set)
+ */
+int
+iopressure_init (const char *cgroup)
+{
+	static const char *mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+	char own[PATH_MAX], dirpath[PATH_MAX], path[PATH_MAX], name[NAME_MAX+1];
+	const char *base = NULL, *cp, *next;
+	size_t len;
+	unsigned int i;
+
+	iopressure_finish();
+	if (IO_PRESSURE_HIGH == 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	for (i = 0; i < sizeof(mounts)/sizeof(mounts[0]) && base == NULL; i++) {
+		snprintf(path, sizeof(path), "%s/cgroup.controllers", mounts[i]);
+		if (access(path, F_OK) == 0)
+			base = mounts[i];
+	}
+	if (base == NULL || own_cgroup(own, sizeof(own)) < 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	len = strlen(own);
+	while (len > 1 && own[len-1] == '/')
+		own[--len] = '\0';
+	/*
+	 * Walk down from the root to our own cgroup, watching
+	 * the siblings of our path at each level, then any
+	 * children of our own cgroup. Together those hold every
+	 * task that is not ours. The top levels (the slices)
+	 * aggregate everything under them, so they are watched
+	 * first, in case we run short of descriptors.
+	 */
+	for (cp = own; ; cp = next) {
+		snprintf(dirpath, sizeof(dirpath), "%s%.*s", base, (int) (cp - own), own);
+		if (*cp == '\0' || own[1] == '\0') {
+			watch_children(dirpath, NULL);
+			break;
+		}
+		next = cp + 1 + strcspn(cp + 1, "/");
+		snprintf(name, sizeof(name), "%.*s", (int) (next - cp - 1), cp + 1);
+		watch_children(dirpath, name);
+	}
+	if (cgroup != NULL) {
+		if (cgroup[0] == '/')
+			snprintf(dirpath, sizeof(dirpath), "%s", cgroup);
+		else if (strchr(cgroup, '.') != NULL)
+			snprintf(dirpath, sizeof(dirpath), "/system.slice/%s", cgroup);
+		else
+			snprintf(dirpath, sizeof(dirpath), "/system.slice/%s.service", cgroup);
+		len = strlen(dirpath);
+		while (len > 1 && dirpath[len-1] == '/')
+			dirpath[--len] = '\0';
+		if (len == 1 || (strncmp(own, dirpath, len) == 0 && (own[len] == '\0' || own[len] == '/')))
+			fprintf(stderr, "Warning: %s: contains our own cgroup, not watched\n", dirpath);
+		else if (snprintf(path, sizeof(path), "%s%s/io.pressure", base, dirpath) >= sizeof(path) ||
+			 add_watch(path) < 0)
+			fprintf(stderr, "Warning: %s: I/O pressure not available\n", path);
+	}
+	if (watch_dropped > 0)
+		fprintf(stderr, "Warning: could not watch I/O pressure of %u cgroup%s\n",
+			watch_dropped, (watch_dropped == 1 ? "" : "s"));
+	if (watch_count == 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	sample_start = now_usec();
+	enabled = true;
+	return 0;
+
+} /* iopressure_init */
+
+/*
+ * take_sample
+ *
+ * Works out the stall share over the last sample
+ * interval and adjusts the rate and chunk size.
+ *
+ * now: current time, in microseconds
+ *
+ * Returns: nothing
+ */
+static void
+take_sample (unsigned long long now)
+{
+	unsigned long long elapsed = now - sample_start;
+	unsigned long long total, stalled = 0;
+	unsigned int permille, i;
+	size_t throughput;
+
+	for (i = 0; i < watch_count; i++) {
+		if (read_stall_total(watches[i].fd, "some", &total) < 0)
+			continue;
+		if (total - watches[i].total > stalled)
+			stalled = total - watches[i].total;
+		watches[i].total = total;
+	}
+	permille = (stalled >= elapsed ? 1000 : (unsigned int) ((stalled * 1000) / elapsed));
+	throughput = (size_t) ((sample_bytes * 1000000ULL) / elapsed);
+	pressure_stats.samples += 1;
+	if (permille > pressure_stats.peak_permille)
+		pressure_stats.peak_permille = permille;
+
+	if (permille > IO_PRESSURE_HIGH * 10) {
+		if (rate == 0) {
+			open_rate = throughput;
+			rate = throughput;
+		}
+		rate /= 2;
+		if (rate < IO_PRESSURE_MIN_RATE)
+			rate = IO_PRESSURE_MIN_RATE;
+		if (chunk_shift < IOPRESSURE_MAX_SHIFT)
+			chunk_shift += 1;
+		if (pressure_stats.min_rate == 0 || rate < pressure_stats.min_rate)
+			pressure_stats.min_rate = rate;
+		pressure_stats.backoffs += 1;
+		pace_start = now;
+		pace_bytes = 0;
+	} else if (permille < IO_PRESSURE_LOW * 10 && rate != 0) {
+		rate *= 2;
+		if (chunk_shift > 0)
+			chunk_shift -= 1;
+		if (rate >= open_rate) {
+			rate = 0;
+			chunk_shift = 0;
+			pressure_stats.releases += 1;
+		} else
+			pressure_stats.increases += 1;
+		pace_start = now;
+		pace_bytes = 0;
+	}
+	sample_start = now;
+	sample_bytes = 0;
+
+} /* take_sample */
+
+/*
+ * iopressure_account
+ *
+ * Reports a completed chunk of I/O. Samples the pressure
+ * if the sample interval has passed, and, if throttled,
+ * sleeps long enough to keep to the allowed rate.
+ *
+ * bytes: size of the chunk
+ *
+ * Returns: nothing
+ */
+void
+iopressure_account (size_t bytes)
+{
+	unsigned long long now, due;
+	struct timespec ts;
+
+	if (!enabled)
+		return;
+	now = now_usec();
+	sample_bytes += bytes;
+	if (now - sample_start >= IOPRESSURE_SAMPLE_USEC)
+		take_sample(now);
+	if (rate == 0)
+		return;
+	pace_bytes += bytes;
+	due = pace_start + (pace_bytes * 1000000ULL) / rate;
+	if (due <= now)
+		return;
+	ts.tv_sec = (due - now) / 1000000ULL;
+	ts.tv_nsec = ((due - now) % 1000000ULL) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+	pressure_stats.throttle_usec += due - now;
+
+} /* iopressure_account */
+
+/*
+ * iopressure_chunk_limit
+ *
+ * Returns the chunk size to use for the next I/O,
+ * scaled down from the caller's maximum while the
+ * system is under I/O pressure.
+ *
+ * max: chunk size when unthrottled
+ *
+ * Returns: chunk size limit
+ */
+size_t
+iopressure_chunk_limit (size_t max)
+{
+	size_t limit = max >> chunk_shift;
+
+	if (limit < IOPRESSURE_MIN_CHUNK)
+		limit = (max < IOPRESSURE_MIN_CHUNK ? max : IOPRESSURE_MIN_CHUNK);
+	return limit;
+
+} /* iopressure_chunk_limit */
+
+/*
+ * iopressure_get_stats
+ *
+ * Returns the control loop statistics.
+ *
+ * stats: pointer to structure to fill in
+ *
+ * Returns: nothing
+ */
+void
+iopressure_get_stats (iopressure_stats_t *stats)
+{
+	*stats = pressure_stats;
+
+} /* iopressure_get_stats */
+
+/*
+ * iopressure_finish
+ *
+ * Stops watching I/O pressure and removes any
+ * throttling.
+ *
+ * Returns: nothing
+ */
+void
+iopressure_finish (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < watch_count; i++)
+		close(watches[i].fd);
+	free(watches);
+	watches = NULL;
+	watch_count = watch_cap = watch_dropped = 0;
+	enabled = false;
+	rate = 0;
+	chunk_shift = 0;
+	sample_bytes = 0;
+
+} /* iopressure_finish */
@@ -0,0 +1,24 @@
+#ifndef iopressure_h_included
+#define iopressure_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include <stddef.h>
+
+struct iopressure_stats_s {
+	unsigned long samples;
+	unsigned long backoffs;
+	unsigned long increases;
+	unsigned long releases;
+	unsigned int peak_permille;
+	size_t min_rate;
+	unsigned long throttle_usec;
+};
+typedef struct iopressure_stats_s iopressure_stats_t;
+
+int iopressure_init(const char *cgroup);
+void iopressure_account(size_t bytes);
+size_t iopressure_chunk_limit(size_t max);
+void iopressure_get_stats(iopressure_stats_t *stats);
+void iopressure_finish(void);
+
+#endif /* iopressure_h_included */
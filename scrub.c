@@ -0,0 +1,656 @@
+/*
+ * scrub.c
+ *
+ * Background integrity scrubbing of the redundant boot
+ * partitions.
+ *
+ * Each run reads a limited amount of the A and B copies
+ * of the redundant partitions - those in the boot device
+ * partition table, plus any X/X_b pairs on the main
+ * storage device found under /dev/disk/by-partlabel -
+ * and compares them, picking up where the previous run
+ * left off. The position, the amount read in the current
+ * hour, and the results of the current and previous passes
+ * are kept in a state file under SCRUB_STATE_DIR, rather
+ * than on the boot device, so that frequent runs do not
+ * wear out (or risk power-loss damage to) the boot media.
+ *
+ * Only redundant copies named with the "_b" suffix are
+ * recognized, as used on tegra186/tegra194; the t210
+ * naming ("-1", "_R") is not handled.
+ *
+ * The two copies of a partition are only expected to match
+ * when both boot slots are at the same version (the VER and
+ * VER_b partitions match); otherwise, differences are just
+ * counted. Read errors are always reported. The VER reads
+ * count against the budget like any other.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "scrub.h"
+#include "util.h"
+#include "iopressure.h"
+#include "config.h"
+
+#define SCRUB_CHUNK_SIZE (64 * 1024)
+#define SCRUB_MAX_TARGETS 64
+/*
+ * Larger partitions (such as the rootfs) are expected to
+ * differ between slots and are not scrubbed.
+ */
+#define SCRUB_MAX_PARTITION_SIZE (256 * 1024 * 1024)
+#define SCRUB_BUDGET_WINDOW 3600
+
+static const char partlabel_dir[] = "/dev/disk/by-partlabel";
+static const char state_dir[] = SCRUB_STATE_DIR;
+static const char state_file[] = "scrub-state";
+
+struct scrub_target_s {
+	char name[64];
+	char devname[2][PATH_MAX];
+	off_t offset[2];
+	off_t size;
+};
+
+struct scrub_state_s {
+	char cursor_name[64];
+	off_t cursor_offset;
+	time_t window_start;
+	unsigned long long window_bytes;
+	unsigned int pass;
+	unsigned int read_errors;
+	unsigned int mismatches;
+	bool have_last_pass;
+	unsigned int last_pass;
+	unsigned int last_read_errors;
+	unsigned int last_mismatches;
+	time_t last_completed;
+};
+
+static struct scrub_target_s targets[SCRUB_MAX_TARGETS];
+static unsigned int target_count;
+
+/*
+ * target_compare
+ *
+ * qsort comparison function for ordering the targets
+ * by name, so the cursor position is stable.
+ */
+static int
+target_compare (const void *a, const void *b)
+{
+	return strcmp(((const struct scrub_target_s *) a)->name,
+		      ((const struct scrub_target_s *) b)->name);
+
+} /* target_compare */
+
+/*
+ * add_boot_targets
+ *
+ * Adds the redundant pairs from the boot device
+ * partition table.
+ *
+ * Returns: nothing
+ */
+static void
+add_boot_targets (const char *bootdev, const char *gptdev, gpt_context_t *gptctx, off_t bootdev_size)
+{
+	gpt_entry_t *part, *other;
+	void *iter = NULL;
+	char othername[64];
+	struct scrub_target_s *t;
+	off_t offset;
+	int i;
+
+	for (part = gpt_enumerate_partitions(gptctx, &iter); part != NULL;
+	     part = gpt_enumerate_partitions(gptctx, &iter)) {
+		if (part->part_name[0] == '\0' || target_count >= SCRUB_MAX_TARGETS)
+			continue;
+		snprintf(othername, sizeof(othername), "%s_b", part->part_name);
+		other = gpt_find_by_name(gptctx, othername);
+		if (other == NULL)
+			continue;
+		t = &targets[target_count];
+		memset(t, 0, sizeof(*t));
+		strncpy(t->name, part->part_name, sizeof(t->name)-1);
+		for (i = 0; i < 2; i++) {
+			gpt_entry_t *p = (i == 0 ? part : other);
+			offset = p->first_lba * gpt_blocksize(gptctx);
+			/*
+			 * As in the updater, offsets past the end of the
+			 * boot device are in the GPT device.
+			 */
+			if (offset >= bootdev_size && strcmp(bootdev, gptdev) != 0) {
+				strcpy(t->devname[i], gptdev);
+				offset -= bootdev_size;
+			} else
+				strcpy(t->devname[i], bootdev);
+			t->offset[i] = offset;
+		}
+		t->size = (part->last_lba - part->first_lba + 1) * gpt_blocksize(gptctx);
+		offset = (other->last_lba - other->first_lba + 1) * gpt_blocksize(gptctx);
+		if (offset < t->size)
+			t->size = offset;
+		target_count += 1;
+	}
+
+} /* add_boot_targets */
+
+/*
+ * partlabel_size
+ *
+ * Returns: size of the partition with the given label,
+ *          or -1 if not present
+ */
+static off_t
+partlabel_size (const char *label, char *pathbuf, size_t pathbufsize)
+{
+	off_t size;
+	int fd;
+
+	snprintf(pathbuf, pathbufsize, "%s/%s", partlabel_dir, label);
+	fd = open(pathbuf, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	size = lseek(fd, 0, SEEK_END);
+	close(fd);
+	return size;
+
+} /* partlabel_size */
+
+/*
+ * add_partlabel_targets
+ *
+ * Adds the X/X_b pairs found in /dev/disk/by-partlabel,
+ * skipping any that are already covered by the boot
+ * device partition table, or that are too large.
+ *
+ * Returns: nothing
+ */
+static void
+add_partlabel_targets (void)
+{
+	DIR *dir;
+	struct dirent *de;
+	char base[64];
+	struct scrub_target_s *t;
+	unsigned int i, boot_count = target_count;
+	off_t size[2];
+	size_t len;
+
+	dir = opendir(partlabel_dir);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL && target_count < SCRUB_MAX_TARGETS) {
+		len = strlen(de->d_name);
+		if (len < 3 || len >= sizeof(base) + 2 || strcmp(de->d_name + len - 2, "_b") != 0)
+			continue;
+		memcpy(base, de->d_name, len - 2);
+		base[len-2] = '\0';
+		for (i = 0; i < boot_count && strcmp(targets[i].name, base) != 0; i++);
+		if (i < boot_count)
+			continue;
+		t = &targets[target_count];
+		memset(t, 0, sizeof(*t));
+		size[0] = partlabel_size(base, t->devname[0], sizeof(t->devname[0]));
+		size[1] = partlabel_size(de->d_name, t->devname[1], sizeof(t->devname[1]));
+		if (size[0] <= 0 || size[1] <= 0)
+			continue;
+		t->size = (size[0] < size[1] ? size[0] : size[1]);
+		if (t->size > SCRUB_MAX_PARTITION_SIZE)
+			continue;
+		strcpy(t->name, base);
+		target_count += 1;
+	}
+	closedir(dir);
+
+} /* add_partlabel_targets */
+
+/*
+ * read_partition
+ *
+ * Reads an entire (small) partition into a newly
+ * allocated buffer.
+ *
+ * Returns: buffer pointer, or NULL on error
+ */
+static uint8_t *
+read_partition (const char *devname, off_t offset, size_t size)
+{
+	uint8_t *buf;
+	int fd;
+
+	buf = malloc(size);
+	if (buf == NULL)
+		return NULL;
+	fd = open(devname, O_RDONLY);
+	if (fd < 0 || pread(fd, buf, size, offset) != (ssize_t) size) {
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return NULL;
+	}
+	close(fd);
+	return buf;
+
+} /* read_partition */
+
+/*
+ * find_target
+ *
+ * Returns: index of the named target, or target_count
+ *          if not present
+ */
+static unsigned int
+find_target (const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < target_count && strcmp(targets[i].name, name) != 0; i++);
+	return i;
+
+} /* find_target */
+
+/*
+ * slots_at_same_version
+ *
+ * Checks whether the VER and VER_b partitions match,
+ * in which case both slots should hold the same content.
+ *
+ * Returns: true if they match, false otherwise
+ */
+static bool
+slots_at_same_version (void)
+{
+	unsigned int i = find_target("VER");
+	uint8_t *ver[2];
+	bool match;
+
+	if (i >= target_count)
+		return false;
+	ver[0] = read_partition(targets[i].devname[0], targets[i].offset[0], targets[i].size);
+	ver[1] = read_partition(targets[i].devname[1], targets[i].offset[1], targets[i].size);
+	match = ver[0] != NULL && ver[1] != NULL && memcmp(ver[0], ver[1], targets[i].size) == 0;
+	free(ver[0]);
+	free(ver[1]);
+	return match;
+
+} /* slots_at_same_version */
+
+/*
+ * open_state_dir
+ *
+ * Opens (creating if needed) the directory holding
+ * the state file, and locks it so that only one scrub
+ * runs at a time.
+ *
+ * Returns: directory file descriptor, or -1 on error
+ *          (errno set; EWOULDBLOCK if another scrub is
+ *          running)
+ */
+static int
+open_state_dir (void)
+{
+	int dirfd;
+
+	if (mkdir(state_dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	dirfd = open(state_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dirfd < 0)
+		return -1;
+	if (flock(dirfd, LOCK_EX|LOCK_NB) < 0) {
+		close(dirfd);
+		return -1;
+	}
+	return dirfd;
+
+} /* open_state_dir */
+
+/*
+ * load_state
+ *
+ * Retrieves the scrubber state from the state file.
+ * A missing file, or missing or malformed lines,
+ * start from the beginning.
+ *
+ * Returns: nothing
+ */
+static void
+load_state (int dirfd, struct scrub_state_s *state)
+{
+	char line[256];
+	long long offset, wstart, completed = 0;
+	FILE *fp;
+	int fd;
+
+	memset(state, 0, sizeof(*state));
+	fd = openat(dirfd, state_file, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "cursor ", 7) == 0) {
+			if (sscanf(line, "cursor %63s %lld", state->cursor_name, &offset) == 2 && offset >= 0)
+				state->cursor_offset = offset;
+			else
+				state->cursor_name[0] = '\0';
+		} else if (strncmp(line, "budget ", 7) == 0) {
+			if (sscanf(line, "budget %lld %llu", &wstart, &state->window_bytes) == 2)
+				state->window_start = wstart;
+			else
+				state->window_bytes = 0;
+		} else if (strncmp(line, "pass ", 5) == 0) {
+			if (sscanf(line, "pass %u %u %u", &state->pass, &state->read_errors,
+				   &state->mismatches) != 3)
+				state->pass = state->read_errors = state->mismatches = 0;
+		} else if (strncmp(line, "last_pass ", 10) == 0) {
+			state->have_last_pass = sscanf(line, "last_pass %u %u %u %lld", &state->last_pass,
+						       &state->last_read_errors, &state->last_mismatches,
+						       &completed) == 4;
+			state->last_completed = completed;
+		}
+	}
+	fclose(fp);
+
+} /* load_state */
+
+/*
+ * save_state
+ *
+ * Saves the scrubber state, replacing the state
+ * file atomically.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+save_state (int dirfd, struct scrub_state_s *state)
+{
+	char tmpname[64];
+	FILE *fp;
+	int fd;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", state_file);
+	fd = openat(dirfd, tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		close(fd);
+		unlinkat(dirfd, tmpname, 0);
+		return -1;
+	}
+	fprintf(fp, "cursor %s %lld\n", state->cursor_name, (long long) state->cursor_offset);
+	fprintf(fp, "budget %lld %llu\n", (long long) state->window_start, state->window_bytes);
+	fprintf(fp, "pass %u %u %u\n", state->pass, state->read_errors, state->mismatches);
+	if (state->have_last_pass)
+		fprintf(fp, "last_pass %u %u %u %lld\n", state->last_pass, state->last_read_errors,
+			state->last_mismatches, (long long) state->last_completed);
+	if (fflush(fp) != 0 || fsync(fd) < 0) {
+		fclose(fp);
+		unlinkat(dirfd, tmpname, 0);
+		return -1;
+	}
+	if (fclose(fp) != 0 || renameat(dirfd, tmpname, dirfd, state_file) < 0) {
+		unlinkat(dirfd, tmpname, 0);
+		return -1;
+	}
+	return 0;
+
+} /* save_state */
+
+/*
+ * read_chunk
+ *
+ * Reads a chunk of one copy of a target, dropping any
+ * cached pages first so the read goes to the media.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+read_chunk (int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+	size_t total;
+
+	posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+	for (total = 0; total < len; total += n) {
+		n = pread(fd, (uint8_t *) buf + total, len - total, offset + total);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+
+} /* read_chunk */
+
+/*
+ * scrub_run
+ *
+ * Scrubs the next portion of the redundant partitions,
+ * within the configured per-run and per-hour limits.
+ *
+ * bootdev: boot device name
+ * gptdev: GPT device name (may be the same as bootdev)
+ * gptctx: loaded boot sector GPT context
+ *
+ * Returns: 0 if no problems were found,
+ *          1 if read errors or mismatches were found,
+ *          -1 on other errors
+ */
+int
+scrub_run (const char *bootdev, const char *gptdev, gpt_context_t *gptctx)
+{
+	static uint8_t buf[2][SCRUB_CHUNK_SIZE];
+	struct scrub_state_s state;
+	struct scrub_target_s *t;
+	unsigned long long allowance, scrubbed = 0, done, total, ver_cost = 0;
+	unsigned int i, cur, run_errors = 0, run_mismatches = 0, run_differ = 0;
+	bool same_version, pass_completed = false;
+	int fds[2] = { -1, -1 };
+	off_t bootdev_size, pos;
+	size_t len, chunkmax;
+	time_t now;
+	int fd, dirfd, c, ret = -1;
+	iopressure_stats_t pstats;
+
+	fd = open(bootdev, O_RDONLY);
+	if (fd < 0) {
+		perror(bootdev);
+		return -1;
+	}
+	bootdev_size = lseek(fd, 0, SEEK_END);
+	close(fd);
+	if (bootdev_size == (off_t) -1) {
+		perror(bootdev);
+		return -1;
+	}
+	target_count = 0;
+	add_boot_targets(bootdev, gptdev, gptctx, bootdev_size);
+	add_partlabel_targets();
+	if (target_count == 0) {
+		printf("No redundant partitions to scrub\n");
+		return 0;
+	}
+	qsort(targets, target_count, sizeof(targets[0]), target_compare);
+
+	dirfd = open_state_dir();
+	if (dirfd < 0) {
+		if (errno == EWOULDBLOCK) {
+			printf("Scrub already in progress\n");
+			return 0;
+		}
+		perror(state_dir);
+		return -1;
+	}
+	load_state(dirfd, &state);
+
+	now = time(NULL);
+	if (now < state.window_start || now - state.window_start >= SCRUB_BUDGET_WINDOW) {
+		state.window_start = now;
+		state.window_bytes = 0;
+	}
+	if (state.window_bytes >= SCRUB_BYTES_PER_HOUR) {
+		printf("Scrub budget of %llu KiB for this hour already used\n",
+		       (unsigned long long) SCRUB_BYTES_PER_HOUR / 1024);
+		ret = 0;
+		goto depart;
+	}
+	allowance = SCRUB_BYTES_PER_HOUR - state.window_bytes;
+	if (allowance > SCRUB_BYTES_PER_RUN)
+		allowance = SCRUB_BYTES_PER_RUN;
+	/*
+	 * Comparing VER and VER_b reads both in full,
+	 * which comes out of the budget first.
+	 */
+	i = find_target("VER");
+	if (i < target_count)
+		ver_cost = 2 * (unsigned long long) targets[i].size;
+	if (ver_cost > allowance) {
+		printf("Scrub budget left this hour (%llu KiB) is too small to compare VER\n",
+		       allowance / 1024);
+		ret = 0;
+		goto depart;
+	}
+	same_version = slots_at_same_version();
+	allowance -= ver_cost;
+	scrubbed += ver_cost;
+
+	for (cur = 0; cur < target_count && strcmp(targets[cur].name, state.cursor_name) != 0; cur++);
+	if (cur >= target_count || state.cursor_offset >= targets[cur].size) {
+		cur = 0;
+		state.cursor_offset = 0;
+	}
+	pos = state.cursor_offset;
+
+	/*
+	 * Each chunk is read from both copies, and both
+	 * reads count against the budget.
+	 */
+	while (allowance >= 2 * 512 && !pass_completed) {
+		t = &targets[cur];
+		if (fds[0] < 0) {
+			for (i = 0; i < 2; i++) {
+				fds[i] = open(t->devname[i], O_RDONLY);
+				if (fds[i] < 0) {
+					perror(t->devname[i]);
+					goto depart;
+				}
+			}
+		}
+		/*
+		 * Chunks get smaller, and reads slower, while other
+		 * users of the system are stalled on I/O
+		 */
+		chunkmax = iopressure_chunk_limit(SCRUB_CHUNK_SIZE);
+		len = (t->size - pos < chunkmax ? t->size - pos : chunkmax);
+		if (len > allowance / 2)
+			len = (allowance / 2) & ~((size_t) 511);
+		for (i = 0, c = 0; i < 2; i++) {
+			if (read_chunk(fds[i], buf[i], len, t->offset[i] + pos) < 0) {
+				fprintf(stderr, "Error: %s%s: read error at offset %lld: %s\n",
+					t->name, (i == 0 ? "" : "_b"), (long long) pos, strerror(errno));
+				run_errors += 1;
+				c = -1;
+			}
+		}
+		if (c == 0 && memcmp(buf[0], buf[1], len) != 0) {
+			if (same_version) {
+				fprintf(stderr, "Error: %s: copies differ at offset %lld\n", t->name, (long long) pos);
+				run_mismatches += 1;
+			} else
+				run_differ += 1;
+		}
+		iopressure_account(2 * len);
+		pos += len;
+		allowance -= 2 * len;
+		scrubbed += 2 * len;
+		if (pos >= t->size) {
+			for (i = 0; i < 2; i++) {
+				close(fds[i]);
+				fds[i] = -1;
+			}
+			pos = 0;
+			cur += 1;
+			if (cur >= target_count) {
+				cur = 0;
+				pass_completed = true;
+			}
+		}
+	}
+
+	state.window_bytes += scrubbed;
+	state.read_errors += run_errors;
+	state.mismatches += run_mismatches;
+	strcpy(state.cursor_name, targets[cur].name);
+	state.cursor_offset = pos;
+	if (pass_completed) {
+		state.have_last_pass = true;
+		state.last_pass = state.pass;
+		state.last_read_errors = state.read_errors;
+		state.last_mismatches = state.mismatches;
+		state.last_completed = now;
+		state.pass += 1;
+		state.read_errors = state.mismatches = 0;
+	}
+	if (save_state(dirfd, &state) < 0) {
+		perror("saving scrub state");
+		goto depart;
+	}
+
+	for (i = 0, done = total = 0; i < target_count; i++) {
+		if (i < cur)
+			done += targets[i].size;
+		total += targets[i].size;
+	}
+	done += pos;
+	printf("Scrubbed %llu KiB (%llu KiB comparing VER): %u read error%s, %u mismatch%s",
+	       scrubbed / 1024, ver_cost / 1024, run_errors, (run_errors == 1 ? "" : "s"),
+	       run_mismatches, (run_mismatches == 1 ? "" : "es"));
+	if (run_differ != 0)
+		printf(" (%u chunk%s differ between slots at different versions)",
+		       run_differ, (run_differ == 1 ? "" : "s"));
+	printf("\n");
+	if (pass_completed)
+		printf("Pass %u complete\n", state.pass - 1);
+	else
+		printf("Pass %u: %llu%% complete, next: %s at offset %lld\n", state.pass,
+		       (done * 100) / total, state.cursor_name, (long long) state.cursor_offset);
+	printf("Budget: %llu of %llu KiB used this hour\n",
+	       state.window_bytes / 1024, (unsigned long long) SCRUB_BYTES_PER_HOUR / 1024);
+	iopressure_get_stats(&pstats);
+	if (pstats.backoffs != 0)
+		printf("Slowed down %lu time%s for I/O pressure (peak %u.%u%% stalled), %lu.%03lu s throttled\n",
+		       pstats.backoffs, (pstats.backoffs == 1 ? "" : "s"),
+		       pstats.peak_permille / 10, pstats.peak_permille % 10,
+		       pstats.throttle_usec / 1000000UL, (pstats.throttle_usec / 1000UL) % 1000UL);
+	ret = (run_errors != 0 || run_mismatches != 0 ? 1 : 0);
+
+  depart:
+	for (i = 0; i < 2; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	close(dirfd);
+	return ret;
+
+} /* scrub_run */
@@ -0,0 +1,9 @@
+#ifndef scrub_h_included
+#define scrub_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include "gpt.h"
+
+int scrub_run(const char *bootdev, const char *gptdev, gpt_context_t *gptctx);
+
+#endif /* scrub_h_included */
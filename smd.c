@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <zlib.h>
 #include "smd.h"
+#include "blkcache.h"
 
 /*
  * Structures used in the SMD storage
@@ -102,7 +103,7 @@ smd_init (gpt_context_t *boot_gpt, int bootfd)
 {
 	smd_context_t *ctx;
 	gpt_entry_t *part;
-	ssize_t n, total, remain;
+	ssize_t n;
 	int i;
 
 	ctx = calloc(1, sizeof(smd_context_t));
@@ -115,13 +116,9 @@ smd_init (gpt_context_t *boot_gpt, int bootfd)
 		part = gpt_find_by_name(boot_gpt, (i == 0 ? "SMD" : "SMD_b"));
 		if (part == NULL)
 			continue;
-		if (lseek(bootfd, part->first_lba * 512, SEEK_SET) == (off_t) -1)
+		n = blkcache_pread(bootfd, &ctx->smd_ods.smd, sizeof(ctx->smd_ods.smd), part->first_lba * gpt_blocksize(boot_gpt));
+		if (n != sizeof(ctx->smd_ods.smd))
 			continue;
-		for (remain = sizeof(ctx->smd_ods.smd), total = 0; remain > 0; total += n, remain -= n) {
-			n = read(bootfd, (uint8_t *) &ctx->smd_ods.smd + total, remain);
-			if (n <= 0)
-				continue;
-		}
 
 		if (memcmp(ctx->smd_ods.smd.magic, smd_magic, sizeof(smd_magic)) != 0)
 			continue;
@@ -144,11 +141,10 @@ smd_init (gpt_context_t *boot_gpt, int bootfd)
 		 */
 		if (ctx->smd_ods.smd.version >= 4) {
 			uint32_t extcrc;
-			for (remain = sizeof(ctx->smd_ods.ext), total = 0; remain > 0; total += n, remain -= n) {
-				n = read(bootfd, (uint8_t *) &ctx->smd_ods.ext + total, remain);
-				if (n <= 0)
-					continue;
-			}
+			n = blkcache_pread(bootfd, &ctx->smd_ods.ext, sizeof(ctx->smd_ods.ext),
+					   part->first_lba * gpt_blocksize(boot_gpt) + sizeof(ctx->smd_ods.smd));
+			if (n != sizeof(ctx->smd_ods.ext))
+				continue;
 			if (ctx->smd_ods.ext.len > sizeof(ctx->smd_ods.ext) - sizeof(uint32_t))
 				continue;
 			extcrc = crc32(0, (void *) &ctx->smd_ods.ext.len, ctx->smd_ods.ext.len);
@@ -562,8 +558,6 @@ int
 smd_update (smd_context_t *ctx, gpt_context_t *boot_gpt, int bootfd, bool force)
 {
 	gpt_entry_t *part;
-	ssize_t n, total;
-	size_t remain;
 	int i;
 
 	if (!(force || ctx->needs_update))
@@ -581,22 +575,12 @@ smd_update (smd_context_t *ctx, gpt_context_t *boot_gpt, int bootfd, bool force)
 		part = gpt_find_by_name(boot_gpt, (i == 0 ? "SMD" : "SMD_b"));
 		if (part == NULL)
 			continue;
-		if (lseek(bootfd, part->first_lba * 512, SEEK_SET) == (off_t) -1)
+		if (blkcache_pwrite(bootfd, &ctx->smd_ods, sizeof(ctx->smd_ods), part->first_lba * gpt_blocksize(boot_gpt)) < 0)
 			continue;
-		for (remain = sizeof(ctx->smd_ods), total = 0; remain > 0; total += n, remain -= n) {
-			n = write(bootfd, (uint8_t *) &ctx->smd_ods.smd + total, remain);
-			if (n <= 0)
-				continue;
-		}
 		if (ctx->smd_ods.smd.version < 4)
 			continue;
-		for (remain = ctx->smd_ods.ext.len + sizeof(uint32_t), total = 0;
-		     remain > 0;
-		     total += n, remain -= n) {
-			n = write(bootfd, (uint8_t *) &ctx->smd_ods.ext + total, remain);
-			if (n <= 0)
-				continue;
-		}
+		blkcache_pwrite(bootfd, &ctx->smd_ods.ext, ctx->smd_ods.ext.len + sizeof(uint32_t),
+				part->first_lba * gpt_blocksize(boot_gpt) + sizeof(ctx->smd_ods));
 	}
 	ctx->needs_update = false;
 	return 0;
@@ -0,0 +1,568 @@
+/*
+ * snapshot.c
+ *
+ * Functions for saving the contents of the boot devices
+ * (boot partitions, pseudo-GPT, slot metadata, and bootinfo)
+ * to a compressed snapshot file, and for restoring them.
+ *
+ * Each device is stored as a series of fixed-size chunks,
+ * compressed separately, with a checksum of the uncompressed
+ * contents. On restore, only the chunks whose checksums differ
+ * from the current device contents are written, in the same
+ * order the bootloader updater uses: everything else first,
+ * then the BCT, then mb1 and mb1_b, and finally the slot
+ * metadata and pseudo-GPT.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#include "snapshot.h"
+#include "blkcache.h"
+#include "util.h"
+
+static const char SNAPSHOT_MAGIC[8] = {'T', 'B', 'C', 'S', 'N', 'A', 'P', '1'};
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_CHUNK_SIZE (64 * 1024)
+#define SNAPSHOT_MAX_DEVICES 2
+#define SNAPSHOT_MAX_REGIONS 8
+
+/*
+ * Write ordering ranks, lowest first
+ */
+#define RANK_OTHER	0
+#define RANK_BCT	1
+#define RANK_MB1	2
+#define RANK_MB1_OTHER	3
+#define RANK_METADATA	4
+#define RANK_COUNT	5
+
+struct snapshot_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_size;
+	uint32_t device_count;
+	uint32_t region_count;
+} __attribute__((packed));
+
+struct snapshot_device_s {
+	char devname[64];
+	uint64_t size;
+} __attribute__((packed));
+
+struct snapshot_region_s {
+	char name[36];
+	uint32_t device;
+	uint32_t rank;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t length;
+} __attribute__((packed));
+
+struct snapshot_chunk_s {
+	uint32_t crc;
+	uint32_t adler;
+	uint32_t length;
+} __attribute__((packed));
+
+static const struct {
+	const char *name;
+	unsigned int rank;
+} ordered_parts[] = {
+	{ "BCT",	RANK_BCT },
+	{ "mb1",	RANK_MB1 },
+	{ "mb1_b",	RANK_MB1_OTHER },
+	{ "SMD",	RANK_METADATA },
+	{ "SMD_b",	RANK_METADATA },
+};
+
+/*
+ * read_all/write_all
+ *
+ * Read or write a complete buffer from/to a file,
+ * handling short transfers.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+read_all (int fd, void *buf, size_t len)
+{
+	ssize_t n;
+	size_t total;
+
+	for (total = 0; total < len; total += n) {
+		n = read(fd, (uint8_t *) buf + total, len - total);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+
+} /* read_all */
+
+static int
+write_all (int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+	size_t total;
+
+	for (total = 0; total < len; total += n) {
+		n = write(fd, (const uint8_t *) buf + total, len - total);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+
+} /* write_all */
+
+/*
+ * chunk_checksum
+ *
+ * Computes the checksum for a chunk of device contents.
+ * A CRC32 and an Adler-32 are kept together, since both
+ * are cheap and zlib already provides them.
+ */
+static void
+chunk_checksum (const uint8_t *buf, size_t len, uint32_t *crcp, uint32_t *adlerp)
+{
+	*crcp = crc32(0, buf, len);
+	*adlerp = adler32(1, buf, len);
+
+} /* chunk_checksum */
+
+/*
+ * open_devices
+ *
+ * Opens the boot device and, if it is a separate device,
+ * the GPT device, and gets their sizes.
+ *
+ * Returns: number of devices opened, or -1 on error
+ */
+static int
+open_devices (const char *bootdev, const char *gptdev, bool writeable,
+	      int fds[SNAPSHOT_MAX_DEVICES], struct snapshot_device_s devs[SNAPSHOT_MAX_DEVICES])
+{
+	const char *names[SNAPSHOT_MAX_DEVICES] = { bootdev, gptdev };
+	int i, count = (strcmp(bootdev, gptdev) == 0 ? 1 : 2);
+	off_t size;
+
+	for (i = 0; i < count; i++) {
+		fds[i] = open(names[i], (writeable ? O_RDWR : O_RDONLY));
+		if (fds[i] < 0) {
+			perror(names[i]);
+			return -1;
+		}
+		size = lseek(fds[i], 0, SEEK_END);
+		if (size == (off_t) -1) {
+			perror(names[i]);
+			return -1;
+		}
+		memset(&devs[i], 0, sizeof(devs[i]));
+		strncpy(devs[i].devname, names[i], sizeof(devs[i].devname)-1);
+		devs[i].size = size;
+	}
+	return count;
+
+} /* open_devices */
+
+/*
+ * find_regions
+ *
+ * Locates the partitions that need ordered writes, and
+ * the pseudo-GPT itself, using the boot sector GPT.
+ *
+ * Returns: number of regions found
+ */
+static unsigned int
+find_regions (gpt_context_t *gptctx, const struct snapshot_device_s *devs, int device_count,
+	      struct snapshot_region_s *regions)
+{
+	gpt_entry_t *part;
+	unsigned int i, count = 0;
+	uint64_t offset;
+
+	for (i = 0; i < sizeof(ordered_parts)/sizeof(ordered_parts[0]); i++) {
+		part = gpt_find_by_name(gptctx, ordered_parts[i].name);
+		if (part == NULL)
+			continue;
+		memset(&regions[count], 0, sizeof(regions[count]));
+		strncpy(regions[count].name, ordered_parts[i].name, sizeof(regions[count].name)-1);
+		regions[count].rank = ordered_parts[i].rank;
+		offset = part->first_lba * gpt_blocksize(gptctx);
+		/*
+		 * As in the updater, offsets past the end of the boot
+		 * device are in the GPT device.
+		 */
+		if (device_count > 1 && offset >= devs[0].size) {
+			regions[count].device = 1;
+			offset -= devs[0].size;
+		}
+		regions[count].offset = offset;
+		regions[count].length = (part->last_lba - part->first_lba + 1) * gpt_blocksize(gptctx);
+		count += 1;
+	}
+	memset(&regions[count], 0, sizeof(regions[count]));
+	strcpy(regions[count].name, "GPT");
+	regions[count].device = device_count - 1;
+	regions[count].rank = RANK_METADATA;
+	regions[count].length = (GPT_SIZE_IN_BLOCKS + 1) * gpt_blocksize(gptctx);
+	regions[count].offset = devs[device_count-1].size - regions[count].length;
+	return count + 1;
+
+} /* find_regions */
+
+/*
+ * rank_at
+ *
+ * Returns the write-ordering rank for a position in
+ * a device, and sets *nextp to the next position at
+ * which the rank might change.
+ */
+static unsigned int
+rank_at (const struct snapshot_region_s *regions, unsigned int region_count,
+	 unsigned int dev, uint64_t pos, uint64_t *nextp)
+{
+	const struct snapshot_region_s *r;
+	unsigned int i, rank = RANK_OTHER;
+	uint64_t next = UINT64_MAX;
+
+	for (i = 0, r = regions; i < region_count; i++, r++) {
+		if (r->device != dev)
+			continue;
+		if (pos >= r->offset && pos < r->offset + r->length) {
+			if (r->rank > rank)
+				rank = r->rank;
+			if (r->offset + r->length < next)
+				next = r->offset + r->length;
+		} else if (r->offset > pos && r->offset < next)
+			next = r->offset;
+	}
+	*nextp = next;
+	return rank;
+
+} /* rank_at */
+
+/*
+ * snapshot_create
+ *
+ * Saves the contents of the boot device(s) to a snapshot file.
+ *
+ * filename: path of snapshot file to create
+ * bootdev: boot device name
+ * gptdev: GPT device name (may be the same as bootdev)
+ * gptctx: loaded boot sector GPT context
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+snapshot_create (const char *filename, const char *bootdev, const char *gptdev, gpt_context_t *gptctx)
+{
+	struct snapshot_header_s hdr;
+	struct snapshot_device_s devs[SNAPSHOT_MAX_DEVICES];
+	struct snapshot_region_s regions[SNAPSHOT_MAX_REGIONS];
+	struct snapshot_chunk_s chunk;
+	int fds[SNAPSHOT_MAX_DEVICES] = { -1, -1 };
+	int outfd = -1, device_count, d, ret = -1;
+	uint8_t *buf = NULL, *cbuf = NULL;
+	uLongf clen, cbufsize = compressBound(SNAPSHOT_CHUNK_SIZE);
+	uint64_t pos, total = 0, ctotal = 0;
+	uint32_t crc, adler;
+	size_t len;
+
+	device_count = open_devices(bootdev, gptdev, false, fds, devs);
+	if (device_count < 0)
+		goto depart;
+	buf = malloc(SNAPSHOT_CHUNK_SIZE);
+	cbuf = malloc(cbufsize);
+	if (buf == NULL || cbuf == NULL) {
+		perror("allocating buffers");
+		goto depart;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.chunk_size = SNAPSHOT_CHUNK_SIZE;
+	hdr.device_count = device_count;
+	hdr.region_count = find_regions(gptctx, devs, device_count, regions);
+
+	outfd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP);
+	if (outfd < 0) {
+		perror(filename);
+		goto depart;
+	}
+	if (write_all(outfd, &hdr, sizeof(hdr)) < 0 ||
+	    write_all(outfd, devs, sizeof(devs[0]) * device_count) < 0 ||
+	    write_all(outfd, regions, sizeof(regions[0]) * hdr.region_count) < 0) {
+		perror(filename);
+		goto depart;
+	}
+	for (d = 0; d < device_count; d++) {
+		for (pos = 0; pos < devs[d].size; pos += len) {
+			len = (devs[d].size - pos < SNAPSHOT_CHUNK_SIZE ? devs[d].size - pos : SNAPSHOT_CHUNK_SIZE);
+			if (blkcache_pread(fds[d], buf, len, pos) != (ssize_t) len) {
+				perror(devs[d].devname);
+				goto depart;
+			}
+			chunk_checksum(buf, len, &crc, &adler);
+			chunk.crc = crc;
+			chunk.adler = adler;
+			clen = cbufsize;
+			if (compress2(cbuf, &clen, buf, len, Z_BEST_COMPRESSION) != Z_OK) {
+				fprintf(stderr, "Error: could not compress snapshot data\n");
+				goto depart;
+			}
+			chunk.length = clen;
+			if (write_all(outfd, &chunk, sizeof(chunk)) < 0 ||
+			    write_all(outfd, cbuf, clen) < 0) {
+				perror(filename);
+				goto depart;
+			}
+			total += len;
+			ctotal += clen;
+		}
+	}
+	if (fsync(outfd) < 0) {
+		perror(filename);
+		goto depart;
+	}
+	printf("Saved %llu bytes from %d device%s (%llu bytes compressed) to %s\n",
+	       (unsigned long long) total, device_count, (device_count == 1 ? "" : "s"),
+	       (unsigned long long) ctotal, filename);
+	ret = 0;
+
+  depart:
+	if (outfd >= 0) {
+		close(outfd);
+		if (ret != 0)
+			unlink(filename);
+	}
+	for (d = 0; d < SNAPSHOT_MAX_DEVICES; d++)
+		if (fds[d] >= 0)
+			close(fds[d]);
+	free(cbuf);
+	free(buf);
+	return ret;
+
+} /* snapshot_create */
+
+/*
+ * snapshot_restore
+ *
+ * Restores the boot device(s) from a snapshot file, writing
+ * only the chunks that differ from the current contents.
+ * The whole snapshot is decompressed and verified before
+ * anything is written.
+ *
+ * filename: path of snapshot file
+ * bootdev: boot device name
+ * gptdev: GPT device name (may be the same as bootdev)
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int
+snapshot_restore (const char *filename, const char *bootdev, const char *gptdev)
+{
+	struct snapshot_header_s hdr;
+	struct snapshot_device_s devs[SNAPSHOT_MAX_DEVICES], curdevs[SNAPSHOT_MAX_DEVICES];
+	struct snapshot_region_s regions[SNAPSHOT_MAX_REGIONS];
+	struct snapshot_chunk_s chunk;
+	int fds[SNAPSHOT_MAX_DEVICES] = { -1, -1 };
+	bool reset_writeable[SNAPSHOT_MAX_DEVICES] = { false, false };
+	uint8_t *image[SNAPSHOT_MAX_DEVICES] = { NULL, NULL };
+	bool *changed[SNAPSHOT_MAX_DEVICES] = { NULL, NULL };
+	int infd = -1, device_count = 0, d, ret = -1;
+	uint8_t *buf = NULL, *cbuf = NULL;
+	uLongf clen, cbufsize = compressBound(SNAPSHOT_CHUNK_SIZE);
+	uint32_t crc, adler, image_crc, image_adler;
+	unsigned int rank, c, chunk_count[SNAPSHOT_MAX_DEVICES];
+	unsigned int changed_count = 0, total_count = 0;
+	uint64_t pos, next, end, written = 0;
+	size_t len;
+	bool phase_wrote;
+
+	infd = open(filename, O_RDONLY);
+	if (infd < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (read_all(infd, &hdr, sizeof(hdr)) < 0 ||
+	    memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SNAPSHOT_VERSION || hdr.chunk_size != SNAPSHOT_CHUNK_SIZE ||
+	    hdr.device_count < 1 || hdr.device_count > SNAPSHOT_MAX_DEVICES ||
+	    hdr.region_count > SNAPSHOT_MAX_REGIONS) {
+		fprintf(stderr, "Error: %s: not a valid snapshot file\n", filename);
+		goto depart;
+	}
+	if (read_all(infd, devs, sizeof(devs[0]) * hdr.device_count) < 0 ||
+	    read_all(infd, regions, sizeof(regions[0]) * hdr.region_count) < 0) {
+		fprintf(stderr, "Error: %s: truncated snapshot file\n", filename);
+		goto depart;
+	}
+	for (c = 0; c < hdr.region_count; c++) {
+		if (regions[c].device >= hdr.device_count || regions[c].rank >= RANK_COUNT) {
+			fprintf(stderr, "Error: %s: not a valid snapshot file\n", filename);
+			goto depart;
+		}
+	}
+
+	/*
+	 * The snapshot must be for the same devices, with
+	 * the same sizes, as are present now.
+	 */
+	device_count = open_devices(bootdev, gptdev, false, fds, curdevs);
+	if (device_count < 0)
+		goto depart;
+	if ((unsigned int) device_count != hdr.device_count) {
+		fprintf(stderr, "Error: snapshot has %u device(s), expected %d\n", hdr.device_count, device_count);
+		goto depart;
+	}
+	for (d = 0; d < device_count; d++) {
+		if (strncmp(devs[d].devname, curdevs[d].devname, sizeof(devs[d].devname)) != 0 ||
+		    devs[d].size != curdevs[d].size) {
+			fprintf(stderr, "Error: snapshot device %.*s (%llu bytes) does not match %s (%llu bytes)\n",
+				(int) sizeof(devs[d].devname), devs[d].devname, (unsigned long long) devs[d].size,
+				curdevs[d].devname, (unsigned long long) curdevs[d].size);
+			goto depart;
+		}
+		close(fds[d]);
+		fds[d] = -1;
+	}
+
+	/*
+	 * Decompress and verify everything up front
+	 */
+	buf = malloc(SNAPSHOT_CHUNK_SIZE);
+	cbuf = malloc(cbufsize);
+	if (buf == NULL || cbuf == NULL) {
+		perror("allocating buffers");
+		goto depart;
+	}
+	for (d = 0; d < device_count; d++) {
+		chunk_count[d] = (devs[d].size + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
+		image[d] = malloc(devs[d].size);
+		changed[d] = calloc(chunk_count[d], sizeof(bool));
+		if (image[d] == NULL || changed[d] == NULL) {
+			perror("allocating buffers");
+			goto depart;
+		}
+		for (c = 0, pos = 0; c < chunk_count[d]; c++, pos += len) {
+			len = (devs[d].size - pos < SNAPSHOT_CHUNK_SIZE ? devs[d].size - pos : SNAPSHOT_CHUNK_SIZE);
+			if (read_all(infd, &chunk, sizeof(chunk)) < 0 || chunk.length > cbufsize ||
+			    read_all(infd, cbuf, chunk.length) < 0) {
+				fprintf(stderr, "Error: %s: truncated snapshot file\n", filename);
+				goto depart;
+			}
+			clen = len;
+			if (uncompress(image[d] + pos, &clen, cbuf, chunk.length) != Z_OK || clen != len) {
+				fprintf(stderr, "Error: %s: corrupted snapshot data\n", filename);
+				goto depart;
+			}
+			chunk_checksum(image[d] + pos, len, &crc, &adler);
+			if (crc != chunk.crc || adler != chunk.adler) {
+				fprintf(stderr, "Error: %s: snapshot checksum mismatch\n", filename);
+				goto depart;
+			}
+		}
+	}
+
+	/*
+	 * Compare against what is on the devices now
+	 */
+	for (d = 0; d < device_count; d++) {
+		reset_writeable[d] = set_bootdev_writeable_status(devs[d].devname, true);
+		fds[d] = open(devs[d].devname, O_RDWR);
+		if (fds[d] < 0) {
+			perror(devs[d].devname);
+			goto depart;
+		}
+		for (c = 0, pos = 0; c < chunk_count[d]; c++, pos += len) {
+			len = (devs[d].size - pos < SNAPSHOT_CHUNK_SIZE ? devs[d].size - pos : SNAPSHOT_CHUNK_SIZE);
+			if (blkcache_pread(fds[d], buf, len, pos) != (ssize_t) len) {
+				perror(devs[d].devname);
+				goto depart;
+			}
+			chunk_checksum(buf, len, &crc, &adler);
+			chunk_checksum(image[d] + pos, len, &image_crc, &image_adler);
+			changed[d][c] = (crc != image_crc || adler != image_adler);
+			if (changed[d][c])
+				changed_count += 1;
+			total_count += 1;
+		}
+	}
+
+	/*
+	 * Write the changed chunks one rank at a time, splitting
+	 * chunks at region boundaries, and flushing after each
+	 * rank so the ordering holds on the media.
+	 */
+	for (rank = 0; rank < RANK_COUNT; rank++) {
+		phase_wrote = false;
+		for (d = 0; d < device_count; d++) {
+			for (c = 0; c < chunk_count[d]; c++) {
+				if (!changed[d][c])
+					continue;
+				end = (uint64_t) c * SNAPSHOT_CHUNK_SIZE + SNAPSHOT_CHUNK_SIZE;
+				if (end > devs[d].size)
+					end = devs[d].size;
+				for (pos = (uint64_t) c * SNAPSHOT_CHUNK_SIZE; pos < end; pos = next) {
+					if (rank_at(regions, hdr.region_count, d, pos, &next) != rank) {
+						if (next > end)
+							next = end;
+						continue;
+					}
+					if (next > end)
+						next = end;
+					if (blkcache_pwrite(fds[d], image[d] + pos, next - pos, pos) < 0) {
+						perror(devs[d].devname);
+						goto depart;
+					}
+					written += next - pos;
+					phase_wrote = true;
+				}
+			}
+		}
+		if (phase_wrote) {
+			for (d = 0; d < device_count; d++) {
+				if (fsync(fds[d]) < 0) {
+					perror(devs[d].devname);
+					goto depart;
+				}
+			}
+		}
+	}
+	printf("Restored %u of %u chunks (%llu bytes written) from %s\n",
+	       changed_count, total_count, (unsigned long long) written, filename);
+	ret = 0;
+
+  depart:
+	if (infd >= 0)
+		close(infd);
+	for (d = 0; d < SNAPSHOT_MAX_DEVICES; d++) {
+		if (fds[d] >= 0)
+			close(fds[d]);
+		if (reset_writeable[d])
+			set_bootdev_writeable_status(devs[d].devname, false);
+		free(image[d]);
+		free(changed[d]);
+	}
+	free(cbuf);
+	free(buf);
+	return ret;
+
+} /* snapshot_restore */
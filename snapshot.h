@@ -0,0 +1,10 @@
+#ifndef snapshot_h_included
+#define snapshot_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include "gpt.h"
+
+int snapshot_create(const char *filename, const char *bootdev, const char *gptdev, gpt_context_t *gptctx);
+int snapshot_restore(const char *filename, const char *bootdev, const char *gptdev);
+
+#endif /* snapshot_h_included */
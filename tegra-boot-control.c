@@ -19,6 +19,9 @@
 #include "gpt.h"
 #include "smd.h"
 #include "util.h"
+#include "snapshot.h"
+#include "scrub.h"
+#include "iopressure.h"
 #include "config.h"
 
 static struct option options[] = {
@@ -30,11 +33,15 @@ static struct option options[] = {
 	{ "status",		no_argument,		0, 's' },
 	{ "load",		required_argument,	0, 'L' },
 	{ "dump",		required_argument,	0, 'D' },
+	{ "snapshot",		required_argument,	0, 'S' },
+	{ "restore",		required_argument,	0, 'R' },
+	{ "scrub",		no_argument,		0, 'r' },
+	{ "pressure-cgroup",	required_argument,	0, 'P' },
 	{ "help",		no_argument,		0, 'h' },
 	{ "version",		no_argument,		0, 0   },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":cdema:sL:D:h";
+static const char *shortopts = ":cdema:sL:D:S:R:rh";
 
 static char *optarghelp[] = {
 	"--current-slot       ",
@@ -45,6 +52,10 @@ static char *optarghelp[] = {
 	"--status             ",
 	"--load               ",
 	"--dump               ",
+	"--snapshot           ",
+	"--restore            ",
+	"--scrub              ",
+	"--pressure-cgroup    ",
 	"--help               ",
 	"--version            ",
 };
@@ -58,6 +69,10 @@ static char *opthelp[] = {
 	"display redundancy and boot slot status",
 	"load slot metadata from file",
 	"dump slot metadata to file",
+	"save boot device contents to snapshot file",
+	"restore boot device contents from snapshot file",
+	"check the next portion of the redundant boot partitions",
+	"with --scrub, also slow down for I/O stalls in this service or cgroup",
 	"display this help text",
 	"display version information"
 };
@@ -71,12 +86,17 @@ typedef enum {
 	ACTION_STATUS,
 	ACTION_LOAD,
 	ACTION_DUMP,
+	ACTION_SNAPSHOT,
+	ACTION_RESTORE,
+	ACTION_SCRUB,
 	ACTION_INVALID = 255,
 } bootctrl_action_t;
 
 static const char bootdev[] = OTABOOTDEV;
 static const char gptdev[] = OTAGPTDEV;
 static char slot_metadata_bin_file[PATH_MAX];
+static char snapshot_file[PATH_MAX];
+static const char *pressure_cgroup;
 
 static void
 print_usage (void)
@@ -219,6 +239,33 @@ main (int argc, char * const argv[])
 				strncpy(slot_metadata_bin_file, optarg, sizeof(slot_metadata_bin_file)-1);
 				readonly = true;
 				break;
+			case 'S':
+				if (action != ACTION_INVALID)
+					option_error = true;
+				else
+					action = ACTION_SNAPSHOT;
+				strncpy(snapshot_file, optarg, sizeof(snapshot_file)-1);
+				break;
+			case 'R':
+				if (action != ACTION_INVALID)
+					option_error = true;
+				else
+					action = ACTION_RESTORE;
+				strncpy(snapshot_file, optarg, sizeof(snapshot_file)-1);
+				if (access(snapshot_file, R_OK) != 0) {
+					fprintf(stderr, "Error: cannot access snapshot file %s\n", snapshot_file);
+					return 1;
+				}
+				break;
+			case 'r':
+				if (action != ACTION_INVALID)
+					option_error = true;
+				else
+					action = ACTION_SCRUB;
+				break;
+			case 'P':
+				pressure_cgroup = optarg;
+				break;
 			case 0:
 				if (strcmp(options[which].name, "version") == 0) {
 					printf("%s\n", VERSION);
@@ -265,7 +312,15 @@ main (int argc, char * const argv[])
 		return 0;
 	}
 
-	gptctx = gpt_init(gptdev, 512, 0);
+	/*
+	 * Restoring does not depend on the current
+	 * partition table, which may be the thing
+	 * being repaired.
+	 */
+	if (action == ACTION_RESTORE)
+		return (snapshot_restore(snapshot_file, bootdev, gptdev) == 0 ? 0 : 1);
+
+	gptctx = gpt_init(gptdev, 0, 0);
 	if (gptctx == NULL) {
 		perror("boot sector GPT");
 		return 1;
@@ -276,6 +331,20 @@ main (int argc, char * const argv[])
 		return 1;
 	}
 
+	if (action == ACTION_SNAPSHOT) {
+		result = (snapshot_create(snapshot_file, bootdev, gptdev, gptctx) == 0 ? 0 : 1);
+		gpt_finish(gptctx);
+		return result;
+	}
+
+	if (action == ACTION_SCRUB) {
+		iopressure_init(pressure_cgroup);
+		result = (scrub_run(bootdev, gptdev, gptctx) == 0 ? 0 : 1);
+		iopressure_finish();
+		gpt_finish(gptctx);
+		return result;
+	}
+
 	if (readonly) {
 		reset_bootdev = false;
 		fd = open(bootdev, O_RDONLY);
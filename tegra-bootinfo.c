@@ -120,7 +120,7 @@ mark_nv_boot_successful (void)
 		perror("smd_get_current_slot");
 		return ret;
 	}
-	gptctx = gpt_init(gptdev, 512, 0);
+	gptctx = gpt_init(gptdev, 0, 0);
 	if (gptctx == NULL) {
 		perror("gpt_init");
 		return ret;
@@ -17,6 +17,12 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
 #include <tegra-eeprom/cvm.h>
 #include <zlib.h>
 #include "bup.h"
@@ -25,6 +31,9 @@
 #include "smd.h"
 #include "ver.h"
 #include "util.h"
+#include "blkcache.h"
+#include "verify.h"
+#include "iopressure.h"
 #include "config.h"
 
 static struct option options[] = {
@@ -32,17 +41,23 @@ static struct option options[] = {
 	{ "slot-suffix",	required_argument,	0, 's' },
 	{ "dry-run",		no_argument,		0, 'n' },
 	{ "needs-repartition",	no_argument,		0, 'N' },
+	{ "verify",		required_argument,	0, 'V' },
+	{ "release-on-pause",	no_argument,		0, 'P' },
+	{ "pressure-cgroup",	required_argument,	0, 'G' },
 	{ "help",		no_argument,		0, 'h' },
 	{ "version",		no_argument,		0, 0   },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":ins:h";
+static const char *shortopts = ":ins:V:h";
 
 static char *optarghelp[] = {
 	"--initialize         ",
 	"--slot-suffix        ",
 	"--dry-run            ",
 	"--needs-repartition  ",
+	"--verify             ",
+	"--release-on-pause   ",
+	"--pressure-cgroup    ",
 	"--help               ",
 	"--version            ",
 };
@@ -52,6 +67,9 @@ static char *opthelp[] = {
 	"update only the redundant boot partitions with the specified suffix (with no SMD update)",
 	"do not perform any writes, just show what would be written",
 	"check if boot device needs repartitioning (T186/T194 only)",
+	"read back written data: off, sample (default), or full",
+	"release cached and locked memory while paused by SIGUSR1",
+	"also slow down for I/O stalls in this service or cgroup",
 	"display this help text",
 	"display version information"
 };
@@ -60,8 +78,17 @@ struct update_entry_s {
 	char partname[64];
 	gpt_entry_t *part;
 	char devname[PATH_MAX];
+	bup_context_t *bupctx;
 	off_t bup_offset;
 	size_t length;
+	/*
+	 * For the BCT and mb1 entries on t186/t194, the content
+	 * (zero-padded to the partition size) and the current
+	 * partition contents are loaded ahead of time.
+	 */
+	uint8_t *staged_content;
+	uint8_t *staged_current;
+	bool staged_match;
 };
 
 struct update_list_s {
@@ -69,18 +96,69 @@ struct update_list_s {
 	const char **partnames;
 };
 
+/*
+ * Tracks which payload supplied each partition, for
+ * detecting conflicts when merging multiple payloads.
+ */
+struct payload_part_s {
+	const char *partname;
+	const char *spec;
+	const char *pathname;
+	bup_context_t *bupctx;
+	off_t bup_offset;
+	size_t length;
+};
+
+#define MAX_PAYLOADS 8
+/*
+ * Granularity for skipping zero-filled regions of content
+ * that is being written over a freshly erased range. Raised
+ * to the physical block size of the boot devices if that is
+ * larger, so the writes stay physically aligned.
+ */
+#define ZERO_SKIP_CHUNK 4096
+/*
+ * Memory allowed for caching small, repeatedly-read
+ * regions of the boot devices (GPT, SMD, VER, BCT).
+ */
+#define BLOCK_CACHE_LIMIT (4 * 1024 * 1024)
+/*
+ * Maximum amount of content written between safe points,
+ * where the update can be paused.
+ */
+#define SAFE_POINT_INTERVAL (1024 * 1024)
 #define MAX_ENTRIES 64
 static struct update_entry_s redundant_entries[MAX_ENTRIES];
 static struct update_entry_s nonredundant_entries[MAX_ENTRIES];
 static unsigned int redundant_entry_count;
 static unsigned int nonredundant_entry_count;
+static struct payload_part_s payload_parts[MAX_ENTRIES*2];
+static unsigned int payload_part_count;
+static int pending_flush_fds[MAX_ENTRIES*2];
+static unsigned int pending_flush_count;
+static bool defer_flush;
 static size_t contentbuf_size;
 static size_t slotbuf_size;
 static uint8_t *contentbuf, *slotbuf, *zerobuf;
 static int bct_updated;
+static size_t zero_bytes_skipped;
+static void *critical_buffers;
+static size_t critical_buffers_size;
+static bool critical_buffers_locked;
 static tegra_soctype_t soctype = TEGRA_SOCTYPE_INVALID;
 static bool spiboot_platform;
 static unsigned long bootdev_size;
+static unsigned int lba_size = 512;
+static unsigned int physical_block_size = 512;
+static size_t zero_skip_chunk = ZERO_SKIP_CHUNK;
+static bool verify_whole_entry;
+static volatile sig_atomic_t pause_requested;
+static bool pause_deferred;
+static bool release_on_pause;
+static bool critical_window_open;
+static bool writing_critical_entry;
+static unsigned int pause_count;
+static unsigned long paused_usec;
 
 /*
  * For tegra210 platforms, these are the names of partitions
@@ -127,7 +205,7 @@ print_usage (void)
 {
 	int i;
 	printf("\nUsage:\n");
-	printf("\ttegra-bootloader-update <option> <bup-package-path>\n\n");
+	printf("\ttegra-bootloader-update <option> <bup-package-path> [<bup-package-path>...]\n\n");
 	printf("Options:\n");
 	for (i = 0; i < sizeof(options)/sizeof(options[0]) && options[i].name != 0; i++) {
 		printf(" %s\t%c%c\t%s\n",
@@ -138,15 +216,16 @@ print_usage (void)
 	}
 	printf("\nArguments:\n");
 	printf(" <bup-package-path>\tpathname of bootloader update package\n");
+	printf("\t\t\t(multiple packages are merged and applied together)\n");
 
 } /* print_usage */
 
 /*
  * read_completely_at
  *
- * Utility function for seeking to a specific offset
- * and reading a fixed number of bytes into a buffer,
- * handling short reads.
+ * Utility function for reading a fixed number of bytes
+ * at a specific offset into a buffer, through the block
+ * cache, handling short reads.
  *
  * fd: file descriptor
  * buf: pointer to read buffer
@@ -160,62 +239,175 @@ print_usage (void)
 static ssize_t
 read_completely_at (int fd, void *buf, size_t bufsiz, off_t offset)
 {
-	ssize_t n, total;
-	size_t remain;
+	ssize_t n;
 
-	if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
+	n = blkcache_pread(fd, buf, bufsiz, offset);
+	if (n >= 0 && (size_t) n < bufsiz) {
+		errno = EIO;
 		return -1;
-	for (remain = bufsiz, total = 0; remain > 0; total += n, remain -= n) {
-		n = read(fd, (uint8_t *) buf + total, remain);
-		if (n <= 0)
-			return -1;
 	}
-	return total;
+	return n;
 
 } /* read_completely_at */
 
 /*
- * write_completely_at
+ * erase_range
  *
- * Utility function for seeking to a specific offset
- * and writing a fixed number of bytes to a file or device,
- * handling short writes.
+ * Utility function for zeroing out a range of a file
+ * or device. Block devices are asked to zero the range
+ * themselves (BLKZEROOUT), which avoids transferring the
+ * zeros; if that is not possible, zeros are written.
  *
  * fd: file descriptor
- * buf: pointer to data to be written
- * bufsiz: number of bytes to write
  * offset: offset from start of file/device
+ * erase_size: number of bytes to erase
  *
- * Returns: number of bytes written, or
- *          -1 on error (errno set)
+ * Returns: 0 on success, -1 on error (errno set)
  *
  */
-static ssize_t
-write_completely_at (int fd, void *buf, size_t bufsiz, off_t offset, size_t erase_size)
+static int
+erase_range (int fd, off_t offset, size_t erase_size)
 {
-	ssize_t n, total;
-	size_t remain;
-
-	if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
-		return -1;
-	if (erase_size != 0) {
-		for (remain = erase_size, total = 0; remain > 0; total += n, remain -= n) {
-			n = write(fd, (uint8_t *) zerobuf + total, remain);
-			if (n <= 0)
-				return -1;
+	struct stat st;
+	uint64_t range[2];
+	unsigned int logical;
+
+	get_block_sizes(fd, &logical, NULL);
+	if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+	    offset % logical == 0 && erase_size % logical == 0) {
+		range[0] = offset;
+		range[1] = erase_size;
+		if (ioctl(fd, BLKZEROOUT, range) == 0) {
+			blkcache_invalidate(fd, offset, erase_size);
+			return 0;
 		}
-		fsync(fd);
-		if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
-			return -1;
 	}
-	for (remain = bufsiz, total = 0; remain > 0; total += n, remain -= n) {
-		n = write(fd, (uint8_t *) buf + total, remain);
-		if (n <= 0)
-			return -1;
-	}
-	return total;
+	if (blkcache_pwrite(fd, zerobuf, erase_size, offset) < 0)
+		return -1;
+	return 0;
 
-} /* write_completely_at */
+} /* erase_range */
+
+/*
+ * print_ok
+ *
+ * Prints the success indicator for an entry, noting
+ * how much zero-filled content did not need writing.
+ *
+ * Returns: nothing
+ *
+ */
+static void
+print_ok (void)
+{
+	if (zero_bytes_skipped != 0)
+		printf("[OK] (%zu zero bytes skipped)\n", zero_bytes_skipped);
+	else
+		printf("[OK]\n");
+
+} /* print_ok */
+
+/*
+ * print_cache_stats
+ *
+ * Reports how effective the block cache was
+ * during the run.
+ *
+ * Returns: nothing
+ *
+ */
+static void
+print_cache_stats (void)
+{
+	blkcache_stats_t stats;
+	unsigned long lookups;
+
+	blkcache_get_stats(&stats);
+	lookups = stats.hits + stats.misses;
+	if (lookups == 0)
+		return;
+	printf("Block cache: %lu hits, %lu misses (%lu%% hit rate), %lu bypassed, %lu invalidated",
+	       stats.hits, stats.misses, (stats.hits * 100) / lookups, stats.bypassed, stats.invalidated);
+	if (stats.checksum_errors != 0)
+		printf(", %lu checksum errors", stats.checksum_errors);
+	printf("\n");
+
+} /* print_cache_stats */
+
+/*
+ * print_verify_stats
+ *
+ * Reports how much read-back verification was
+ * done, and what it cost.
+ *
+ * Returns: nothing
+ *
+ */
+static void
+print_verify_stats (void)
+{
+	verify_stats_t stats;
+
+	verify_get_stats(&stats);
+	if (stats.regions == 0)
+		return;
+	printf("Read-back verification: %lu of %lu chunks checked, %zu KiB read, %lu.%03lu ms",
+	       stats.chunks_checked, stats.chunks_written, stats.bytes_read / 1024,
+	       stats.usec / 1000UL, stats.usec % 1000UL);
+	if (stats.buffered_regions != 0)
+		printf(" (%lu region%s without direct I/O)", stats.buffered_regions,
+		       (stats.buffered_regions == 1 ? "" : "s"));
+	if (stats.mismatches != 0)
+		printf(", %lu mismatch%s", stats.mismatches, (stats.mismatches == 1 ? "" : "es"));
+	printf("\n");
+
+} /* print_verify_stats */
+
+/*
+ * print_pause_stats
+ *
+ * Reports how long the update was paused, if
+ * it was paused at all.
+ *
+ * Returns: nothing
+ *
+ */
+static void
+print_pause_stats (void)
+{
+	if (pause_count == 0)
+		return;
+	printf("Paused %u time%s, %lu.%03lu s total\n", pause_count, (pause_count == 1 ? "" : "s"),
+	       paused_usec / 1000000UL, (paused_usec / 1000UL) % 1000UL);
+
+} /* print_pause_stats */
+
+/*
+ * print_pressure_stats
+ *
+ * Reports what the I/O pressure control loop did,
+ * if it had to slow anything down.
+ *
+ * Returns: nothing
+ *
+ */
+static void
+print_pressure_stats (void)
+{
+	iopressure_stats_t stats;
+
+	iopressure_get_stats(&stats);
+	if (stats.backoffs == 0)
+		return;
+	printf("I/O pressure: peak %u.%u%% stalled, slowed down %lu time%s (to %zu KiB/s at lowest), "
+	       "sped up %lu time%s, released %lu time%s, %lu.%03lu s throttled\n",
+	       stats.peak_permille / 10, stats.peak_permille % 10,
+	       stats.backoffs, (stats.backoffs == 1 ? "" : "s"), stats.min_rate / 1024,
+	       stats.increases, (stats.increases == 1 ? "" : "s"),
+	       stats.releases, (stats.releases == 1 ? "" : "s"),
+	       stats.throttle_usec / 1000000UL, (stats.throttle_usec / 1000UL) % 1000UL);
+
+} /* print_pressure_stats */
 
 /*
  * redundant_part_format
@@ -241,6 +433,363 @@ static const char *redundant_part_format(const char *partname)
 
 } /* redundant_part_format */
 
+/*
+ * is_critical_part
+ *
+ * Identifies the partitions whose write ordering matters
+ * for bootability (the BCT and the mb1 copies). Writes to
+ * these are always flushed immediately.
+ *
+ * partname: name of partition
+ *
+ * Returns: true if critical, false otherwise
+ *
+ */
+static bool
+is_critical_part (const char *partname)
+{
+	return (strcmp(partname, "BCT") == 0 ||
+		strcmp(partname, "mb1") == 0 ||
+		strcmp(partname, "mb1_b") == 0);
+
+} /* is_critical_part */
+
+/*
+ * flush_or_defer
+ *
+ * Called after a partition has been written. Flushes the
+ * device immediately if deferred flushing is not enabled
+ * or the partition is critical; otherwise, adds the file
+ * descriptor to the list to be flushed later by
+ * flush_pending_writes().
+ *
+ * fd: file descriptor that was written
+ * owned: true if fd should be closed once flushed
+ * ent: pointer to the entry that was written
+ *
+ * Returns: nothing
+ *
+ */
+static void
+flush_or_defer (int fd, bool owned, struct update_entry_s *ent)
+{
+	unsigned int i;
+
+	if (!defer_flush || is_critical_part(ent->partname) ||
+	    pending_flush_count >= sizeof(pending_flush_fds)/sizeof(pending_flush_fds[0])) {
+		fsync(fd);
+		if (owned)
+			close(fd);
+		return;
+	}
+	/*
+	 * The boot and GPT devices are shared by many entries,
+	 * so only record them once.
+	 */
+	if (!owned)
+		for (i = 0; i < pending_flush_count; i++)
+			if (pending_flush_fds[i] == fd)
+				return;
+	pending_flush_fds[pending_flush_count++] = (owned ? fd : -(fd + 1));
+
+} /* flush_or_defer */
+
+/*
+ * flush_pending_writes
+ *
+ * Flushes all devices with deferred writes, closing
+ * the ones that were opened just for writing an entry.
+ *
+ * Returns: 0 on success, -1 if any flush failed (errno set)
+ *
+ */
+static int
+flush_pending_writes (void)
+{
+	unsigned int i;
+	int fd, ret = 0, save_errno = 0;
+
+	for (i = 0; i < pending_flush_count; i++) {
+		fd = pending_flush_fds[i];
+		if (fd < 0)
+			fd = -(fd + 1);
+		if (fsync(fd) < 0 && ret == 0) {
+			save_errno = errno;
+			ret = -1;
+		}
+		if (pending_flush_fds[i] >= 0)
+			close(fd);
+	}
+	pending_flush_count = 0;
+	if (ret < 0)
+		errno = save_errno;
+	return ret;
+
+} /* flush_pending_writes */
+
+/*
+ * pause_signal_handler
+ *
+ * SIGUSR1 requests a pause at the next safe point;
+ * SIGUSR2 cancels the request, or resumes a paused
+ * update.
+ *
+ * Returns: nothing
+ *
+ */
+static void
+pause_signal_handler (int sig)
+{
+	pause_requested = (sig == SIGUSR1);
+
+} /* pause_signal_handler */
+
+/*
+ * safe_point
+ *
+ * Called between chunk writes. If a pause has been requested,
+ * flushes everything written so far and waits for SIGUSR2,
+ * so the boot device is left idle for other users. Pausing is
+ * refused while the BCT or mb1 is being updated; the request
+ * is held until the first safe point after that.
+ *
+ * fd: file descriptor currently being written, or -1
+ *
+ * Returns: 0 on success, -1 if flushing failed (errno set)
+ *
+ */
+static int
+safe_point (int fd)
+{
+	sigset_t pausemask, oldmask;
+	struct timespec start, end;
+
+	if (!pause_requested)
+		return 0;
+	if (critical_window_open || writing_critical_entry) {
+		if (!pause_deferred)
+			fprintf(stderr, "\nPause refused during BCT/mb1 update, deferring\n");
+		pause_deferred = true;
+		return 0;
+	}
+	pause_deferred = false;
+	if ((fd >= 0 && fsync(fd) < 0) || flush_pending_writes() < 0)
+		return -1;
+	if (release_on_pause) {
+		blkcache_set_limit(0);
+		if (critical_buffers_locked)
+			munlock(critical_buffers, critical_buffers_size);
+	}
+	fprintf(stderr, "\nUpdate paused, send SIGUSR2 to resume\n");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sigemptyset(&pausemask);
+	sigaddset(&pausemask, SIGUSR1);
+	sigaddset(&pausemask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &pausemask, &oldmask);
+	while (pause_requested)
+		sigsuspend(&oldmask);
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	paused_usec += (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000L;
+	pause_count += 1;
+	if (release_on_pause) {
+		if (critical_buffers_locked && mlock(critical_buffers, critical_buffers_size) < 0) {
+			fprintf(stderr, "Warning: could not re-lock BCT/mb1 buffers in memory: %s\n", strerror(errno));
+			critical_buffers_locked = false;
+		}
+		blkcache_set_limit(BLOCK_CACHE_LIMIT);
+	}
+	fprintf(stderr, "Update resumed\n");
+	return 0;
+
+} /* safe_point */
+
+/*
+ * write_completely_at
+ *
+ * Utility function for seeking to a specific offset
+ * and writing a fixed number of bytes to a file or device,
+ * handling short writes.
+ *
+ * If erase_size is non-zero, the range is erased first,
+ * and any zero_skip_chunk-sized pieces of the content that
+ * are all zeros are not written, since the erase has already
+ * put zeros there. The number of bytes skipped is added
+ * to zero_bytes_skipped.
+ *
+ * The digests for read-back verification are recorded
+ * from the content as it is written.
+ *
+ * fd: file descriptor
+ * buf: pointer to data to be written
+ * bufsiz: number of bytes to write
+ * offset: offset from start of file/device
+ * erase_size: number of bytes to erase before writing (0 for none)
+ *
+ * Returns: number of bytes written, or
+ *          -1 on error (errno set)
+ *
+ */
+static ssize_t
+write_completely_at (int fd, void *buf, size_t bufsiz, off_t offset, size_t erase_size)
+{
+	size_t pos, runstart, chunk, runmax;
+	bool skip_zeros = erase_size >= bufsiz;
+	bool throttle = !(critical_window_open || writing_critical_entry);
+	bool zero;
+
+	if (erase_size != 0) {
+		if (erase_range(fd, offset, erase_size) < 0)
+			return -1;
+		fsync(fd);
+	}
+	/*
+	 * Coalesce consecutive non-zero chunks into a single write,
+	 * flushing the pending run whenever a zero chunk (or the end
+	 * of the content) is reached. Long runs are split so there
+	 * is a safe point at least every SAFE_POINT_INTERVAL bytes.
+	 * Outside the BCT/mb1 window, runs are made shorter and
+	 * paced while the system is under I/O pressure.
+	 */
+	runmax = (throttle ? iopressure_chunk_limit(SAFE_POINT_INTERVAL) : SAFE_POINT_INTERVAL);
+	for (pos = runstart = 0; pos <= bufsiz; pos += chunk) {
+		chunk = (bufsiz - pos < zero_skip_chunk ? bufsiz - pos : zero_skip_chunk);
+		zero = pos < bufsiz && skip_zeros && block_is_zero((uint8_t *) buf + pos, chunk);
+		if (pos < bufsiz && !zero && pos - runstart < runmax)
+			continue;
+		if (pos > runstart) {
+			if (blkcache_pwrite(fd, (uint8_t *) buf + runstart, pos - runstart, offset + runstart) < 0)
+				return -1;
+			if (throttle) {
+				iopressure_account(pos - runstart);
+				runmax = iopressure_chunk_limit(SAFE_POINT_INTERVAL);
+			}
+			if (safe_point(fd) < 0)
+				return -1;
+		}
+		if (pos >= bufsiz)
+			break;
+		if (zero) {
+			zero_bytes_skipped += chunk;
+			runstart = pos + chunk;
+		} else
+			runstart = pos;
+	}
+	if (verify_record(fd, buf, bufsiz, offset, verify_whole_entry) < 0)
+		return -1;
+	return bufsiz;
+
+} /* write_completely_at */
+
+/*
+ * payload_contents_match
+ *
+ * Compares the contents of two payload entries supplying
+ * the same partition from different payloads.
+ *
+ * a, b: payload partition records to compare
+ *
+ * Returns: true if the contents are identical, false otherwise
+ *
+ */
+static bool
+payload_contents_match (struct payload_part_s *a, struct payload_part_s *b)
+{
+	static uint8_t abuf[65536], bbuf[65536];
+	size_t remain, chunk;
+	ssize_t n, total;
+
+	if (a->length != b->length)
+		return false;
+	if (bup_setpos(a->bupctx, a->bup_offset) == (off_t) -1 ||
+	    bup_setpos(b->bupctx, b->bup_offset) == (off_t) -1)
+		return false;
+	for (remain = a->length; remain > 0; remain -= chunk) {
+		chunk = (remain > sizeof(abuf) ? sizeof(abuf) : remain);
+		for (total = 0; total < chunk; total += n) {
+			n = bup_read(a->bupctx, abuf + total, chunk - total);
+			if (n <= 0)
+				return false;
+		}
+		for (total = 0; total < chunk; total += n) {
+			n = bup_read(b->bupctx, bbuf + total, chunk - total);
+			if (n <= 0)
+				return false;
+		}
+		if (memcmp(abuf, bbuf, chunk) != 0)
+			return false;
+	}
+	return true;
+
+} /* payload_contents_match */
+
+/*
+ * merge_payload_entry
+ *
+ * Checks an entry from one of the update payloads against
+ * the partitions already supplied by other payloads. A
+ * partition may be supplied by more than one payload only
+ * if the contents are identical, whatever the entries' spec
+ * strings are: two payloads with different entries for the
+ * same partition that both match this device is a conflict.
+ * Partitions can have several entries in one payload (e.g.,
+ * BCT), so the entry is a duplicate if it matches any of the
+ * other payloads' entries for the partition, and a conflict
+ * if it matches none of them.
+ *
+ * bupctx: context pointer for the payload holding the entry
+ * pathname: pathname of the payload (for messages)
+ * partname: name of the partition
+ * spec: spec string of the entry
+ * offset: offset of the entry's content in the payload
+ * length: length of the entry's content
+ *
+ * Returns: 0 if the entry should be added to the update
+ *          1 if the entry duplicates one from another payload
+ *         -1 on conflict or other error
+ *
+ */
+static int
+merge_payload_entry (bup_context_t *bupctx, const char *pathname, const char *partname,
+		     const char *spec, off_t offset, size_t length)
+{
+	struct payload_part_s newpart = {
+		.partname = partname,
+		.spec = spec,
+		.pathname = pathname,
+		.bupctx = bupctx,
+		.bup_offset = offset,
+		.length = length,
+	};
+	struct payload_part_s *other = NULL;
+	unsigned int i;
+
+	for (i = 0; i < payload_part_count; i++) {
+		struct payload_part_s *pp = &payload_parts[i];
+		/*
+		 * Multiple entries for the same partition in one
+		 * payload are handled by the caller.
+		 */
+		if (pp->bupctx == bupctx || strcmp(pp->partname, partname) != 0)
+			continue;
+		if (payload_contents_match(pp, &newpart))
+			return 1;
+		other = pp;
+	}
+	if (other != NULL) {
+		fprintf(stderr, "Error: conflicting entries for partition %s in %s (spec '%s') and %s (spec '%s')\n",
+			partname, other->pathname, other->spec, pathname, spec);
+		return -1;
+	}
+	if (payload_part_count >= sizeof(payload_parts)/sizeof(payload_parts[0])) {
+		fprintf(stderr, "Error: too many partitions in update payloads\n");
+		return -1;
+	}
+	payload_parts[payload_part_count++] = newpart;
+	return 0;
+
+} /* merge_payload_entry */
+
 /*
  * update_bct
  *
@@ -292,6 +841,12 @@ update_bct (int bootfd, void *curbct, void *newbct, struct update_entry_s *ent)
 	}
 
 	bctslotsize = page_size * ((ent->length + (page_size-1)) / page_size);
+	if (ent->staged_content != NULL &&
+	    bctslotsize > (ent->part->last_lba - ent->part->first_lba + 1) * lba_size) {
+		printf("[FAIL]\n");
+		fprintf(stderr, "Error: BCT slot size exceeds BCT partition size\n");
+		return -1;
+	}
 
 	for (i = 0; i < 3; i++) {
 		off_t offset = 0;
@@ -310,18 +865,30 @@ update_bct (int bootfd, void *curbct, void *newbct, struct update_entry_s *ent)
 			printf("[offset=%lu,no update needed]...", (unsigned long) offset);
 		else {
 			printf("[offset=%lu]...", (unsigned long) offset);
-			if (write_completely_at(bootfd, newbct, ent->length, ent->part->first_lba * 512 + offset, bctslotsize) < 0) {
+			/*
+			 * Staged content is already padded out to the slot
+			 * size, so it can be written without a separate erase.
+			 */
+			if ((ent->staged_content != NULL
+			     ? write_completely_at(bootfd, newbct, bctslotsize, ent->part->first_lba * lba_size + offset, 0)
+			     : write_completely_at(bootfd, newbct, ent->length, ent->part->first_lba * lba_size + offset, bctslotsize)) < 0) {
 				printf("[FAIL]\n");
 				perror("BCT");
 				return -1;
 			}
+			/*
+			 * Keep the staged copy of the partition current for
+			 * any later BCT entries that compare against it.
+			 */
+			if (ent->staged_content != NULL && curbct != NULL)
+				memcpy((uint8_t *) curbct + offset, newbct, bctslotsize);
 		}
 
 	}
 
 	fsync(bootfd);
 	bct_updated = 1;
-	printf("[OK]\n");
+	print_ok();
 	return 0;
 
 } /* update_bct */
@@ -398,7 +965,7 @@ update_bct_t210 (int bootfd, void *curbct, void *newbct, struct update_entry_s *
 			bctcopies, (bctcopies == 1 ? "" : "s"));
 		return -1;
 	}
-	bctpartsize = (ent->part->last_lba - ent->part->first_lba + 1) * 512;
+	bctpartsize = (ent->part->last_lba - ent->part->first_lba + 1) * lba_size;
 	bctcount =  bctpartsize / block_size;
 	if (bctcount > 64)
 		bctcount = 64;
@@ -432,7 +999,7 @@ update_bct_t210 (int bootfd, void *curbct, void *newbct, struct update_entry_s *
 
 		printf("%s%s: ", prefix, bctname);
 		fflush(stdout);
-		if (write_completely_at(bootfd, contentbuf, ent->length, ent->part->first_lba * 512 + offset, ent->length) < 0) {
+		if (write_completely_at(bootfd, contentbuf, ent->length, ent->part->first_lba * lba_size + offset, ent->length) < 0) {
 
 			printf("[FAIL]\n");
 			perror("BCT");
@@ -440,7 +1007,7 @@ update_bct_t210 (int bootfd, void *curbct, void *newbct, struct update_entry_s *
 		}
 		if (bctidx == 0 && bctcopies == 2) {
 			offset += ent->length;
-			if (write_completely_at(bootfd, contentbuf, ent->length, ent->part->first_lba * 512 + offset, ent->length) < 0) {
+			if (write_completely_at(bootfd, contentbuf, ent->length, ent->part->first_lba * lba_size + offset, ent->length) < 0) {
 				printf("[FAIL]\n");
 				perror("BCT");
 				return -1;
@@ -455,10 +1022,10 @@ update_bct_t210 (int bootfd, void *curbct, void *newbct, struct update_entry_s *
 } /* update_bct_t210 */
 
 /*
- * maybe_update_bootpart
+ * locate_bootpart
  *
- * Update a boot partition if its current contents
- * differ from the BUP content (which is in contentbuf).
+ * Works out which device holds a boot partition, and
+ * the offset of the partition within that device.
  *
  * On systems that boot from eMMC, boot partitions may be
  * located either in /dev/mmcblk0boot0 (called the "boot device")
@@ -467,6 +1034,40 @@ update_bct_t210 (int bootfd, void *curbct, void *newbct, struct update_entry_s *
  * bootfd: file descriptor for boot device
  * gptfd:  file descriptor for second boot (aka "GPT") device
  * ent:    pointer to entry from update payload
+ * fdp:    pointer to int to hold the file descriptor
+ * offsetp: pointer to off_t to hold the offset
+ *
+ * Returns: 0 on success, -1 on error (errno not set)
+ *
+ */
+static int
+locate_bootpart (int bootfd, int gptfd, struct update_entry_s *ent, int *fdp, off_t *offsetp)
+{
+	*fdp = bootfd;
+	*offsetp = ent->part->first_lba * lba_size;
+	if (*offsetp >= bootdev_size) {
+		if (gptfd < 0) {
+			printf("[FAIL]\n");
+			fprintf(stderr, "Partition %s starts past end of boot device\n", ent->partname);
+			return -1;
+		}
+		*fdp = gptfd;
+		*offsetp -= bootdev_size;
+	}
+	return 0;
+
+} /* locate_bootpart */
+
+/*
+ * maybe_update_bootpart
+ *
+ * Update a boot partition if its current contents
+ * differ from the BUP content (which is in contentbuf,
+ * or in the entry's staged buffers if it was pre-loaded).
+ *
+ * bootfd: file descriptor for boot device
+ * gptfd:  file descriptor for second boot (aka "GPT") device
+ * ent:    pointer to entry from update payload
  * is_bct: 1 if this is a BCT update, 0 otherwise
  * initialize: non-zero if initializing, 0 otherwise
  * bctctx: 'which' context for BCT updates (for t210 platforms)
@@ -479,58 +1080,188 @@ maybe_update_bootpart (int bootfd, int gptfd, struct update_entry_s *ent,
 		       int is_bct, int initialize, int *bctctx)
 {
 	int fd;
-	size_t partsize = (ent->part->last_lba - ent->part->first_lba + 1) * 512;
+	size_t partsize = (ent->part->last_lba - ent->part->first_lba + 1) * lba_size;
 	off_t offset;
+	uint8_t *content, *current;
 
 	if (ent->length > partsize) {
 		printf("[FAIL]\n");
 		fprintf(stderr, "Error: BUP contents too large for boot partition\n");
 		return -1;
 	}
-	fd = bootfd;
-	offset = ent->part->first_lba * 512;
-	if (offset >= bootdev_size) {
-		if (gptfd < 0) {
+	if (locate_bootpart(bootfd, gptfd, ent, &fd, &offset) < 0)
+		return -1;
+	if (ent->staged_content != NULL) {
+		content = ent->staged_content;
+		current = ent->staged_current;
+	} else {
+		if (read_completely_at(fd, slotbuf, partsize, offset) < 0) {
 			printf("[FAIL]\n");
-			fprintf(stderr, "Partition %s starts past end of boot device\n", ent->partname);
+			perror(ent->partname);
 			return -1;
 		}
-		fd = gptfd;
-		offset -= bootdev_size;
-	}
-	if (read_completely_at(fd, slotbuf, partsize, offset) < 0) {
-		printf("[FAIL]\n");
-		perror(ent->partname);
-		return -1;
+		content = contentbuf;
+		current = slotbuf;
 	}
 	if (is_bct)
 		return (soctype == TEGRA_SOCTYPE_210
-			? update_bct_t210(bootfd, (initialize ? NULL : slotbuf), contentbuf, ent, bctctx)
-			: update_bct(bootfd, (initialize ? NULL : slotbuf), contentbuf, ent));
+			? update_bct_t210(bootfd, (initialize ? NULL : current), content, ent, bctctx)
+			: update_bct(bootfd, (initialize ? NULL : current), content, ent));
 
-	if (memcmp(contentbuf, slotbuf, ent->length) == 0) {
+	if (ent->staged_content != NULL ? ent->staged_match : memcmp(content, current, ent->length) == 0) {
 		printf("[no update needed]\n");
 		return 0;
 	}
 
-	if (write_completely_at(fd, contentbuf, ent->length, offset, partsize) < 0) {
+	if ((ent->staged_content != NULL
+	     ? write_completely_at(fd, content, partsize, offset, 0)
+	     : write_completely_at(fd, content, ent->length, offset, partsize)) < 0) {
 		printf("[FAIL]\n");
 		perror(ent->partname);
 		return -1;
 	}
 
-	fsync(fd);
-	printf("[OK]\n");
+	flush_or_defer(fd, false, ent);
+	print_ok();
 	return 0;
 
 } /* maybe_update_bootpart */
 
+/*
+ * stage_critical_entries
+ *
+ * For tegra186/tegra194 platforms, loads everything needed for
+ * the BCT and mb1 updates before any writes are made: the new
+ * content (padded with zeros to the partition size) and the
+ * current partition contents, in buffers locked into memory.
+ * The BCT update is validated and the mb1 contents compared
+ * here, so the critical part of the update (from the first
+ * BCT write through the last mb1 write) consists only of the
+ * writes and flushes.
+ *
+ * Failure to lock the buffers is not fatal.
+ *
+ * bootfd: file descriptor for the boot device
+ * gptfd:  file descriptor for the "GPT" device
+ * ents:   array of pointers to the critical entries
+ * count:  number of entries in the array
+ * initialize: non-zero if initializing (skip BCT validation)
+ *
+ * Returns: 0 on success, -1 on error (errno not set)
+ *
+ */
+static int
+stage_critical_entries (int bootfd, int gptfd, struct update_entry_s **ents,
+			unsigned int count, int initialize)
+{
+	size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	size_t partsize, bufsize, total;
+	uint8_t *bufp;
+	unsigned int i, j;
+	ssize_t n;
+	off_t offset;
+	int fd;
+
+	/*
+	 * The multiple BCT entries all refer to the same partition,
+	 * so only one copy of its current contents is needed.
+	 */
+	for (i = 0, total = 0; i < count; i++) {
+		partsize = (ents[i]->part->last_lba - ents[i]->part->first_lba + 1) * lba_size;
+		if (ents[i]->length > partsize) {
+			fprintf(stderr, "Error: BUP contents too large for %s partition\n", ents[i]->partname);
+			return -1;
+		}
+		for (j = 0; j < i && ents[j]->part != ents[i]->part; j++);
+		total += (j < i ? 1 : 2) * (pagesize * ((partsize + pagesize - 1) / pagesize));
+	}
+	if (total == 0)
+		return 0;
+	critical_buffers = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (critical_buffers == MAP_FAILED) {
+		critical_buffers = NULL;
+		perror("allocating BCT/mb1 buffers");
+		return -1;
+	}
+	critical_buffers_size = total;
+	if (mlock(critical_buffers, critical_buffers_size) == 0)
+		critical_buffers_locked = true;
+	else
+		fprintf(stderr, "Warning: could not lock BCT/mb1 buffers in memory: %s\n", strerror(errno));
+
+	for (i = 0, bufp = critical_buffers; i < count; i++) {
+		struct update_entry_s *ent = ents[i];
+		partsize = (ent->part->last_lba - ent->part->first_lba + 1) * lba_size;
+		bufsize = pagesize * ((partsize + pagesize - 1) / pagesize);
+		ent->staged_content = bufp;
+		bufp += bufsize;
+		for (j = 0; j < i && ents[j]->part != ent->part; j++);
+		if (j < i)
+			ent->staged_current = ents[j]->staged_current;
+		else {
+			ent->staged_current = bufp;
+			bufp += bufsize;
+		}
+		if (bup_setpos(ent->bupctx, ent->bup_offset) == (off_t) -1) {
+			fprintf(stderr, "could not set position for %s\n", ent->partname);
+			return -1;
+		}
+		for (total = 0; total < ent->length; total += n) {
+			n = bup_read(ent->bupctx, ent->staged_content + total, ent->length - total);
+			if (n <= 0) {
+				fprintf(stderr, "error reading content for %s\n", ent->partname);
+				return -1;
+			}
+		}
+		if (j >= i) {
+			if (locate_bootpart(bootfd, gptfd, ent, &fd, &offset) < 0)
+				return -1;
+			if (read_completely_at(fd, ent->staged_current, partsize, offset) < 0) {
+				perror(ent->partname);
+				return -1;
+			}
+		}
+		if (strcmp(ent->partname, "BCT") == 0) {
+			if (!initialize &&
+			    ((soctype == TEGRA_SOCTYPE_186 && !bct_update_valid_t18x(ent->staged_current, ent->staged_content)) ||
+			     (soctype == TEGRA_SOCTYPE_194 && !bct_update_valid_t19x(ent->staged_current, ent->staged_content)))) {
+				fprintf(stderr, "Error: validation check failed for BCT update\n");
+				return -1;
+			}
+		} else
+			ent->staged_match = memcmp(ent->staged_content, ent->staged_current, ent->length) == 0;
+	}
+	return 0;
+
+} /* stage_critical_entries */
+
+/*
+ * release_critical_buffers
+ *
+ * Unlocks and frees the buffers set up by
+ * stage_critical_entries().
+ *
+ * Returns: nothing
+ *
+ */
+static void
+release_critical_buffers (void)
+{
+	if (critical_buffers == NULL)
+		return;
+	if (critical_buffers_locked)
+		munlock(critical_buffers, critical_buffers_size);
+	munmap(critical_buffers, critical_buffers_size);
+	critical_buffers = NULL;
+	critical_buffers_locked = false;
+
+} /* release_critical_buffers */
+
 /*
  * process_entry
  *
  * Processes an entry from the update payload.
  *
- * bupctx: context pointer for the open BUP payload
  * bootfd: file descriptor for the boot device
  * gptfd:  file descriptor for the "GPT" device
  * ent:    pointer to update payload entry to process
@@ -542,27 +1273,43 @@ maybe_update_bootpart (int bootfd, int gptfd, struct update_entry_s *ent,
  *
  */
 static int
-process_entry (bup_context_t *bupctx, int bootfd, int gptfd, struct update_entry_s *ent,
+process_entry (int bootfd, int gptfd, struct update_entry_s *ent,
 	       bool dryrun, int initialize, int *bctctx)
 {
 	ssize_t total, n;
 	unsigned int erase_size;
 	int fd;
 
-	printf("  Processing %s... ", ent->partname);
-	fflush(stdout);
-	if (bup_setpos(bupctx, ent->bup_offset) == (off_t) -1) {
-		printf("[FAIL]\n");
-		fprintf(stderr, "could not set position for %s\n", ent->partname);
+	writing_critical_entry = is_critical_part(ent->partname);
+	if (safe_point(-1) < 0) {
+		perror("flushing updated partitions");
 		return -1;
 	}
-	for (total = 0; total < ent->length; total += n) {
-		n = bup_read(bupctx, contentbuf + total, contentbuf_size - total);
-		if (n <= 0) {
+	printf("  Processing %s... ", ent->partname);
+	fflush(stdout);
+	zero_bytes_skipped = 0;
+	/*
+	 * The BCT and mb1 copies are always read back in full
+	 */
+	verify_whole_entry = is_critical_part(ent->partname);
+	/*
+	 * BCT/mb1 content may already have been loaded
+	 * by stage_critical_entries()
+	 */
+	if (ent->staged_content == NULL) {
+		if (bup_setpos(ent->bupctx, ent->bup_offset) == (off_t) -1) {
 			printf("[FAIL]\n");
-			fprintf(stderr, "error reading content for %s\n", ent->partname);
+			fprintf(stderr, "could not set position for %s\n", ent->partname);
 			return -1;
 		}
+		for (total = 0; total < ent->length; total += n) {
+			n = bup_read(ent->bupctx, contentbuf + total, contentbuf_size - total);
+			if (n <= 0) {
+				printf("[FAIL]\n");
+				fprintf(stderr, "error reading content for %s\n", ent->partname);
+				return -1;
+			}
+		}
 	}
 
 	if (dryrun) {
@@ -587,13 +1334,6 @@ process_entry (bup_context_t *bupctx, int bootfd, int gptfd, struct update_entry
 		return -1;
 	}
 
-	if (lseek(fd, 0, SEEK_SET) < 0) {
-		printf("[FAIL]\n");
-		perror(ent->devname);
-		close(fd);
-		return -1;
-	}
-
 	if (write_completely_at(fd, contentbuf, ent->length, 0, erase_size) < 0) {
 		printf("[FAIL]\n");
 		perror(ent->devname);
@@ -601,9 +1341,8 @@ process_entry (bup_context_t *bupctx, int bootfd, int gptfd, struct update_entry
 		return -1;
 	}
 
-	fsync(fd);
-	close(fd);
-	printf("[OK]\n");
+	flush_or_defer(fd, true, ent);
+	print_ok();
 	return 0;
 
 } /* process_entry */
@@ -619,9 +1358,10 @@ process_entry (bup_context_t *bupctx, int bootfd, int gptfd, struct update_entry
  * ordered: array of pointers to be filled by this function
  * count: length of the arrays
  *
- * Returns: nothing
+ * Returns: 0 on success, -1 if an entry could not be
+ *          placed (e.g., more than one mb1 entry)
  */
-static void
+static int
 order_entries (struct update_entry_s *orig, struct update_entry_s **ordered, unsigned int count)
 {
 	int mb1, mb1_b, bct, bct1, bct2, mb2, mb2_b;
@@ -665,8 +1405,11 @@ order_entries (struct update_entry_s *orig, struct update_entry_s **ordered, uns
 	if (mb1_b >= 0)
 		ordered[j++] = &orig[mb1_b];
 
-	if (j != count)
-		fprintf(stderr, "Warning: ordered entry list mismatch\n");
+	if (j != count) {
+		fprintf(stderr, "Error: ordered entry list mismatch\n");
+		return -1;
+	}
+	return 0;
 
 } /* order_entries */
 
@@ -778,8 +1521,8 @@ nvc_parts_match (int bootfd, int gptfd, struct update_entry_s *nvc[2])
 
 	for (i = 0; i < 2; i++) {
 		fd = bootfd;
-		offset = nvc[i]->part->first_lba * 512;
-		partsize = (nvc[i]->part->last_lba - nvc[i]->part->first_lba + 1) * 512;
+		offset = nvc[i]->part->first_lba * lba_size;
+		partsize = (nvc[i]->part->last_lba - nvc[i]->part->first_lba + 1) * lba_size;
 		if (offset >= bootdev_size) {
 			fd = gptfd;
 			offset -= bootdev_size;
@@ -804,7 +1547,6 @@ nvc_parts_match (int bootfd, int gptfd, struct update_entry_s *nvc[2])
  *
  * Logic should be equivalent to that in the L4T updater script.
  *
- * bupctx: BUP context pointer
  * bootfd: fd for the boot device
  * gptfd:  fd for the GPT device
  * entry_list: list of BUP entries to be processed
@@ -816,7 +1558,7 @@ nvc_parts_match (int bootfd, int gptfd, struct update_entry_s *nvc[2])
  *    false: OK to apply the update
  */
 static bool
-invalid_version_or_downgrade (bup_context_t *bupctx, int bootfd, int gptfd,
+invalid_version_or_downgrade (int bootfd, int gptfd,
 			      struct update_entry_s *entry_list, size_t entry_count,
 			      bool force_initialize)
 {
@@ -851,12 +1593,12 @@ invalid_version_or_downgrade (bup_context_t *bupctx, int bootfd, int gptfd,
 	/*
 	 * Read the version info from the payload
 	 */
-	if (bup_setpos(bupctx, ver[0]->bup_offset) == (off_t) -1) {
+	if (bup_setpos(ver[0]->bupctx, ver[0]->bup_offset) == (off_t) -1) {
 		fprintf(stderr, "Error: could not find version info in BUP payload\n");
 		return true;
 	}
 	for (total = 0; total < ver[0]->length; total += n) {
-		n = bup_read(bupctx, contentbuf + total, contentbuf_size - total);
+		n = bup_read(ver[0]->bupctx, contentbuf + total, contentbuf_size - total);
 		if (n <= 0) {
 			fprintf(stderr, "Error reading version info from BUP payload");
 			return true;
@@ -878,12 +1620,12 @@ invalid_version_or_downgrade (bup_context_t *bupctx, int bootfd, int gptfd,
 			return true;
 		}
 		fd = bootfd;
-		offset = ver[i]->part->first_lba * 512;
+		offset = ver[i]->part->first_lba * lba_size;
 		if (offset >= bootdev_size) {
 			fd = gptfd;
 			offset -= bootdev_size;
 		}
-		partsize = (ver[i]->part->last_lba - ver[i]->part->first_lba + 1) * 512;
+		partsize = (ver[i]->part->last_lba - ver[i]->part->first_lba + 1) * lba_size;
 		if (read_completely_at(fd, slotbuf, partsize, offset) < 0) {
 			fprintf(stderr, "Error reading %s partition: %s\n", ver[i]->partname, strerror(errno));
 			return true;
@@ -989,7 +1731,7 @@ find_largest_partition (size_t *sizep)
 	for (i = 0; i < redundant_entry_count; i++) {
 		struct update_entry_s *ent = &redundant_entries[i];
 		if (ent->part != NULL)
-			partlen = (ent->part->last_lba - ent->part->first_lba + 1) * 512;
+			partlen = (ent->part->last_lba - ent->part->first_lba + 1) * lba_size;
 		else {
 			off_t offset;
 			int fd = open(ent->devname, O_RDONLY);
@@ -1007,7 +1749,7 @@ find_largest_partition (size_t *sizep)
 	for (i = 0; i < nonredundant_entry_count; i++) {
 		struct update_entry_s *ent = &nonredundant_entries[i];
 		if (ent->part != NULL)
-			partlen = (ent->part->last_lba - ent->part->first_lba + 1) * 512;
+			partlen = (ent->part->last_lba - ent->part->first_lba + 1) * lba_size;
 		else {
 			off_t offset;
 			int fd = open(ent->devname, O_RDONLY);
@@ -1022,7 +1764,7 @@ find_largest_partition (size_t *sizep)
 		if (partlen > largest)
 			largest = partlen;
 	}
-	*sizep = 512 * ((largest + 511) / 512);
+	*sizep = physical_block_size * ((largest + physical_block_size - 1) / physical_block_size);
 	return 0;
 error_depart:
 	return -1;
@@ -1040,11 +1782,14 @@ main (int argc, char * const argv[])
 	bool reset_bootdev = false, reset_gptdev = false;
 	gpt_context_t *gptctx = NULL;
 	bup_context_t *bupctx = NULL;
+	bup_context_t *bupctxs[MAX_PAYLOADS];
+	unsigned int payload_count, p;
 	smd_context_t *smdctx = NULL;
 	struct update_entry_s updent;
 	void *bupiter;
 	const char *partname;
 	const char *suffix = NULL;
+	const char *pressure_cgroup = NULL;
 	const char *bootdev;
 	off_t offset;
 	size_t length;
@@ -1059,9 +1804,14 @@ main (int argc, char * const argv[])
 	bool slot_specified = false;
 	const char *missing[32];
 	struct update_entry_s *ordered_entries[MAX_ENTRIES], mb1_other;
-	unsigned int i;
+	struct update_entry_s *critical_entries[MAX_ENTRIES+1];
+	unsigned int i, critical_count;
+	struct timespec window_start, window_end;
+	bool in_critical_window = false;
 	off_t bootdev_end_offset;
 	bool check_only = false;
+	unsigned int logical, physical;
+	struct sigaction sa;
 
 	while ((c = getopt_long_only(argc, argv, shortopts, options, &which)) != -1) {
 		switch (c) {
@@ -1096,6 +1846,25 @@ main (int argc, char * const argv[])
 			case 'n':
 				dryrun = true;
 				break;
+			case 'V':
+				if (strcmp(optarg, "off") == 0)
+					verify_set_mode(VERIFY_OFF);
+				else if (strcmp(optarg, "sample") == 0)
+					verify_set_mode(VERIFY_SAMPLE);
+				else if (strcmp(optarg, "full") == 0)
+					verify_set_mode(VERIFY_FULL);
+				else {
+					fprintf(stderr, "Error: verify mode must be 'off', 'sample', or 'full'\n");
+					print_usage();
+					return 1;
+				}
+				break;
+			case 'P':
+				release_on_pause = true;
+				break;
+			case 'G':
+				pressure_cgroup = optarg;
+				break;
 			case 'N':
 				check_only = dryrun = true;
 				break;
@@ -1155,26 +1924,57 @@ main (int argc, char * const argv[])
 		return 1;
 	}
 
-	bupctx = bup_init(argv[optind]);
-	if (bupctx == NULL) {
-		perror(argv[optind]);
+	/*
+	 * Multiple payloads may be specified; their entries are merged
+	 * and applied together. With --needs-repartition, no payload
+	 * is needed, but we still need a context for the device names.
+	 */
+	payload_count = (optind < argc ? argc - optind : 1);
+	if (payload_count > MAX_PAYLOADS) {
+		fprintf(stderr, "Error: too many update payloads (maximum %u)\n", MAX_PAYLOADS);
 		return 1;
 	}
+	memset(bupctxs, 0, sizeof(bupctxs));
+	for (p = 0; p < payload_count; p++) {
+		bupctxs[p] = bup_init(argv[optind+p]);
+		if (bupctxs[p] == NULL) {
+			perror(argv[optind+p]);
+			goto reset_and_depart;
+		}
+	}
+	bupctx = bupctxs[0];
 
 	bootdev = bup_boot_device(bupctx);
 	if (strlen(bootdev) < 8) {
 		fprintf(stderr, "Error: unrecognized boot device: %s\n", bootdev);
-		bup_finish(bupctx);
-		return 1;
+		goto reset_and_depart;
 	}
 
 	if (memcmp(bootdev, "/dev/mtd", 8) == 0)
 		spiboot_platform = true;
 	else if (memcmp(bootdev, "/dev/mmc", 8) != 0) {
 		fprintf(stderr, "Error: unrecognized boot device: %s\n", bootdev);
-		bup_finish(bupctx);
-		return 1;
+		goto reset_and_depart;
 	}
+	/*
+	 * On tegra186/tegra194, only the BCT and mb1 writes need to be
+	 * individually flushed; the rest are flushed together before
+	 * the BCT is touched and before the slot switch.
+	 */
+	defer_flush = (soctype != TEGRA_SOCTYPE_210);
+	blkcache_set_limit(BLOCK_CACHE_LIMIT);
+	/*
+	 * SIGUSR1/SIGUSR2 pause and resume the update at
+	 * the next safe point
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pause_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	if (!dryrun)
+		iopressure_init(pressure_cgroup);
 
 	if (spiboot_platform)
 		gptfd = -1;
@@ -1202,12 +2002,25 @@ main (int argc, char * const argv[])
 		goto reset_and_depart;
 	}
 
-	gptctx = gpt_init(bup_gpt_device(bupctx), 512, (initialize && !dryrun) ? GPT_INIT_FOR_WRITING : 0);
+	gptctx = gpt_init(bup_gpt_device(bupctx), 0, (initialize && !dryrun) ? GPT_INIT_FOR_WRITING : 0);
 	if (gptctx == NULL) {
 		perror("boot sector GPT");
 		goto reset_and_depart;
 	}
 
+	/*
+	 * Partition offsets and sizes are in units of the
+	 * logical block size; buffers and write granularity
+	 * follow the largest physical block size.
+	 */
+	lba_size = gpt_blocksize(gptctx);
+	physical_block_size = gpt_physical_blocksize(gptctx);
+	get_block_sizes(fd, &logical, &physical);
+	if (physical > physical_block_size)
+		physical_block_size = physical;
+	if (physical_block_size > zero_skip_chunk)
+		zero_skip_chunk = physical_block_size;
+
 	if (check_only) {
 		if (soctype == TEGRA_SOCTYPE_210) {
 			/*
@@ -1284,18 +2097,20 @@ main (int argc, char * const argv[])
 		}
 	}
 
-	missing_count = bup_find_missing_entries(bupctx, missing, sizeof(missing)/sizeof(missing[0]));
-	if (missing_count < 0) {
-		fprintf(stderr, "Error checking BUP payload for missing entries\n");
-		goto reset_and_depart;
-	} else if (missing_count > 0) {
-		int m;
-		fprintf(stderr, "Error: missing entries for partition%s: %s",
-			(missing_count == 1 ? "" : "s"), missing[0]);
-		for (m = 1; m < missing_count; m++)
-			fprintf(stderr, ", %s", missing[m]);
-		fprintf(stderr, "\n       for TNSPEC %s\n", bup_tnspec(bupctx));
-		goto reset_and_depart;
+	for (p = 0; p < payload_count; p++) {
+		missing_count = bup_find_missing_entries(bupctxs[p], missing, sizeof(missing)/sizeof(missing[0]));
+		if (missing_count < 0) {
+			fprintf(stderr, "Error checking BUP payload %s for missing entries\n", argv[optind+p]);
+			goto reset_and_depart;
+		} else if (missing_count > 0) {
+			int m;
+			fprintf(stderr, "Error: %s: missing entries for partition%s: %s", argv[optind+p],
+				(missing_count == 1 ? "" : "s"), missing[0]);
+			for (m = 1; m < missing_count; m++)
+				fprintf(stderr, ", %s", missing[m]);
+			fprintf(stderr, "\n       for TNSPEC %s\n", bup_tnspec(bupctxs[p]));
+			goto reset_and_depart;
+		}
 	}
 
 	/*
@@ -1318,103 +2133,121 @@ main (int argc, char * const argv[])
 	printf("Native TNSPEC:   %s\n", bup_tnspec(bupctx));
 	if (bup_compat_spec(bupctx) != NULL)
 		printf("Compatible with: %s\n", bup_compat_spec(bupctx));
-	while (bup_enumerate_entries(bupctx, &bupiter, &partname, &offset, &length, &version)) {
-		gpt_entry_t *part, *part_b;
-		char partname_b[64], pathname_b[PATH_MAX];
-
-		sprintf(partname_b, redundant_part_format(partname), partname);
-		memset(&updent, 0, sizeof(updent));
-		strcpy(updent.partname, partname);
-		updent.bup_offset = offset;
-		updent.length = length;
-		if (length > largest_length)
-			largest_length = length;
-
-		part = gpt_find_by_name(gptctx, partname);
-		if (part != NULL) {
-			/*
-			 * Partition is located in the boot device
-			 */
-			part_b = gpt_find_by_name(gptctx, partname_b);
-			if (initialize) {
-				if (part_b != NULL || strcmp(partname, "BCT") == 0) {
-					if (redundant_entry_count >= sizeof(redundant_entries)/sizeof(redundant_entries[0])) {
-						fprintf(stderr, "too many partitions to initialize\n");
-						goto reset_and_depart;
-					}
-					redundant_entries[redundant_entry_count] = updent;
-					redundant_entries[redundant_entry_count].part = part;
-					redundant_entry_count += 1;
-					if (part_b != NULL) {
+	for (p = 0, bupiter = 0; p < payload_count; p++) {
+		if (payload_count > 1)
+			printf("Payload:         %s\n", argv[optind+p]);
+		while (bup_enumerate_entries(bupctxs[p], &bupiter, &partname, &offset, &length, &version)) {
+			gpt_entry_t *part, *part_b;
+			char partname_b[64], pathname_b[PATH_MAX];
+
+			err = merge_payload_entry(bupctxs[p], argv[optind+p], partname,
+						  bup_entry_spec(bupctxs[p], bupiter), offset, length);
+			if (err < 0)
+				goto reset_and_depart;
+			if (err > 0) {
+				printf("  %s: same content in earlier payload, skipping\n", partname);
+				continue;
+			}
+			sprintf(partname_b, redundant_part_format(partname), partname);
+			memset(&updent, 0, sizeof(updent));
+			strcpy(updent.partname, partname);
+			updent.bupctx = bupctxs[p];
+			updent.bup_offset = offset;
+			updent.length = length;
+			if (length > largest_length)
+				largest_length = length;
+
+			part = gpt_find_by_name(gptctx, partname);
+			if (part != NULL) {
+				/*
+				 * Partition is located in the boot device
+				 */
+				part_b = gpt_find_by_name(gptctx, partname_b);
+				if (initialize) {
+					if (part_b != NULL || strcmp(partname, "BCT") == 0) {
+						if (redundant_entry_count + 2 > sizeof(redundant_entries)/sizeof(redundant_entries[0])) {
+							fprintf(stderr, "too many partitions to initialize\n");
+							goto reset_and_depart;
+						}
 						redundant_entries[redundant_entry_count] = updent;
-						strcpy(redundant_entries[redundant_entry_count].partname, partname_b);
-						redundant_entries[redundant_entry_count].part = part_b;
+						redundant_entries[redundant_entry_count].part = part;
 						redundant_entry_count += 1;
+						if (part_b != NULL) {
+							redundant_entries[redundant_entry_count] = updent;
+							strcpy(redundant_entries[redundant_entry_count].partname, partname_b);
+							redundant_entries[redundant_entry_count].part = part_b;
+							redundant_entry_count += 1;
+						}
+					} else {
+						if (nonredundant_entry_count >= sizeof(nonredundant_entries)/sizeof(nonredundant_entries[0])) {
+							fprintf(stderr, "too many (non-redundant) partitions to initialize\n");
+							goto reset_and_depart;
+						}
+						nonredundant_entries[nonredundant_entry_count] = updent;
+						nonredundant_entries[nonredundant_entry_count].part = part;
+						nonredundant_entry_count += 1;
 					}
-				} else {
-					if (nonredundant_entry_count >= sizeof(nonredundant_entries)/sizeof(nonredundant_entries[0])) {
-						fprintf(stderr, "too many (non-redundant) partitions to initialize\n");
+				} else if (part_b != NULL || strcmp(partname, "BCT") == 0) {
+					if (redundant_entry_count >= sizeof(redundant_entries)/sizeof(redundant_entries[0])) {
+						fprintf(stderr, "too many partitions to update\n");
 						goto reset_and_depart;
 					}
-					nonredundant_entries[nonredundant_entry_count] = updent;
-					nonredundant_entries[nonredundant_entry_count].part = part;
-					nonredundant_entry_count += 1;
-				}
-			} else if (part_b != NULL || strcmp(partname, "BCT") == 0) {
-				if (redundant_entry_count >= sizeof(redundant_entries)/sizeof(redundant_entries[0])) {
-					fprintf(stderr, "too many partitions to update\n");
-					goto reset_and_depart;
+					redundant_entries[redundant_entry_count] = updent;
+					strcpy(redundant_entries[redundant_entry_count].partname,
+					       (part_b == NULL || *suffix == '\0' ? partname : partname_b));
+					redundant_entries[redundant_entry_count].part = (part_b == NULL || *suffix == '\0' ? part : part_b);
+					/*
+					 * Save the info for the other mb1 entry, in case the BCT
+					 * was updated and we need to update both mb1's
+					 */
+					if (strcmp(partname, "mb1") == 0) {
+						mb1_other = updent;
+						strcpy(mb1_other.partname, (*suffix == '\0' ? partname_b : partname));
+						mb1_other.part = (*suffix == '\0' ? part_b : part);
+					}
+					redundant_entry_count += 1;
 				}
-				redundant_entries[redundant_entry_count] = updent;
-				strcpy(redundant_entries[redundant_entry_count].partname,
-				       (part_b == NULL || *suffix == '\0' ? partname : partname_b));
-				redundant_entries[redundant_entry_count].part = (part_b == NULL || *suffix == '\0' ? part : part_b);
+			} else {
 				/*
-				 * Save the info for the other mb1 entry, in case the BCT
-				 * was updated and we need to update both mb1's
+				 * Normal partition, not in the boot device
 				 */
-				if (strcmp(partname, "mb1") == 0) {
-					mb1_other = updent;
-					strcpy(mb1_other.partname, (*suffix == '\0' ? partname_b : partname));
-					mb1_other.part = (*suffix == '\0' ? part_b : part);
+				int redundant;
+				sprintf(pathname, "/dev/disk/by-partlabel/%s", partname);
+				if (access(pathname, F_OK|W_OK) != 0) {
+					if (partition_should_be_present(partname)) {
+						fprintf(stderr, "Error: cannot locate partition: %s\n", partname);
+						goto reset_and_depart;
+					} else
+						continue;
 				}
-				redundant_entry_count += 1;
-			}
-		} else {
-			/*
-			 * Normal partition, not in the boot device
-			 */
-			int redundant;
-			sprintf(pathname, "/dev/disk/by-partlabel/%s", partname);
-			if (access(pathname, F_OK|W_OK) != 0) {
-				if (partition_should_be_present(partname)) {
-					fprintf(stderr, "Error: cannot locate partition: %s\n", partname);
+				strcpy(pathname_b, "/dev/disk/by-partlabel/");
+				sprintf(pathname_b + strlen(pathname_b), redundant_part_format(partname), partname);
+				redundant = access(pathname_b, F_OK|W_OK) == 0;
+				if (redundant_entry_count + 2 > sizeof(redundant_entries)/sizeof(redundant_entries[0]) ||
+				    nonredundant_entry_count >= sizeof(nonredundant_entries)/sizeof(nonredundant_entries[0])) {
+					fprintf(stderr, "too many partitions to update\n");
 					goto reset_and_depart;
-				} else
-					continue;
-			}
-			strcpy(pathname_b, "/dev/disk/by-partlabel/");
-			sprintf(pathname_b + strlen(pathname_b), redundant_part_format(partname), partname);
-			redundant = access(pathname_b, F_OK|W_OK) == 0;
-			if (initialize) {
-				if (redundant) {
-					redundant_entries[redundant_entry_count] = updent;
-					strcpy(redundant_entries[redundant_entry_count].devname, pathname);
-					redundant_entry_count += 1;
+				}
+				if (initialize) {
+					if (redundant) {
+						redundant_entries[redundant_entry_count] = updent;
+						strcpy(redundant_entries[redundant_entry_count].devname, pathname);
+						redundant_entry_count += 1;
+						redundant_entries[redundant_entry_count] = updent;
+						strcpy(redundant_entries[redundant_entry_count].partname, partname_b);
+						strcpy(redundant_entries[redundant_entry_count].devname, pathname_b);
+						redundant_entry_count += 1;
+					} else {
+						nonredundant_entries[nonredundant_entry_count] = updent;
+						strcpy(nonredundant_entries[nonredundant_entry_count].devname, pathname);
+						nonredundant_entry_count += 1;
+					}
+				} else if (redundant) {
 					redundant_entries[redundant_entry_count] = updent;
-					strcpy(redundant_entries[redundant_entry_count].partname, partname_b);
-					strcpy(redundant_entries[redundant_entry_count].devname, pathname_b);
+					strcpy(redundant_entries[redundant_entry_count].partname, (*suffix == '\0' ? partname : partname_b));
+					strcpy(redundant_entries[redundant_entry_count].devname, (*suffix == '\0' ? pathname : pathname_b));
 					redundant_entry_count += 1;
-				} else {
-					nonredundant_entries[nonredundant_entry_count] = updent;
-					strcpy(nonredundant_entries[nonredundant_entry_count].devname, pathname);
-					nonredundant_entry_count += 1;
 				}
-			} else if (redundant) {
-				redundant_entries[redundant_entry_count] = updent;
-				strcpy(redundant_entries[redundant_entry_count].partname, (*suffix == '\0' ? partname : partname_b));
-				strcpy(redundant_entries[redundant_entry_count].devname, (*suffix == '\0' ? pathname : pathname_b));
-				redundant_entry_count += 1;
 			}
 		}
 	}
@@ -1433,13 +2266,18 @@ main (int argc, char * const argv[])
 		nonredundant_entry_count = 0;
 	}
 
-	contentbuf = malloc(largest_length);
 	if (find_largest_partition(&slotbuf_size) < 0) {
 		fprintf(stderr, "Error obtaining partition sizes\n");
 		goto reset_and_depart;
 	}
-	slotbuf = malloc(slotbuf_size);
-	zerobuf = calloc(1, slotbuf_size);
+	if (posix_memalign((void **) &contentbuf, physical_block_size, largest_length) != 0)
+		contentbuf = NULL;
+	if (posix_memalign((void **) &slotbuf, physical_block_size, slotbuf_size) != 0)
+		slotbuf = NULL;
+	if (posix_memalign((void **) &zerobuf, physical_block_size, slotbuf_size) != 0)
+		zerobuf = NULL;
+	else
+		memset(zerobuf, 0, slotbuf_size);
 	if (contentbuf == NULL || slotbuf == NULL || zerobuf == NULL) {
 		perror("allocating content buffers");
 		goto reset_and_depart;
@@ -1448,24 +2286,75 @@ main (int argc, char * const argv[])
 
 	if (soctype == TEGRA_SOCTYPE_210) {
 		int bctctx = -1;
-		if (invalid_version_or_downgrade(bupctx, fd, gptfd, redundant_entries, redundant_entry_count, (initialize > 1)))
+		if (invalid_version_or_downgrade(fd, gptfd, redundant_entries, redundant_entry_count, (initialize > 1)))
 			goto reset_and_depart;
 		redundant_entry_count = order_entries_t210(redundant_entries, ordered_entries, redundant_entry_count);
 		if (redundant_entry_count == 0)
 			goto reset_and_depart;
 		for (i = 0; i < redundant_entry_count; i++)
-			if (process_entry(bupctx, fd, gptfd, ordered_entries[i], dryrun, initialize, &bctctx) != 0)
+			if (process_entry(fd, gptfd, ordered_entries[i], dryrun, initialize, &bctctx) != 0)
 				goto reset_and_depart;
+		if (verify_pending() < 0) {
+			fprintf(stderr, "Error: read-back verification failed\n");
+			goto reset_and_depart;
+		}
 	} else {
-		order_entries(redundant_entries, ordered_entries, redundant_entry_count);
+		if (order_entries(redundant_entries, ordered_entries, redundant_entry_count) < 0)
+			goto reset_and_depart;
 
-		for (i = 0; i < redundant_entry_count; i++)
-			if (process_entry(bupctx, fd, gptfd, ordered_entries[i], dryrun, initialize, NULL) != 0)
+		/*
+		 * Load and check everything needed for the BCT and mb1
+		 * updates before writing anything, to keep the window
+		 * between the first BCT write and the last mb1 write
+		 * as short as possible.
+		 */
+		for (i = 0, critical_count = 0; i < redundant_entry_count; i++)
+			if (is_critical_part(ordered_entries[i]->partname) && ordered_entries[i]->part != NULL)
+				critical_entries[critical_count++] = ordered_entries[i];
+		if (!initialize && mb1_other.part != NULL)
+			critical_entries[critical_count++] = &mb1_other;
+		if (stage_critical_entries(fd, gptfd, critical_entries, critical_count, initialize) < 0)
+			goto reset_and_depart;
+
+		for (i = 0; i < redundant_entry_count; i++) {
+			if (is_critical_part(ordered_entries[i]->partname)) {
+				/*
+				 * Everything written so far must be on the device
+				 * before we start on the BCT and mb1.
+				 */
+				if (flush_pending_writes() < 0) {
+					perror("flushing updated partitions");
+					goto reset_and_depart;
+				}
+				/*
+				 * Check what has been written so far before
+				 * starting, but leave the BCT and mb1 checks
+				 * until after the last mb1 write, to keep the
+				 * window short.
+				 */
+				if (!in_critical_window && verify_pending() < 0) {
+					fprintf(stderr, "Error: read-back verification failed\n");
+					goto reset_and_depart;
+				}
+				if (!in_critical_window) {
+					clock_gettime(CLOCK_MONOTONIC, &window_start);
+					in_critical_window = true;
+					critical_window_open = true;
+				}
+			}
+			if (process_entry(fd, gptfd, ordered_entries[i], dryrun, initialize, NULL) != 0)
 				goto reset_and_depart;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &window_end);
+		/*
+		 * mb1_b, if it still needs updating, is part of the window
+		 */
+		if (initialize || !bct_updated)
+			critical_window_open = false;
 
 		if (initialize) {
 			for (i = 0; i < nonredundant_entry_count; i++)
-				if (process_entry(bupctx, fd, gptfd, &nonredundant_entries[i], dryrun, initialize, NULL) != 0)
+				if (process_entry(fd, gptfd, &nonredundant_entries[i], dryrun, initialize, NULL) != 0)
 					goto reset_and_depart;
 		} else if (bct_updated) {
 			/*
@@ -1475,8 +2364,28 @@ main (int argc, char * const argv[])
 				fprintf(stderr, "Error: could not update alternate mb1 partition\n");
 				goto reset_and_depart;
 			}
-			if (process_entry(bupctx, fd, gptfd, &mb1_other, dryrun, initialize, NULL) != 0)
+			if (process_entry(fd, gptfd, &mb1_other, dryrun, initialize, NULL) != 0)
 				goto reset_and_depart;
+			clock_gettime(CLOCK_MONOTONIC, &window_end);
+		}
+		critical_window_open = false;
+		if (in_critical_window && !dryrun) {
+			long usec = (window_end.tv_sec - window_start.tv_sec) * 1000000L +
+				(window_end.tv_nsec - window_start.tv_nsec) / 1000L;
+			printf("BCT/mb1 update window: %ld.%03ld ms\n", usec / 1000L, usec % 1000L);
+		}
+		if (flush_pending_writes() < 0) {
+			perror("flushing updated partitions");
+			goto reset_and_depart;
+		}
+		/*
+		 * Nothing gets marked active unless everything
+		 * written reads back correctly.
+		 */
+		if (verify_pending() < 0) {
+			fprintf(stderr, "Error: read-back verification failed, not switching boot slots\n");
+			print_verify_stats();
+			goto reset_and_depart;
 		}
 		if (!slot_specified) {
 			if (dryrun)
@@ -1494,12 +2403,20 @@ main (int argc, char * const argv[])
 		}
 	}
 
+	print_cache_stats();
+	print_verify_stats();
+	print_pause_stats();
+	print_pressure_stats();
+
 	/*
 	 * Success if we get through all of the above
 	 */
 	ret = 0;
 
   reset_and_depart:
+	flush_pending_writes();
+	verify_discard();
+	release_critical_buffers();
 	if (smdctx)
 		smd_finish(smdctx);
 	if (fd >= 0) {
@@ -1524,8 +2441,11 @@ main (int argc, char * const argv[])
 
 	if (gptctx)
 		gpt_finish(gptctx);
-	if (bupctx)
-		bup_finish(bupctx);
+	blkcache_set_limit(0);
+	iopressure_finish();
+	for (p = 0; p < MAX_PAYLOADS; p++)
+		if (bupctxs[p])
+			bup_finish(bupctxs[p]);
 
 	return ret;
 
@@ -0,0 +1,294 @@
+/*
+ * tegra-bup-catalog.c
+ *
+ * Tool for maintaining and querying an index of the
+ * BUP payloads in a directory.  See the documentation
+ * for more detail.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include "bupcatalog.h"
+#include "ver.h"
+#include "config.h"
+
+static struct option options[] = {
+	{ "update",		required_argument,	0, 'u' },
+	{ "jobs",		required_argument,	0, 'j' },
+	{ "list",		no_argument,		0, 'l' },
+	{ "find",		required_argument,	0, 'f' },
+	{ "min-version",	required_argument,	0, 'm' },
+	{ "newest",		no_argument,		0, 'n' },
+	{ "help",		no_argument,		0, 'h' },
+	{ "version",		no_argument,		0, 0   },
+	{ 0,			0,			0, 0   }
+};
+static const char *shortopts = ":u:j:lf:m:nh";
+
+static char *optarghelp[] = {
+	"--update DIR         ",
+	"--jobs N             ",
+	"--list               ",
+	"--find TNSPEC        ",
+	"--min-version X.Y.Z  ",
+	"--newest             ",
+	"--help               ",
+	"--version            ",
+};
+
+static char *opthelp[] = {
+	"create or refresh the index from the payloads in DIR",
+	"parse up to N payloads in parallel (default: one per CPU)",
+	"list the payloads in the index",
+	"list the payloads covering TNSPEC, newest first",
+	"skip payloads older than BSP version X.Y.Z (for use with --find)",
+	"print only the path of the newest payload (for use with --find)",
+	"display this help text",
+	"display version information"
+};
+
+/*
+ * print_usage
+ */
+static void
+print_usage (void)
+{
+	int i;
+	printf("\nUsage:\n");
+	printf("\ttegra-bup-catalog <option> <index-file>\n");
+	printf("Options:\n");
+	for (i = 0; i < sizeof(options)/sizeof(options[0]) && options[i].name != 0; i++) {
+		printf(" %s\t%c%c\t%s\n",
+		       optarghelp[i],
+		       (options[i].val == 0 ? ' ' : '-'),
+		       (options[i].val == 0 ? ' ' : options[i].val),
+		       opthelp[i]);
+	}
+
+} /* print_usage */
+
+/*
+ * parse_bsp_version
+ *
+ * Parses a version string of the form X.Y.Z
+ * (or X.Y).
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+parse_bsp_version (const char *str, unsigned int *bsp_version)
+{
+	unsigned int major, minor, maint = 0;
+	int n;
+
+	n = sscanf(str, "%u.%u.%u", &major, &minor, &maint);
+	if (n < 2)
+		return -1;
+	*bsp_version = make_bsp_version(major, minor, maint);
+	return 0;
+
+} /* parse_bsp_version */
+
+/*
+ * update_catalog
+ */
+static int
+update_catalog (const char *indexpath, const char *dirpath, unsigned int jobs)
+{
+	bup_catalog_update_stats_t stats;
+
+	if (bup_catalog_update(indexpath, dirpath, jobs, &stats) < 0) {
+		perror(indexpath);
+		return 1;
+	}
+	printf("%u payload%s indexed (%u parsed, %u unchanged), %u removed, %u skipped\n",
+	       stats.payloads, (stats.payloads == 1 ? "" : "s"), stats.scanned, stats.reused,
+	       stats.removed, stats.skipped);
+	return 0;
+
+} /* update_catalog */
+
+/*
+ * list_catalog
+ */
+static int
+list_catalog (bup_catalog_t *cat)
+{
+	bup_catalog_payload_t info;
+	bup_catalog_entry_t entry;
+	char timestr[64];
+	unsigned int i, j, bsp_version;
+	struct tm tm;
+
+	printf("Directory: %s\n", bup_catalog_directory(cat));
+	for (i = 0; bup_catalog_payload_info(cat, i, &info); i++) {
+		for (j = 0, bsp_version = 0; bup_catalog_entry_info(cat, i, j, &entry); j++)
+			if (entry.bsp_version > bsp_version)
+				bsp_version = entry.bsp_version;
+		localtime_r(&info.mtime, &tm);
+		strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+		printf("%s\n", info.name);
+		printf("  Size: %lld  Modified: %s  CRC32: %08x\n",
+		       (long long) info.size, timestr, (unsigned int) info.digest);
+		printf("  Header version: 0x%x  Entries: %u  BSP version: ",
+		       info.header_version, info.entry_count);
+		if (bsp_version == 0)
+			printf("unknown\n");
+		else
+			printf("%u.%u.%u\n", bsp_version_major(bsp_version),
+			       bsp_version_minor(bsp_version), bsp_version_maint(bsp_version));
+	}
+	return 0;
+
+} /* list_catalog */
+
+/*
+ * find_payloads
+ */
+static int
+find_payloads (bup_catalog_t *cat, const char *tnspec, unsigned int min_bsp_version, bool newest)
+{
+	bup_catalog_match_t *matches;
+	bup_catalog_payload_t info;
+	unsigned int i;
+	int count;
+
+	matches = calloc(bup_catalog_payload_count(cat) + 1, sizeof(bup_catalog_match_t));
+	if (matches == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	count = bup_catalog_find(cat, tnspec, min_bsp_version, matches, bup_catalog_payload_count(cat));
+	if (count == 0) {
+		fprintf(stderr, "No payload found for %s\n", tnspec);
+		free(matches);
+		return 1;
+	}
+	for (i = 0; i < (newest ? 1 : count); i++) {
+		bup_catalog_payload_info(cat, matches[i].payload, &info);
+		if (newest || matches[i].bsp_version == 0)
+			printf("%s/%s\n", bup_catalog_directory(cat), info.name);
+		else
+			printf("%s/%s\t%u.%u.%u\n", bup_catalog_directory(cat), info.name,
+			       bsp_version_major(matches[i].bsp_version),
+			       bsp_version_minor(matches[i].bsp_version),
+			       bsp_version_maint(matches[i].bsp_version));
+	}
+	free(matches);
+	return 0;
+
+} /* find_payloads */
+
+/*
+ * main program
+ */
+int
+main (int argc, char * const argv[])
+{
+
+	int c, which, ret;
+	char *dirpath = NULL, *tnspec = NULL, *end;
+	unsigned int jobs = 0, min_bsp_version = 0;
+	bool newest = false;
+	bup_catalog_t *cat;
+	enum {
+		nocmd,
+		update,
+		list,
+		find,
+	} cmd = nocmd;
+
+	if (argc < 2) {
+		print_usage();
+		return 1;
+	}
+
+	while ((c = getopt_long_only(argc, argv, shortopts, options, &which)) != -1) {
+
+		switch (c) {
+		case 'h':
+			print_usage();
+			return 0;
+		case 'u':
+		case 'l':
+		case 'f':
+			if (cmd != nocmd) {
+				fprintf(stderr, "Error: only one of -u/-l/-f permitted\n");
+				print_usage();
+				return 1;
+			}
+			if (c == 'u') {
+				cmd = update;
+				dirpath = optarg;
+			} else if (c == 'f') {
+				cmd = find;
+				tnspec = optarg;
+			} else
+				cmd = list;
+			break;
+		case 'j':
+			jobs = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "Error: invalid job count: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			if (parse_bsp_version(optarg, &min_bsp_version) < 0) {
+				fprintf(stderr, "Error: invalid version: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			newest = true;
+			break;
+		case 0:
+			if (strcmp(options[which].name, "version") == 0) {
+				printf("%s\n", VERSION);
+				return 0;
+			}
+			/* fallthrough */
+		default:
+			fprintf(stderr, "Error: unrecognized option\n");
+			print_usage();
+			return 1;
+		} /* switch (c) */
+
+	} /* while getopt */
+
+	if (cmd == nocmd) {
+		print_usage();
+		return 1;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Error: missing index file name\n");
+		print_usage();
+		return 1;
+	}
+
+	if (cmd == update)
+		return update_catalog(argv[optind], dirpath, jobs);
+
+	cat = bup_catalog_open(argv[optind]);
+	if (cat == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (cmd == list)
+		ret = list_catalog(cat);
+	else
+		ret = find_payloads(cat, tnspec, min_bsp_version, newest);
+	bup_catalog_close(cat);
+	return ret;
+
+} /* main */
@@ -7,11 +7,15 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include "util.h"
 
 #define MAX_PARTITIONS 256
@@ -117,3 +121,77 @@ partition_should_be_present (const char *partname)
 	return false;
 
 } /* partition_should_be_present */
+
+/*
+ * Vector type used for scanning buffers for zeros. The
+ * generic vector extension maps onto SSE2 or NEON registers,
+ * so no target-specific intrinsics are needed.
+ */
+typedef uint64_t zscan_vec_t __attribute__((vector_size(16), may_alias));
+
+/*
+ * block_is_zero
+ *
+ * Checks whether a buffer contains only zero bytes,
+ * scanning 64 bytes per iteration once the pointer
+ * is suitably aligned.
+ *
+ * buf: pointer to buffer
+ * len: length of buffer in bytes
+ *
+ * Returns true if all bytes are zero, false otherwise.
+ */
+bool
+block_is_zero (const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	const zscan_vec_t *v;
+	zscan_vec_t acc;
+
+	for (; len > 0 && ((uintptr_t) p % sizeof(zscan_vec_t)) != 0; p++, len--)
+		if (*p != 0)
+			return false;
+	for (v = (const zscan_vec_t *) p; len >= 4 * sizeof(zscan_vec_t); v += 4, len -= 4 * sizeof(zscan_vec_t)) {
+		acc = v[0] | v[1] | v[2] | v[3];
+		if ((acc[0] | acc[1]) != 0)
+			return false;
+	}
+	for (p = (const uint8_t *) v; len > 0; p++, len--)
+		if (*p != 0)
+			return false;
+	return true;
+
+} /* block_is_zero */
+
+/*
+ * get_block_sizes
+ *
+ * Retrieves the logical and physical block sizes of
+ * a block device. For anything other than a block device
+ * (or if the device will not say), 512-byte blocks are
+ * assumed.
+ *
+ * fd: open file descriptor
+ * logicalp: pointer to logical block size result
+ * physicalp: pointer to physical block size result (may be NULL)
+ *
+ * Returns: nothing
+ */
+void
+get_block_sizes (int fd, unsigned int *logicalp, unsigned int *physicalp)
+{
+	struct stat st;
+	int logical = 512;
+	unsigned int physical = 512;
+
+	if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKSSZGET, &logical) < 0 || logical < 512)
+			logical = 512;
+		if (ioctl(fd, BLKPBSZGET, &physical) < 0 || physical < (unsigned int) logical)
+			physical = logical;
+	}
+	*logicalp = logical;
+	if (physicalp != NULL)
+		*physicalp = physical;
+
+} /* get_block_sizes */
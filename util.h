@@ -3,7 +3,10 @@
 /* Copyright (c) 2021, Matthew Madison */
 
 #include <stdbool.h>
+#include <stddef.h>
 bool set_bootdev_writeable_status(const char *bootdev, bool make_writeble);
 bool partition_should_be_present(const char *partname);
+bool block_is_zero(const void *buf, size_t len);
+void get_block_sizes(int fd, unsigned int *logicalp, unsigned int *physicalp);
 
 #endif /* util_h_included */
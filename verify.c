@@ -0,0 +1,357 @@
+/*
+ * verify.c
+ *
+ * Read-back verification of data written to the boot
+ * devices by the bootloader updater.
+ *
+ * When a region is written, CRC32 digests of its chunks
+ * are recorded from the buffer that was just written, so
+ * the content does not have to be kept or re-read from the
+ * payload. Once the writes have been flushed, the chunks
+ * are read back from the device with direct I/O, bypassing
+ * both the page cache and the block cache, and compared
+ * against the recorded digests.
+ *
+ * In sample mode, only some of the chunks of each region
+ * are read back, unless the caller asks for the whole
+ * region to be checked. In full mode, every chunk is.
+ *
+ * Copyright (c) 2023, Matthew Madison
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <zlib.h>
+#include "verify.h"
+#include "iopressure.h"
+#include "util.h"
+
+#define VERIFY_CHUNK_SIZE (64 * 1024)
+/*
+ * In sample mode, the first and last chunks of a
+ * region are checked, along with every Nth chunk.
+ */
+#define VERIFY_SAMPLE_INTERVAL 8
+
+struct verify_sample_s {
+	unsigned int index;
+	uint32_t crc;
+};
+
+struct verify_region_s {
+	struct verify_region_s *next;
+	char devname[PATH_MAX];
+	int fd;
+	bool direct;
+	off_t offset;
+	size_t length;
+	unsigned int sample_count;
+	struct verify_sample_s samples[];
+};
+
+static verify_mode_t verify_mode = VERIFY_SAMPLE;
+static struct verify_region_s *pending_head, **pending_tail = &pending_head;
+static verify_stats_t verify_stats;
+
+/*
+ * elapsed_usec
+ *
+ * Returns: microseconds elapsed since *start
+ */
+static unsigned long
+elapsed_usec (struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000L;
+
+} /* elapsed_usec */
+
+/*
+ * free_region
+ *
+ * Closes the read-back descriptor for a region
+ * and frees it.
+ *
+ * Returns: nothing
+ */
+static void
+free_region (struct verify_region_s *region)
+{
+	if (region->fd >= 0)
+		close(region->fd);
+	free(region);
+
+} /* free_region */
+
+/*
+ * verify_set_mode
+ *
+ * Sets the verification mode for subsequent writes.
+ *
+ * mode: VERIFY_OFF, VERIFY_SAMPLE (default), or VERIFY_FULL
+ *
+ * Returns: nothing
+ */
+void
+verify_set_mode (verify_mode_t mode)
+{
+	verify_mode = mode;
+
+} /* verify_set_mode */
+
+/*
+ * verify_record
+ *
+ * Records the digests for a region that has just been
+ * written, and opens the device for reading it back
+ * once the write has been flushed.
+ *
+ * fd: file descriptor the region was written through
+ * buf: the content that was written
+ * len: length of the region
+ * offset: offset of the region in the device
+ * whole: true to check every chunk, even in sample mode
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+verify_record (int fd, const void *buf, size_t len, off_t offset, bool whole)
+{
+	struct verify_region_s *region;
+	struct timespec start;
+	char fdpath[64];
+	unsigned int i, chunk_count, sample_count;
+	size_t chunk;
+	ssize_t n;
+
+	if (verify_mode == VERIFY_OFF || len == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	chunk_count = (len + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE;
+	if (whole || verify_mode == VERIFY_FULL)
+		sample_count = chunk_count;
+	else
+		sample_count = 1 + (chunk_count - 1) / VERIFY_SAMPLE_INTERVAL +
+			((chunk_count - 1) % VERIFY_SAMPLE_INTERVAL != 0 ? 1 : 0);
+	region = calloc(1, sizeof(*region) + sample_count * sizeof(region->samples[0]));
+	if (region == NULL)
+		return -1;
+	region->fd = -1;
+	/*
+	 * Open a separate descriptor for the read-back, so direct
+	 * I/O can be used without affecting the writer.
+	 */
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+	n = readlink(fdpath, region->devname, sizeof(region->devname)-1);
+	if (n < 0) {
+		free_region(region);
+		return -1;
+	}
+	region->devname[n] = '\0';
+	region->fd = open(region->devname, O_RDONLY|O_DIRECT);
+	region->direct = region->fd >= 0;
+	if (region->fd < 0)
+		region->fd = open(region->devname, O_RDONLY);
+	if (region->fd < 0) {
+		free_region(region);
+		return -1;
+	}
+	region->offset = offset;
+	region->length = len;
+	for (i = 0; i < chunk_count; i++) {
+		if (!(whole || verify_mode == VERIFY_FULL) &&
+		    i % VERIFY_SAMPLE_INTERVAL != 0 && i != chunk_count - 1)
+			continue;
+		chunk = (len - (size_t) i * VERIFY_CHUNK_SIZE < VERIFY_CHUNK_SIZE
+			 ? len - (size_t) i * VERIFY_CHUNK_SIZE : VERIFY_CHUNK_SIZE);
+		region->samples[region->sample_count].index = i;
+		region->samples[region->sample_count].crc = crc32(0, (const uint8_t *) buf + (size_t) i * VERIFY_CHUNK_SIZE, chunk);
+		region->sample_count += 1;
+	}
+	*pending_tail = region;
+	pending_tail = &region->next;
+	verify_stats.regions += 1;
+	verify_stats.chunks_written += chunk_count;
+	verify_stats.usec += elapsed_usec(&start);
+	return 0;
+
+} /* verify_record */
+
+/*
+ * read_back
+ *
+ * Reads a chunk of a region back from the device. The read
+ * is widened to the device's logical block boundaries for
+ * direct I/O. If the device will not do direct I/O for this
+ * read, falls back to a buffered read after dropping any
+ * cached pages for the range.
+ *
+ * region: region being checked
+ * abuf: aligned buffer, large enough for the widened read
+ * align: logical block size
+ * start: device offset of the chunk
+ * len: length of the chunk
+ * datap: set to point to the chunk data within abuf
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+read_back (struct verify_region_s *region, uint8_t *abuf, unsigned int align,
+	   off_t start, size_t len, uint8_t **datap)
+{
+	off_t astart = start - (start % align);
+	size_t alen = ((start - astart) + len + align - 1) / align * align;
+	size_t total;
+	ssize_t n;
+
+	for (total = 0; total < alen; total += n) {
+		n = pread(region->fd, abuf + total, alen - total, astart + total);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0 && errno == EINVAL && region->direct) {
+			close(region->fd);
+			region->fd = open(region->devname, O_RDONLY);
+			if (region->fd < 0)
+				return -1;
+			region->direct = false;
+			posix_fadvise(region->fd, region->offset, region->length, POSIX_FADV_DONTNEED);
+			verify_stats.buffered_regions += 1;
+			n = 0;
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				/*
+				 * Short read at the end of the device
+				 */
+				if (total >= (start - astart) + len)
+					break;
+				errno = EIO;
+			}
+			return -1;
+		}
+	}
+	verify_stats.bytes_read += total;
+	*datap = abuf + (start - astart);
+	return 0;
+
+} /* read_back */
+
+/*
+ * verify_pending
+ *
+ * Reads back and checks all regions recorded since
+ * the last call. The caller must have flushed the writes
+ * for those regions first.
+ *
+ * Returns: 0 if everything matched, -1 on mismatch or error
+ */
+int
+verify_pending (void)
+{
+	struct verify_region_s *region;
+	struct timespec start;
+	unsigned int i, logical, align;
+	uint8_t *abuf, *data;
+	off_t chunkstart;
+	size_t chunk;
+	int ret = 0;
+
+	if (pending_head == NULL)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((region = pending_head) != NULL) {
+		pending_head = region->next;
+		if (pending_head == NULL)
+			pending_tail = &pending_head;
+		get_block_sizes(region->fd, &logical, NULL);
+		align = (logical > 4096 ? logical : 4096);
+		if (posix_memalign((void **) &abuf, align, VERIFY_CHUNK_SIZE + 2 * align) != 0) {
+			fprintf(stderr, "Error: could not allocate read-back buffer\n");
+			free_region(region);
+			ret = -1;
+			continue;
+		}
+		/*
+		 * Buffered reads need any cached pages dropped first
+		 */
+		if (!region->direct) {
+			fdatasync(region->fd);
+			posix_fadvise(region->fd, region->offset, region->length, POSIX_FADV_DONTNEED);
+			verify_stats.buffered_regions += 1;
+		}
+		for (i = 0; i < region->sample_count; i++) {
+			chunkstart = region->offset + (off_t) region->samples[i].index * VERIFY_CHUNK_SIZE;
+			chunk = region->length - (size_t) region->samples[i].index * VERIFY_CHUNK_SIZE;
+			if (chunk > VERIFY_CHUNK_SIZE)
+				chunk = VERIFY_CHUNK_SIZE;
+			if (read_back(region, abuf, logical, chunkstart, chunk, &data) < 0) {
+				fprintf(stderr, "Error: %s: read-back at offset %llu: %s\n", region->devname,
+					(unsigned long long) chunkstart, strerror(errno));
+				ret = -1;
+				break;
+			}
+			verify_stats.chunks_checked += 1;
+			iopressure_account(chunk);
+			if (crc32(0, data, chunk) != region->samples[i].crc) {
+				fprintf(stderr, "Error: %s: read-back mismatch at offset %llu\n", region->devname,
+					(unsigned long long) chunkstart);
+				verify_stats.mismatches += 1;
+				ret = -1;
+			}
+		}
+		free(abuf);
+		free_region(region);
+	}
+	verify_stats.usec += elapsed_usec(&start);
+	return ret;
+
+} /* verify_pending */
+
+/*
+ * verify_discard
+ *
+ * Drops any regions not yet checked.
+ *
+ * Returns: nothing
+ */
+void
+verify_discard (void)
+{
+	struct verify_region_s *region;
+
+	while ((region = pending_head) != NULL) {
+		pending_head = region->next;
+		free_region(region);
+	}
+	pending_tail = &pending_head;
+
+} /* verify_discard */
+
+/*
+ * verify_get_stats
+ *
+ * Returns the read-back verification statistics.
+ *
+ * stats: pointer to structure to fill in
+ *
+ * Returns: nothing
+ */
+void
+verify_get_stats (verify_stats_t *stats)
+{
+	*stats = verify_stats;
+
+} /* verify_get_stats */
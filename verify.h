@@ -0,0 +1,32 @@
+#ifndef verify_h_included
+#define verify_h_included
+/* Copyright (c) 2023, Matthew Madison */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum {
+	VERIFY_OFF,
+	VERIFY_SAMPLE,
+	VERIFY_FULL,
+} verify_mode_t;
+
+struct verify_stats_s {
+	unsigned long regions;
+	unsigned long chunks_written;
+	unsigned long chunks_checked;
+	unsigned long mismatches;
+	unsigned long buffered_regions;
+	size_t bytes_read;
+	unsigned long usec;
+};
+typedef struct verify_stats_s verify_stats_t;
+
+void verify_set_mode(verify_mode_t mode);
+int verify_record(int fd, const void *buf, size_t len, off_t offset, bool whole);
+int verify_pending(void);
+void verify_discard(void);
+void verify_get_stats(verify_stats_t *stats);
+
+#endif /* verify_h_included */